@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "admission.h"
+#include "memory.h"
+
+// TinyLFU admission: Once memory runs out a SET has to evict an entry to make
+// room for its own, and without a filter a burst of keys that are set once and
+// never read again flushes the hot entries out.  So GET and SET requests count
+// key accesses in a Count-Min sketch and a new entry may only take the place of
+// the entry picked by the eviction clock if its key is estimated to have been
+// accessed more often.  Otherwise the SET fails as out of memory, which is why
+// it's off unless `admission' is turned on in the config.
+//
+// The sketch is a table of 64 bit words holding 16 4 bit counters each.  A key
+// has one counter in each of ADMISSION_SKETCH_DEPTH words picked by rehashing
+// its hash, and its estimate is the smallest of them.  The counters are halved
+// every ADMISSION_SAMPLE_FACTOR accesses per word so old hits fade.  Counters
+// are updated without locking and the odd lost update doesn't matter.  Each
+// worker counts accesses on a cache line of its own and only adds them to the
+// shared count every ADMISSION_COUNT_BATCH accesses.
+//
+// Entries keep their own hit count but that never fades, and misses and SETs
+// of keys that aren't mapped have to be counted too.
+
+#define COUNTER_MASK 0xFULL
+#define HALVE_MASK   0x7777777777777777ULL
+
+static u64 *sketch = NULL;
+static u32  sketch_mask = 0; // Words - 1
+static u64  sample_size = 0;
+
+typedef struct
+{
+  u32 count; // Written by its worker only
+} __attribute__ ((aligned (CACHE_LINE_SIZE))) WorkerAccesses;
+
+// One more for requests replayed from the request log, see `load_request_log'
+static WorkerAccesses worker_accesses[NUM_WORKERS + 1];
+
+static _Atomic (u64) num_accesses = 0; // Since the counters were last halved
+static _Atomic (u64) num_resets = 0;
+static _Atomic (u64) num_admitted = 0;
+static _Atomic (u64) num_rejected = 0;
+
+static tss_t current_candidate = (tss_t) -1;
+
+int
+init_admission (const RuntimeConfig *config)
+{
+  size_t size = 0x400;
+  int    err;
+
+  if (!config->admission)
+    return 0;
+
+  err = tss_create (&current_candidate, NULL);
+  cik_assert (err == thrd_success);
+  if (err != thrd_success)
+    return err;
+
+  tss_set (current_candidate, NULL);
+
+  // Largest power of two that fits
+  while (((size * 2) <= config->admission_sketch_size)
+         && ((size * 2) <= MAX_BUCKET_SIZE))
+    size *= 2;
+
+  sketch = reserve_memory (size);
+  if (!sketch)
+    return -1;
+
+  memset (sketch, 0, size);
+  sketch_mask = (size / sizeof (u64)) - 1;
+  sample_size = (u64) ADMISSION_SAMPLE_FACTOR * (sketch_mask + 1);
+
+  return 0;
+}
+
+// Spread `hash' differently for each row of the sketch
+static inline u64
+rehash (u64 hash, u32 row)
+{
+  u64 h = (hash + (((u64) row << 32) | row)) * 0x9E3779B97F4A7C15ULL;
+  return h ^ (h >> 29);
+}
+
+static inline u32
+get_word_index (u64 h)
+{
+  return (u32) h & sketch_mask;
+}
+
+static inline u32
+get_counter_shift (u64 h)
+{
+  return (u32) (h >> 60) * 4;
+}
+
+static void
+halve_counters (void)
+{
+  for (u32 i = 0; i <= sketch_mask; ++i)
+    {
+      u64 word = __atomic_load_n (&sketch[i], __ATOMIC_RELAXED);
+      __atomic_store_n (&sketch[i], (word >> 1) & HALVE_MASK,
+                        __ATOMIC_RELAXED);
+    }
+
+  atomic_fetch_add_explicit (&num_resets, 1, memory_order_relaxed);
+}
+
+// Count a GET or SET of the key with `hash' by `worker'
+void
+count_access (u32 worker, u64 hash)
+{
+  u32 *count;
+
+  if (!sketch)
+    return;
+
+  for (u32 row = 0; row < ADMISSION_SKETCH_DEPTH; ++row)
+    {
+      u64  h     = rehash (hash, row);
+      u64 *word  = &sketch[get_word_index (h)];
+      u32  shift = get_counter_shift (h);
+      u64  value = __atomic_load_n (word, __ATOMIC_RELAXED);
+
+      if (((value >> shift) & COUNTER_MASK) != COUNTER_MASK)
+        __atomic_compare_exchange_n (word, &value, value + (1ULL << shift),
+                                     false, __ATOMIC_RELAXED,
+                                     __ATOMIC_RELAXED);
+    }
+
+  count = &worker_accesses[(worker < NUM_WORKERS) ? worker : NUM_WORKERS].count;
+  if (++*count < ADMISSION_COUNT_BATCH)
+    return;
+
+  *count = 0;
+
+  // Halved counters make for half the accesses
+  if (atomic_fetch_add_explicit (&num_accesses, ADMISSION_COUNT_BATCH,
+                                 memory_order_relaxed) + ADMISSION_COUNT_BATCH
+      == sample_size)
+    {
+      halve_counters ();
+      atomic_fetch_sub_explicit (&num_accesses, sample_size / 2,
+                                 memory_order_relaxed);
+    }
+}
+
+static u32
+estimate_frequency (u64 hash)
+{
+  u32 frequency = COUNTER_MASK;
+
+  for (u32 row = 0; row < ADMISSION_SKETCH_DEPTH; ++row)
+    {
+      u64 h     = rehash (hash, row);
+      u64 value = __atomic_load_n (&sketch[get_word_index (h)],
+                                   __ATOMIC_RELAXED);
+      u32 count = (value >> get_counter_shift (h)) & COUNTER_MASK;
+      if (count < frequency)
+        frequency = count;
+    }
+
+  return frequency;
+}
+
+// Entries evicted on this thread until `end_admission' make room for the entry
+// of `key', see `admit_instead_of'
+void
+begin_admission (const CacheKey *key)
+{
+  if (sketch)
+    tss_set (current_candidate, (void *) key);
+}
+
+void
+end_admission (void)
+{
+  if (sketch)
+    tss_set (current_candidate, NULL);
+}
+
+// Called by the eviction clock for the entry it's about to evict.  Evicting
+// for anything but a new entry, like tag key lists or tables, is always fine.
+bool
+admit_instead_of (const CacheEntry *victim)
+{
+  const CacheKey *candidate;
+
+  if (!sketch)
+    return true;
+
+  candidate = tss_get (current_candidate);
+  if (!candidate)
+    return true;
+
+  if (estimate_frequency (candidate->hash)
+      > estimate_frequency (victim->key.hash))
+    {
+      atomic_fetch_add_explicit (&num_admitted, 1, memory_order_relaxed);
+      return true;
+    }
+
+  atomic_fetch_add_explicit (&num_rejected, 1, memory_order_relaxed);
+  return false;
+}
+
+void
+write_admission_stats (int fd)
+{
+  dprintf (fd, "\n%s\t%s\t%s\t%s\t%s\n",
+           "Admission", "SketchBytes", "Admitted", "Rejected", "Resets");
+  dprintf (fd, "%s\t%lu\t%lu\t%lu\t%lu\n", sketch ? "yes" : "no",
+           sketch ? (u64) (sketch_mask + 1) * sizeof (u64) : 0,
+           atomic_load (&num_admitted), atomic_load (&num_rejected),
+           atomic_load (&num_resets));
+}
@@ -0,0 +1,13 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H 1
+
+#include "types.h"
+
+int  init_admission         (const RuntimeConfig *);
+void count_access           (u32, u64);
+void begin_admission        (const CacheKey *);
+void end_admission          (void);
+bool admit_instead_of       (const CacheEntry *);
+void write_admission_stats  (int);
+
+#endif /* ! ADMISSION_H */
@@ -0,0 +1,112 @@
+#include "compact.h"
+#include "entry.h"
+#include "memory.h"
+#include "tag.h"
+
+// Incremental compaction: Each call to `compact_memory' walks a few entry maps
+// moving entries (and their value chunk lists) out of the slab being compacted
+// and once all maps are walked does the same for tag key lists.  Entries and
+// tags that are busy are skipped and caught on the next pass.  Only meant to be
+// called from the rebalancer thread.
+
+typedef struct
+{
+  bool active;
+  u32  map_index; // Next entry map to walk
+  u32  npasses;   // Completed walks of the whole index
+} CompactionState;
+
+static CompactionState state = {};
+
+// Returns `ptr' relative to `to' instead of `from'
+#define REBASE_POINTER(ptr, from, to) \
+  ((void *) ((u8 *) (to) + ((u8 *) (ptr) - (u8 *) (from))))
+
+static CacheEntry *
+move_entry_callback (CacheEntry *entry, void *unused)
+{
+  CacheEntry *moved;
+
+  (void) unused;
+
+  if (entry->value.chunked)
+    {
+      ValueChunks *chunks = entry->value.chunks;
+
+      // New references are only taken while holding the entry so if we're the
+      // only one no GET request is streaming them.
+      if (atomic_load (&chunks->refs) == 1)
+        {
+          ValueChunks *moved_chunks = move_memory (chunks);
+          if (moved_chunks)
+            entry->value.chunks = chunks = moved_chunks;
+
+          for (u32 i = 0; i < chunks->nchunks; ++i)
+            {
+              u8 *chunk = move_memory (chunks->chunks[i]);
+              if (chunk)
+                chunks->chunks[i] = chunk;
+            }
+        }
+    }
+
+  moved = move_memory (entry);
+  if (!moved)
+    return entry;
+
+  // Key, tags and small values are stored right after the entry
+  moved->key.base  = REBASE_POINTER (entry->key.base, entry, moved);
+  moved->tags.base = REBASE_POINTER (entry->tags.base, entry, moved);
+  for (u8 t = 0; t < moved->tags.nmemb; ++t)
+    {
+      CacheTag *tag = &moved->tags.base[t];
+      tag->base = REBASE_POINTER (tag->base, entry, moved);
+    }
+  if (!moved->value.chunked)
+    moved->value.base = REBASE_POINTER (entry->value.base, entry, moved);
+
+  return moved; // Still locked since we copied the lock too
+}
+
+// Do a bounded amount of compaction work.  Returns true while a slab is being
+// compacted, meaning the caller should call again soon.
+bool
+compact_memory ()
+{
+  if (!state.active)
+    {
+      if (!begin_compaction ())
+        return false;
+
+      // The slab might hold nothing but free buckets already
+      if (try_finish_compaction (false))
+        return true;
+
+      state = (CompactionState) {
+        .active    = true,
+        .map_index = 0,
+        .npasses   = 0
+      };
+    }
+
+  for (u32 n = 0;
+       (n < COMPACTION_STEP_MAPS) && (state.map_index < NUM_CACHE_ENTRY_MAPS);
+       ++n)
+    {
+      try_move_entries (entry_maps[state.map_index++],
+                        move_entry_callback, NULL);
+    }
+
+  if (state.map_index < NUM_CACHE_ENTRY_MAPS)
+    return true;
+
+  try_move_tag_keys ();
+
+  ++state.npasses;
+  state.map_index = 0;
+
+  if (try_finish_compaction (state.npasses >= COMPACTION_MAX_PASSES))
+    state.active = false;
+
+  return true;
+}
@@ -0,0 +1,8 @@
+#ifndef COMPACT_H
+#define COMPACT_H 1
+
+#include "types.h"
+
+bool compact_memory (void);
+
+#endif /* ! COMPACT_H */
@@ -0,0 +1,235 @@
+#include <string.h>
+
+#include "compress.h"
+
+// A small LZ77 compressor writing the LZ4 block format, so clients that accept
+// compressed values can use any LZ4 library to decompress them.  A block is a
+// list of sequences of
+//
+//   u8      token     (literal length << 4 | (match length - MIN_MATCH))
+//   u8[]    ..        (literal length - 15 in 255 steps, if length >= 15)
+//   u8[]    literals
+//   u16     offset    (little endian, back from the current position)
+//   u8[]    ..        (match length - 19 in 255 steps, if length >= 19)
+//
+// where the last sequence has only literals.  The format wants the last match
+// to start MF_LIMIT bytes before the end and the last LAST_LITERALS bytes to be
+// literals.
+
+#define HASH_LOG      12
+#define MIN_MATCH     4
+#define LAST_LITERALS 5
+#define MF_LIMIT      12
+#define MAX_OFFSET    0xFFFF
+#define SKIP_TRIGGER  6 // Step faster through data that doesn't match
+
+static inline u32
+read_u32 (const u8 *p)
+{
+  u32 v;
+  memcpy (&v, p, sizeof (v));
+  return v;
+}
+
+static inline u32
+hash_u32 (u32 v)
+{
+  return (v * 2654435761U) >> (32 - HASH_LOG);
+}
+
+static inline u8 *
+write_length (u8 *op, u32 length)
+{
+  for (; length >= 0xFF; length -= 0xFF)
+    *op++ = 0xFF;
+  *op++ = (u8) length;
+  return op;
+}
+
+static inline bool
+read_length (const u8 **ip, const u8 *iend, size_t *length)
+{
+  u8 b;
+  do
+    {
+      if (*ip >= iend)
+        return false;
+      b = *(*ip)++;
+      *length += b;
+    }
+  while (b == 0xFF);
+  return true;
+}
+
+// Write a sequence of `nliterals' bytes at `literals' and, unless `match_length'
+// is 0, a match `offset' bytes back.  Returns NULL if it doesn't fit before
+// `oend'.
+static inline u8 *
+write_sequence (u8 *op, u8 *oend, const u8 *literals, u32 nliterals,
+                u32 offset, u32 match_length)
+{
+  u8 *token = op;
+
+  // Worst case: Token, length bytes for both lengths, literals and offset
+  if ((size_t) (oend - op) < (1 + (nliterals / 0xFF) + 1 + nliterals + 2
+                              + (match_length / 0xFF) + 1))
+    return NULL;
+
+  ++op;
+
+  if (nliterals >= 0xF)
+    {
+      *token = 0xF << 4;
+      op = write_length (op, nliterals - 0xF);
+    }
+  else
+    {
+      *token = nliterals << 4;
+    }
+
+  memcpy (op, literals, nliterals);
+  op += nliterals;
+
+  if (match_length == 0)
+    return op;
+
+  *op++ = offset & 0xFF;
+  *op++ = offset >> 8;
+
+  match_length -= MIN_MATCH;
+  if (match_length >= 0xF)
+    {
+      *token |= 0xF;
+      op = write_length (op, match_length - 0xF);
+    }
+  else
+    {
+      *token |= match_length;
+    }
+
+  return op;
+}
+
+// Compress `size' bytes at `src' into at most `cap' bytes at `dst'.  Returns
+// the compressed size or 0 if it didn't fit.
+u32
+compress_block (const u8 *src, u32 size, u8 *dst, u32 cap)
+{
+  u32       table[1 << HASH_LOG] = {}; // Positions in `src'
+  const u8 *ip     = src;
+  const u8 *anchor = src;
+  const u8 *end    = src + size;
+  u8       *op     = dst;
+  u8       *oend   = dst + cap;
+  u32       nmisses = 0;
+
+  if (cap == 0)
+    return 0;
+
+  if (size > MF_LIMIT)
+    {
+      const u8 *match_limit  = end - MF_LIMIT;
+      const u8 *extend_limit = end - LAST_LITERALS;
+
+      while (ip < match_limit)
+        {
+          u32       seq = read_u32 (ip);
+          u32       h   = hash_u32 (seq);
+          const u8 *ref = src + table[h];
+          const u8 *mp, *mr;
+
+          table[h] = (u32) (ip - src);
+
+          if ((ref >= ip) || ((ip - ref) > MAX_OFFSET)
+              || (read_u32 (ref) != seq))
+            {
+              ip += 1 + (nmisses++ >> SKIP_TRIGGER);
+              continue;
+            }
+
+          nmisses = 0;
+
+          while ((ip > anchor) && (ref > src) && (ip[-1] == ref[-1]))
+            --ip, --ref;
+
+          for (mp = ip + MIN_MATCH, mr = ref + MIN_MATCH;
+               (mp < extend_limit) && (*mp == *mr); ++mp, ++mr)
+            ;
+
+          op = write_sequence (op, oend, anchor, (u32) (ip - anchor),
+                               (u32) (ip - ref), (u32) (mp - ip));
+          if (!op)
+            return 0;
+
+          ip = anchor = mp;
+        }
+    }
+
+  op = write_sequence (op, oend, anchor, (u32) (end - anchor), 0, 0);
+  if (!op)
+    return 0;
+
+  return (u32) (op - dst);
+}
+
+// Decompress the `size' byte block at `src' into exactly `dst_size' bytes at
+// `dst'.  Returns false on malformed input, which is never read or written out
+// of bounds.
+bool
+decompress_block (const u8 *src, u32 size, u8 *dst, u32 dst_size)
+{
+  const u8 *ip   = src;
+  const u8 *iend = src + size;
+  u8       *op   = dst;
+  u8       *oend = dst + dst_size;
+
+  while (ip < iend)
+    {
+      u8        token        = *ip++;
+      size_t    nliterals    = token >> 4;
+      size_t    match_length = token & 0xF;
+      size_t    offset;
+      const u8 *ref;
+
+      if ((nliterals == 0xF) && !read_length (&ip, iend, &nliterals))
+        return false;
+      if ((nliterals > (size_t) (iend - ip))
+          || (nliterals > (size_t) (oend - op)))
+        return false;
+
+      memcpy (op, ip, nliterals);
+      op += nliterals;
+      ip += nliterals;
+
+      if (ip == iend)
+        break; // Last sequence
+
+      if ((iend - ip) < 2)
+        return false;
+      offset = ip[0] | (ip[1] << 8);
+      ip += 2;
+      if ((offset == 0) || (offset > (size_t) (op - dst)))
+        return false;
+
+      if ((match_length == 0xF) && !read_length (&ip, iend, &match_length))
+        return false;
+      match_length += MIN_MATCH;
+      if (match_length > (size_t) (oend - op))
+        return false;
+
+      ref = op - offset;
+      if (offset >= match_length)
+        {
+          memcpy (op, ref, match_length);
+          op += match_length;
+        }
+      else
+        {
+          // Overlapping match repeats the last `offset' bytes
+          while (match_length--)
+            *op++ = *ref++;
+        }
+    }
+
+  return op == oend;
+}
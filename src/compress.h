@@ -0,0 +1,9 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H 1
+
+#include "types.h"
+
+u32  compress_block   (const u8 *, u32, u8 *, u32);
+bool decompress_block (const u8 *, u32, u8 *, u32);
+
+#endif /* ! COMPRESS_H */
@@ -1,6 +1,8 @@
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <netdb.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -28,10 +30,26 @@ static RuntimeConfig runtime_config = {
   .tag_stats_filename       = NULL, // Disabled by default
   .memory_stats_filename    = NULL, // Disabled by default
   .client_stats_filename    = NULL, // Disabled by default
-  .worker_stats_filename    = NULL  // Disabled by default
+  .worker_stats_filename    = NULL, // Disabled by default
+  .memory_limit             = DEFAULT_MEMORY_LIMIT,
+  .huge_pages               = HUGE_PAGES_NONE,
+  .release_pages            = PAGE_RELEASE_DONTNEED,
+  .release_pages_above      = DEFAULT_RELEASE_PAGES_ABOVE,
+  .prefault_memory          = false,
+  .numa                     = false,
+  .compaction               = true,
+  .compression              = true,
+  .compression_above        = DEFAULT_COMPRESSION_ABOVE,
+  .index_load_factor        = DEFAULT_INDEX_LOAD_FACTOR,
+  .walk_threads             = DEFAULT_WALK_THREADS,
+  .active_expiry            = true,
+  .active_expiry_delay      = DEFAULT_ACTIVE_EXPIRY_DELAY,
+  .admission                = false,
+  .admission_sketch_size    = DEFAULT_ADMISSION_SKETCH_SIZE
 };
 
 bool parse_variable (const char *, int, const char *, char *);
+static bool parse_size (const char *, size_t *);
 
 RuntimeConfig *
 parse_args (int argc, char **argv)
@@ -225,6 +243,207 @@ parse_variable (const char *filename, int lineno, const char *name, char *value)
       worker_stats_filename[sizeof (worker_stats_filename) - 1] = '\0';
       runtime_config.worker_stats_filename = worker_stats_filename;
     }
+  else if (0 == strcmp(name, "memory_limit"))
+    {
+      size_t limit;
+      if (!parse_size (value, &limit) || limit == 0)
+        {
+          err_print ("Invalid memory limit '%s' in %s on line %d\n",
+                     value, filename, lineno);
+          return false;
+        }
+
+      runtime_config.memory_limit = limit;
+    }
+  else if (0 == strcmp(name, "release_pages"))
+    {
+      if (0 == strcmp (value, "none"))
+        runtime_config.release_pages = PAGE_RELEASE_NONE;
+      else if (0 == strcmp (value, "dontneed"))
+        runtime_config.release_pages = PAGE_RELEASE_DONTNEED;
+      else if (0 == strcmp (value, "free"))
+        runtime_config.release_pages = PAGE_RELEASE_FREE;
+      else
+        {
+          err_print ("Invalid page release mode '%s' in %s on line %d"
+                     " (expected none, dontneed or free)\n",
+                     value, filename, lineno);
+          return false;
+        }
+    }
+  else if (0 == strcmp(name, "release_pages_above"))
+    {
+      size_t size;
+      if (!parse_size (value, &size))
+        {
+          err_print ("Invalid size '%s' for release_pages_above in %s"
+                     " on line %d\n", value, filename, lineno);
+          return false;
+        }
+
+      runtime_config.release_pages_above = size;
+    }
+  else if (0 == strcmp(name, "huge_pages"))
+    {
+      if (0 == strcmp (value, "none"))
+        runtime_config.huge_pages = HUGE_PAGES_NONE;
+      else if (0 == strcmp (value, "transparent"))
+        runtime_config.huge_pages = HUGE_PAGES_TRANSPARENT;
+      else if (0 == strcmp (value, "explicit"))
+        runtime_config.huge_pages = HUGE_PAGES_EXPLICIT;
+      else
+        {
+          err_print ("Invalid huge page mode '%s' in %s on line %d"
+                     " (expected none, transparent or explicit)\n",
+                     value, filename, lineno);
+          return false;
+        }
+    }
+  else if (0 == strcmp(name, "prefault_memory"))
+    {
+      if (0 == strcmp (value, "yes"))
+        runtime_config.prefault_memory = true;
+      else if (0 == strcmp (value, "no"))
+        runtime_config.prefault_memory = false;
+      else
+        {
+          err_print ("Invalid value '%s' for prefault_memory in %s on line %d"
+                     " (expected yes or no)\n", value, filename, lineno);
+          return false;
+        }
+    }
+  else if (0 == strcmp(name, "numa"))
+    {
+      if (0 == strcmp (value, "yes"))
+        runtime_config.numa = true;
+      else if (0 == strcmp (value, "no"))
+        runtime_config.numa = false;
+      else
+        {
+          err_print ("Invalid value '%s' for numa in %s on line %d"
+                     " (expected yes or no)\n", value, filename, lineno);
+          return false;
+        }
+    }
+  else if (0 == strcmp(name, "compaction"))
+    {
+      if (0 == strcmp (value, "yes"))
+        runtime_config.compaction = true;
+      else if (0 == strcmp (value, "no"))
+        runtime_config.compaction = false;
+      else
+        {
+          err_print ("Invalid value '%s' for compaction in %s on line %d"
+                     " (expected yes or no)\n", value, filename, lineno);
+          return false;
+        }
+    }
+  else if (0 == strcmp(name, "compression"))
+    {
+      if (0 == strcmp (value, "yes"))
+        runtime_config.compression = true;
+      else if (0 == strcmp (value, "no"))
+        runtime_config.compression = false;
+      else
+        {
+          err_print ("Invalid value '%s' for compression in %s on line %d"
+                     " (expected yes or no)\n", value, filename, lineno);
+          return false;
+        }
+    }
+  else if (0 == strcmp(name, "index_load_factor"))
+    {
+      char  *end;
+      double load_factor = strtod (value, &end);
+      if ((end == value) || (*end != '\0')
+          || (load_factor < 0.1) || (load_factor > 0.95))
+        {
+          err_print ("Invalid load factor '%s' in %s on line %d"
+                     " (expected 0.1 to 0.95)\n", value, filename, lineno);
+          return false;
+        }
+
+      runtime_config.index_load_factor = load_factor;
+    }
+  else if (0 == strcmp(name, "compression_above"))
+    {
+      size_t size;
+      if (!parse_size (value, &size))
+        {
+          err_print ("Invalid size '%s' for compression_above in %s"
+                     " on line %d\n", value, filename, lineno);
+          return false;
+        }
+
+      runtime_config.compression_above = size;
+    }
+  else if (0 == strcmp(name, "walk_threads"))
+    {
+      char *end;
+      unsigned long nthreads = strtoul (value, &end, 10);
+      if ((end == value) || (*end != '\0') || (nthreads > MAX_WALK_THREADS))
+        {
+          err_print ("Invalid thread count '%s' for walk_threads in %s"
+                     " on line %d (expected 0 to %d)\n", value, filename,
+                     lineno, MAX_WALK_THREADS);
+          return false;
+        }
+
+      runtime_config.walk_threads = (u32) nthreads;
+    }
+  else if (0 == strcmp(name, "active_expiry"))
+    {
+      if (0 == strcmp (value, "yes"))
+        runtime_config.active_expiry = true;
+      else if (0 == strcmp (value, "no"))
+        runtime_config.active_expiry = false;
+      else
+        {
+          err_print ("Invalid value '%s' for active_expiry in %s on line %d"
+                     " (expected yes or no)\n", value, filename, lineno);
+          return false;
+        }
+    }
+  else if (0 == strcmp(name, "active_expiry_delay"))
+    {
+      char *end;
+      unsigned long delay = strtoul (value, &end, 10);
+      if ((end == value) || (*end != '\0') || (delay > 0xFFFFFFFF))
+        {
+          err_print ("Invalid number of seconds '%s' for active_expiry_delay"
+                     " in %s on line %d\n", value, filename, lineno);
+          return false;
+        }
+
+      runtime_config.active_expiry_delay = (u32) delay;
+    }
+  else if (0 == strcmp(name, "admission"))
+    {
+      if (0 == strcmp (value, "yes"))
+        runtime_config.admission = true;
+      else if (0 == strcmp (value, "no"))
+        runtime_config.admission = false;
+      else
+        {
+          err_print ("Invalid value '%s' for admission in %s on line %d"
+                     " (expected yes or no)\n", value, filename, lineno);
+          return false;
+        }
+    }
+  else if (0 == strcmp(name, "admission_sketch_size"))
+    {
+      size_t size;
+      if (!parse_size (value, &size) || (size < 0x400)
+          || (size > MAX_BUCKET_SIZE))
+        {
+          err_print ("Invalid size '%s' for admission_sketch_size in %s"
+                     " on line %d (expected 1K to 8M)\n", value, filename,
+                     lineno);
+          return false;
+        }
+
+      runtime_config.admission_sketch_size = size;
+    }
   else
     {
       err_print ("Unknown variable '%s' in %s on line %d\n",
@@ -234,3 +453,36 @@ parse_variable (const char *filename, int lineno, const char *name, char *value)
 
   return true;
 }
+
+// Parse a byte count with an optional K, M or G suffix
+static bool
+parse_size (const char *value, size_t *size)
+{
+  char *endptr = NULL;
+  unsigned long long int result;
+  u32 shift = 0;
+
+  errno = 0;
+  result = strtoull (value, &endptr, 10);
+  if ((endptr == value) || (errno == ERANGE))
+    return false;
+
+  switch (toupper (*endptr))
+    {
+    case 'G': shift = 30; ++endptr; break;
+    case 'M': shift = 20; ++endptr; break;
+    case 'K': shift = 10; ++endptr; break;
+    default: break;
+    }
+
+  // Don't let the suffix wrap it around
+  if ((*endptr != '\0') || (result > (ULLONG_MAX >> shift)))
+    return false;
+
+  result <<= shift;
+  if (result > SIZE_MAX)
+    return false;
+
+  *size = result;
+  return true;
+}
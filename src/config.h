@@ -12,14 +12,81 @@
 # define cik_assert(expr)
 #endif
 
-#define MAX_NUM_BUCKETS        0x10        //  16
+// Probe entry maps a group of slots at a time by comparing 7 bit hash tags with
+// SSE2 instead of slot by slot, see entry.c.  Build with GROUP_PROBING=1.
+#ifndef GROUP_PROBING
+# define GROUP_PROBING 0
+#endif
+
+#define MAX_NUM_BUCKETS        0x40        //  64 Size classes at most
+#define SIZE_CLASS_STEPS       0x4         //   4 Size classes per doubling
 #define MIN_BUCKET_SIZE        0x100       // 256 Bytes
 #define MAX_BUCKET_SIZE        0x800000    //   8 Megabytes
 #define MAX_BUCKET_ENTRY_COUNT 0x80000     // 512 K
-#define MAX_TOTAL_MEMORY       0xFFFFFFFF  //   4 Gb -1b
+#define SMALL_OBJECT_STEP      0x10        //  16 Bytes between small classes
+#define MAX_SMALL_OBJECT_SIZE  0x100       // 256 Bytes
+#define MAX_SMALL_FALLBACK_SIZE 0x180      // 384 Bytes, bigger buckets aren't taken for small objects
+#define VALUE_CHUNK_SIZE       MAX_BUCKET_SIZE
+#define MIN_PAYLOAD_SIZE       0x1000      //   4 Kilobytes
+#define MAX_IDLE_PAYLOAD_SIZE  0x10000     //  64 Kilobytes kept between requests
+#define DEFAULT_MEMORY_LIMIT   0x100000000 //   4 Gb
+#define MEMORY_COMMIT_SIZE     0x4000000   //  64 Megabytes
+#define HUGE_PAGE_SIZE         0x200000    //   2 Megabytes
+#define DEFAULT_RELEASE_PAGES_ABOVE 0x100000 // 1 Megabyte buckets and up
+#define DEFAULT_COMPRESSION_ABOVE 0x1000   //   4 Kilobyte values and up
+#define MIN_COMPRESSED_VALUE_SIZE 0x40     //  64 Bytes, smaller values are stored as is
+#define MAX_COMPRESSED_VALUE_SIZE 0x200000 //   2 Megabytes, bigger values too
+#define MAGAZINE_SIZE          0x20        //  32 Buckets per thread and size
+#define MAX_MAGAZINE_BYTES     0x100000    //   1 Megabyte per thread and size
+#define SLAB_ALIGNMENT         0x1000      //   4 Kilobytes (page size)
+#define SLAB_SIZE              0x802000    //   8 Megabytes + 8 Kilobytes
+#define SMALL_SLABS_PER_SLAB   0x80        // 128 Small object slabs packed into a slab
+#define REBALANCE_INTERVAL     1           //   1s
+#define REBALANCE_MAX_SLABS    0x10        //  16 Slabs moved per interval
+#define REBALANCE_MAX_VICTIMS  0x4         //   4 Slabs considered per move
+#define MAX_EVICTION_CANDIDATES 0x4000     //  16 K Entries remembered per move
+#define RETIRE_LIST_SIZE       0x100       // 256 Entries released per wait at most
+#define COMPACTION_MAX_BUCKET_SIZE 0x40000 // 256 Kilobytes, bigger ones aren't moved
+#define COMPACTION_MIN_FREE_SLABS  0x2     //   2 Slabs worth of free buckets
+#define COMPACTION_STEP_MAPS       0x8     //   8 Entry maps walked per step
+#define COMPACTION_STEP_DELAY      1000000 //   1ms between steps (in ns)
+#define COMPACTION_MAX_PASSES      0x2     //   2 Walks before giving up a slab
+#define COMPACTION_BACKOFF         0x10    //  16 Picks before retrying a slab
+#define MAX_NUMA_NODES         0x8
+#define CACHE_LINE_SIZE        0x40        //  64 Bytes
+#define LOCK_SPIN_LIMIT        0x80        // 128 Spins before sleeping on a lock
+#define MAX_NUM_CPUS           0x400       // Same as CPU_SETSIZE
 
 #define NUM_CACHE_ENTRY_MAPS 6421 // Should be a prime
-#define CACHE_ENTRY_MAP_SIZE 797  // Should be a prime
+#define MIN_CACHE_ENTRY_MAP_SIZE  0x20    //  32 Slots per map to begin with
+#define MAX_CACHE_ENTRY_MAP_SIZE  0x20000 // 128 K Slots, 4 Mb tables at most
+#define CACHE_ENTRY_SLOT_ALIGNMENT 0x20   //  32 Bytes, two slots per cache line
+#define DEFAULT_INDEX_LOAD_FACTOR 0.75    // Entries per slot before growing
+#define CACHE_ENTRY_MIGRATE_SLOTS 0x10    //  16 Slots migrated per request
+#define CACHE_ENTRY_GROUP_SIZE    0x10    //  16 Slots probed at once, see GROUP_PROBING
+#define ENTRY_HIT_SAMPLE_BITS     4       //   1 In 16 unlocked hits counted, see `hit_entry_unlocked'
+
+#define DEFAULT_WALK_THREADS 0x3  //  3 Helper threads walking the index with a worker
+#define MAX_WALK_THREADS     0x10 // 16 Helper threads at most
+#define WALK_STEP_MAPS       0x10 // 16 Maps taken at a time by a walking thread
+
+#define EXPIRY_WHEEL_BITS    6       //  64 Buckets per wheel level
+#define EXPIRY_WHEEL_LEVELS  4       //   4 Levels, ~194 days ahead
+#define EXPIRY_BLOCK_SIZE    0x400   //   1 Kilobyte blocks of expiry records
+#define EXPIRY_REAP_BATCH    0x100   // 256 Records reaped per step
+#define EXPIRY_STEP_DELAY    1000000 //   1ms between steps (in ns)
+#define EXPIRY_MEMORY_SHARE  0x20    //   1/32 Of the memory at most for expiry records
+#define DEFAULT_ACTIVE_EXPIRY_DELAY 60 // 1m past expiry before entries are reaped
+
+#define EVICTION_SWEEP_SLOTS  0x40 // Slots visited per clock hand step
+#define EVICTION_EXACT_SWEEPS 0x10 // Clock hand steps before any size will do
+#define EVICTION_MAX_TURNS    2    // Clock turns before giving up
+#define EVICTION_IDLE_SWEEPS  0x40 // Clock hand steps without a big enough entry before giving up
+
+#define DEFAULT_ADMISSION_SKETCH_SIZE 0x200000 // 2 Megabytes, 4 M counters
+#define ADMISSION_SKETCH_DEPTH        4        // Counters per key
+#define ADMISSION_SAMPLE_FACTOR       10       // Accesses per word between halvings
+#define ADMISSION_COUNT_BATCH         0x40     // Accesses a worker counts before sharing them
 
 #define SERVER_BACKLOG       0x100
 #define NUM_WORKERS          0x10
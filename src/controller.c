@@ -1,13 +1,19 @@
 #include <string.h>
 
+#include "admission.h"
+#include "compress.h"
 #include "controller.h"
 #include "entry.h"
+#include "epoch.h"
+#include "expiry.h"
+#include "hash.h"
 #include "log.h"
 #include "memory.h"
 #include "profiler.h"
 #include "server.h"
 #include "tag.h"
 #include "util.h"
+#include "walk.h"
 
 #if __BIG_ENDIAN__
 # define htonll(x) (x)
@@ -17,13 +23,21 @@
 # define ntohll(x) (((u64) ntohl ((x) & 0xFFFFFFFF) << 32) | ntohl ((x) >> 32))
 #endif
 
+#define SATURATE_U32(x) ((u32) (((x) > 0xFFFFFFFF) ? 0xFFFFFFFF : (x)))
+
 static tss_t current_client = (tss_t) -1;
 
+static bool   compress_values = false;
+static size_t compress_values_above = 0;
+
 int
-init_controller ()
+init_controller (const RuntimeConfig *config)
 {
   int err;
 
+  compress_values = config->compression;
+  compress_values_above = config->compression_above;
+
   err = tss_create (&current_client, NULL);
   cik_assert (err == thrd_success);
   cik_assert (current_client != (tss_t) -1);
@@ -38,37 +52,28 @@ init_controller ()
 static inline CacheEntryHashMap *
 get_map_for_key (CacheKey key)
 {
-  // @Revisit: Distibution is good when keys have high entry at the end but some
-  // keys have /both/ prefix /and/ suffix. Ex:
-  //   e69_LAYOUT_FRONTEND_STORE1_408DE8216887838FDFE8FE49819AC15F8_PAGE_LAYOUT
-  u32 map_index = 0;
-  if (key.nmemb >= sizeof (u64))
-    map_index = (*(u64 *) key.base) % NUM_CACHE_ENTRY_MAPS;
-  else if (key.nmemb >= sizeof (u32))
-    map_index = (*(u32 *) key.base) % NUM_CACHE_ENTRY_MAPS;
-  else if (key.nmemb >= sizeof (u16))
-    map_index = (*(u16 *) key.base) % NUM_CACHE_ENTRY_MAPS;
-  else if (key.nmemb >= sizeof (u8))
-    map_index = (*(u8 *)  key.base) % NUM_CACHE_ENTRY_MAPS;
-  return entry_maps[map_index];
+  return entry_maps[get_map_index (key.hash)];
 }
 
 static StatusCode
-read_request_key (Client *client, CacheKey key)
+read_request_key (Client *client, CacheKey *key)
 {
   StatusCode status;
 
   cik_assert (client != NULL);
-  cik_assert (key.base != NULL);
+  cik_assert (key->base != NULL);
 
-  status = read_request_payload (client, key.base, key.nmemb);
+  status = read_request_payload (client, key->base, key->nmemb);
   if (status != STATUS_OK)
     return status;
 
   // Both keys and tags tend to be prefixed and so in general they have more
-  // entropy at the end. Hence we store them in reverse byte order to improve
-  // hash map distribution and early exit memcmp.
-  reverse_bytes (key.base, key.nmemb);
+  // entropy at the end. Hence we store them in reverse byte order to exit
+  // memcmp early.
+  reverse_bytes (key->base, key->nmemb);
+
+  // Hashed once here, the hash goes with the key into the map and the entry
+  key->hash = hash_bytes (key->base, key->nmemb);
 
   return STATUS_OK;
 }
@@ -77,11 +82,18 @@ static StatusCode
 read_tags_using_payload_buffer (Client *client, CacheTag *tags, u8 ntags)
 {
   StatusCode status;
+  Payload   *payload_buffer = &client->worker->payload_buffer;
   u8        *buffer;
   u32        buffer_cap;
 
-  buffer = client->worker->payload_buffer.base;
-  buffer_cap = client->worker->payload_buffer.cap;
+  // Make room for the longest possible tags up front so the buffer doesn't
+  // move while we're pointing `tags' into it
+  payload_buffer->nmemb = 0;
+  if (!reserve_payload (payload_buffer, (u32) ntags * 0xFF))
+    return STATUS_OUT_OF_MEMORY; // @Cleanup: Drain input stream
+
+  buffer = payload_buffer->base;
+  buffer_cap = payload_buffer->cap;
 
   for (u8 t = 0; t < ntags; ++t)
     {
@@ -101,12 +113,209 @@ read_tags_using_payload_buffer (Client *client, CacheTag *tags, u8 ntags)
       reverse_bytes (tag->base, tag->nmemb);
     }
 
-  client->worker->payload_buffer.nmemb = (client->worker->payload_buffer.cap
-                                          - buffer_cap);
+  payload_buffer->nmemb = payload_buffer->cap - buffer_cap;
 
   return STATUS_OK;
 }
 
+// Read a value of `vlen' bytes into the payload buffer, past the tags, and try
+// to compress it there.  `value' is pointed at the compressed value if that
+// paid off and at the raw one otherwise.  The caller makes room for both.
+static StatusCode
+read_and_compress_value (Client *client, u32 vlen, CacheValue *value)
+{
+  StatusCode status;
+  Worker    *worker = client->worker;
+  u8        *raw    = worker->payload_buffer.base + worker->payload_buffer.nmemb;
+  u8        *out    = raw + vlen;
+  u32        size   = htonl (vlen);
+  u64        start_tick;
+
+  status = read_request_payload (client, raw, vlen);
+  if (status != STATUS_OK)
+    return status;
+
+  // Not worth decompressing on every GET unless it saves at least an eighth
+  start_tick = get_performance_counter ();
+  memcpy (out, &size, sizeof (size));
+  size = compress_block (raw, vlen, out + sizeof (size),
+                         vlen - (vlen / 8) - sizeof (size));
+  worker->timers.compress   += (get_performance_counter () - start_tick);
+  worker->counters.compress += 1;
+
+  value->compressed = (size != 0);
+  value->base       = value->compressed ? out : raw;
+  value->nmemb      = value->compressed ? (sizeof (size) + size) : vlen;
+
+  worker->compression.raw    += vlen;
+  worker->compression.stored += value->nmemb;
+
+  return STATUS_OK;
+}
+
+// Decompress a compressed `value' into `payload', replacing what it holds
+static StatusCode
+decompress_value (Worker *worker, CacheValue value, Payload *payload)
+{
+  u32  size;
+  u64  start_tick;
+  bool ok;
+
+  payload->nmemb = 0;
+
+  if (value.nmemb < sizeof (size))
+    return STATUS_PROTOCOL_ERROR;
+
+  memcpy (&size, value.base, sizeof (size));
+  size = ntohl (size);
+  if (size > MAX_COMPRESSED_VALUE_SIZE)
+    return STATUS_PROTOCOL_ERROR;
+
+  if (!reserve_payload (payload, size))
+    return STATUS_OUT_OF_MEMORY;
+
+  start_tick = get_performance_counter ();
+  ok = decompress_block (value.base + sizeof (size), value.nmemb - sizeof (size),
+                         payload->base, size);
+  worker->timers.decompress   += (get_performance_counter () - start_tick);
+  worker->counters.decompress += 1;
+
+  if (!ok)
+    return STATUS_PROTOCOL_ERROR;
+
+  payload->nmemb = size;
+
+  return STATUS_OK;
+}
+
+// The expiry time is renewed without holding the entry for unlocked GETs
+static inline bool
+is_entry_expired (const CacheEntry *entry, u8 flags)
+{
+  time_t expires;
+
+  if (flags & GET_FLAG_IGNORE_EXPIRES)
+    return false;
+
+  expires = __atomic_load_n (&entry->expires, __ATOMIC_RELAXED);
+  return (expires != CACHE_EXPIRES_INIT) && (expires < time (NULL));
+}
+
+static inline void
+hit_entry (CacheEntry *entry)
+{
+  __atomic_fetch_add (&entry->nhits, 1, __ATOMIC_RELAXED);
+  TOUCH_ENTRY (entry);
+}
+
+// Writing the hit count of a hot entry on every unlocked GET would bounce its
+// cache line between workers, so only a sample of the hits is counted, each
+// for the ones passed over.  Spreading the worker's GET count keeps the sample
+// from following the order of its requests.
+static inline void
+hit_entry_unlocked (Worker *worker, CacheEntry *entry)
+{
+  u32 spread = worker->counters.get_unlocked * 0x9E3779B9U;
+  if ((spread >> (32 - ENTRY_HIT_SAMPLE_BITS)) == 0)
+    __atomic_fetch_add (&entry->nhits, 1U << ENTRY_HIT_SAMPLE_BITS,
+                        __ATOMIC_RELAXED);
+  TOUCH_ENTRY (entry);
+}
+
+static inline void
+count_get_hit (Client *client, CacheKey key)
+{
+  log_request_get_hit (client, key);
+  ++client->counters.get_hit;
+}
+
+static inline void
+count_get_miss (Client *client, CacheKey key)
+{
+  log_request_get_miss (client, key);
+  ++client->counters.get_miss;
+}
+
+// Serve a GET without locking the map or the entry, see epoch.c.  Returns false
+// if we have to lock the entry after all, which is for streamed values and for
+// values that don't fit the payload buffer.  Growing it could evict an entry
+// and wait for readers, us included.
+static bool
+try_get_unlocked (Client *client, CacheKey key, u8 flags,
+                  Payload **response_payload, StatusCode *status)
+{
+  Worker     *worker         = client->worker;
+  Payload    *payload_buffer = &worker->payload_buffer;
+  CacheEntry *entry          = NULL;
+  bool        served         = true;
+
+  if (worker->id >= NUM_WORKERS)
+    return false; // Not a worker, see `load_request_log'
+
+  begin_unlocked_read (worker->id);
+
+  entry = get_cache_entry (get_map_for_key (key), key);
+  if (entry == BUSY_ENTRY)
+    {
+      served = false;
+    }
+  else if (!entry)
+    {
+      *status = STATUS_NOT_FOUND;
+    }
+  else if (is_entry_expired (entry, flags))
+    {
+      *status = STATUS_EXPIRED;
+    }
+  else if (entry->value.chunked)
+    {
+      served = false; // Streaming takes a reference to the chunks
+    }
+  else if (entry->value.compressed && (~flags & GET_FLAG_ACCEPT_COMPRESSED))
+    {
+      u32 size = 0;
+      if (entry->value.nmemb >= sizeof (size))
+        memcpy (&size, entry->value.base, sizeof (size));
+      if (ntohl (size) > payload_buffer->cap)
+        served = false;
+      else
+        *status = decompress_value (worker, entry->value, payload_buffer);
+    }
+  else if (entry->value.nmemb > payload_buffer->cap)
+    {
+      served = false;
+    }
+  else
+    {
+      payload_buffer->nmemb = entry->value.nmemb;
+      payload_buffer->compressed = entry->value.compressed;
+      if (payload_buffer->nmemb > 0)
+        memcpy (payload_buffer->base, entry->value.base,
+                payload_buffer->nmemb);
+      *status = STATUS_OK;
+    }
+
+  if (served && (*status == STATUS_OK))
+    hit_entry_unlocked (worker, entry);
+
+  end_unlocked_read (worker->id);
+
+  if (!served)
+    return false;
+
+  if ((*status == STATUS_NOT_FOUND) || (*status == STATUS_EXPIRED))
+    count_get_miss (client, key);
+  else if (*status == STATUS_OK)
+    count_get_hit (client, key);
+
+  if ((*status == STATUS_OK) && (payload_buffer->nmemb > 0))
+    *response_payload = payload_buffer;
+
+  ++worker->counters.get_unlocked;
+
+  return true;
+}
+
 static StatusCode
 handle_get_request (Client *client, Request *request, Payload **response_payload)
 {
@@ -125,41 +334,60 @@ handle_get_request (Client *client, Request *request, Payload **response_payload
   key.base  = tmp_key_data;
   key.nmemb = klen;
 
-  status = read_request_key (client, key);
+  status = read_request_key (client, &key);
   if (status != STATUS_OK)
     return status;
 
+  count_access (client->worker->id, key.hash);
+
+  if (try_get_unlocked (client, key, flags, response_payload, &status))
+    return status;
+
   entry = lock_and_get_cache_entry (get_map_for_key (key), key);
   if (!entry)
     {
-      log_request_get_miss (client, key);
-      ++client->counters.get_miss;
+      count_get_miss (client, key);
       return STATUS_NOT_FOUND;
     }
 
-  if (~flags & GET_FLAG_IGNORE_EXPIRES)
+  if (is_entry_expired (entry, flags))
     {
-      if (entry->expires != CACHE_EXPIRES_INIT)
-        {
-          time_t now = time (NULL);
-          if (entry->expires < now)
-            {
-              UNLOCK_ENTRY (entry);
-              log_request_get_miss (client, key);
-              ++client->counters.get_miss;
-              return STATUS_EXPIRED;
-            }
-        }
+      UNLOCK_ENTRY (entry);
+      count_get_miss (client, key);
+      return STATUS_EXPIRED;
     }
 
-  log_request_get_hit (client, key);
-  ++entry->nhits;
-  ++client->counters.get_hit;
+  count_get_hit (client, key);
+  hit_entry (entry);
+
+  if (entry->value.chunked)
+    {
+      // Chunked values are too big to copy so we hold a reference to the
+      // chunks instead and let the server stream them to the client.
+      atomic_fetch_add (&entry->value.chunks->refs, 1);
+      payload_buffer->chunks = entry->value.chunks;
+      payload_buffer->nmemb = entry->value.nmemb;
+      *response_payload = payload_buffer;
+      UNLOCK_ENTRY (entry);
+      return STATUS_OK;
+    }
+
+  if (entry->value.compressed && (~flags & GET_FLAG_ACCEPT_COMPRESSED))
+    {
+      // Decompressing under the lock saves copying the compressed value out
+      // first.  It was checked when it was set so this only fails on memory.
+      status = decompress_value (client->worker, entry->value, payload_buffer);
+      UNLOCK_ENTRY (entry);
+      if (status == STATUS_OK)
+        *response_payload = payload_buffer;
+      return status;
+    }
 
-  if (entry->value.nmemb > payload_buffer->cap)
+  // Eviction only try-locks entries so it's safe to reserve while we hold it
+  if (!reserve_payload (payload_buffer, entry->value.nmemb))
     {
       UNLOCK_ENTRY (entry);
-      return STATUS_BUG; // We should always have a buffer big enough
+      return STATUS_OUT_OF_MEMORY;
     }
 
   if (entry->value.nmemb > 0)
@@ -167,6 +395,7 @@ handle_get_request (Client *client, Request *request, Payload **response_payload
       // We copy the entry value to a payload buffer so we don't have to keep
       // the entity locked while writing it's data to the client.
       payload_buffer->nmemb = entry->value.nmemb;
+      payload_buffer->compressed = entry->value.compressed;
       memcpy (payload_buffer->base, entry->value.base, payload_buffer->nmemb);
       *response_payload = payload_buffer;
     }
@@ -182,7 +411,9 @@ handle_set_request (Client *client, Request *request)
   PROFILE (PROF_HANDLE_SET_REQUEST);
 
   StatusCode status;
-  CacheEntry *entry = NULL, *old_entry = NULL;
+  CacheEntry *entry          = NULL, *old_entry = NULL;
+  Payload    *payload_buffer = &client->worker->payload_buffer;
+  CacheValue  value          = CACHE_VALUE_INIT;
 
   u8  klen  = request->s.klen;
   u32 tlen  = 0;
@@ -194,11 +425,14 @@ handle_set_request (Client *client, Request *request)
   u8      *payload;
   u8       tmp_key_data[0xFF];
   size_t   total_size;
+  time_t   expires;
+  bool     chunked;
+  bool     compress;
   CacheTag tags[ntags];
   CacheKey key = { .base = tmp_key_data, .nmemb = klen };
 
   // Read key
-  status = read_request_key (client, key);
+  status = read_request_key (client, &key);
   if (status != STATUS_OK)
     return status;
 
@@ -209,19 +443,37 @@ handle_set_request (Client *client, Request *request)
   if (flags & SET_FLAG_ONLY_TTL)
     {
       // Just renew expiry time for entry, ignore tags and value
+      expires = (ttl == (u32) -1) ? CACHE_EXPIRES_INIT : (time (NULL) + ttl);
+
       entry = lock_and_get_cache_entry (get_map_for_key (key), key);
       if (!entry)
         return STATUS_NOT_FOUND;
 
-      if (ttl == (u32) -1)
-        entry->expires = CACHE_EXPIRES_INIT;
-      else
-        entry->expires = time (NULL) + ttl;
+      // Unlocked GETs may be reading it, see `is_entry_expired'
+      __atomic_store_n (&entry->expires, expires, __ATOMIC_RELAXED);
+      track_expiry (entry);
 
       UNLOCK_ENTRY (entry);
+
       return STATUS_OK;
     }
 
+  count_access (client->worker->id, key.hash);
+
+  compress = (compress_values && (~flags & SET_FLAG_COMPRESSED)
+              && (vlen >= compress_values_above)
+              && (vlen >= MIN_COMPRESSED_VALUE_SIZE)
+              && (vlen <= MAX_COMPRESSED_VALUE_SIZE));
+
+  // Make room for the value and its compressed copy along with the tags so the
+  // tags don't move.  If there's no room we just store the value as is.
+  if (compress)
+    {
+      payload_buffer->nmemb = 0;
+      compress = reserve_payload (payload_buffer,
+                                  ((u32) ntags * 0xFF) + (2 * vlen));
+    }
+
   status = read_tags_using_payload_buffer (client, tags, ntags);
   if (status != STATUS_OK)
     return status;
@@ -230,11 +482,44 @@ handle_set_request (Client *client, Request *request)
   for (u8 t = 0; t < ntags; ++t)
     tlen += tags[t].nmemb;
 
+  if (compress)
+    {
+      // Compress up front so we know how big an entry to reserve
+      status = read_and_compress_value (client, vlen, &value);
+      if (status != STATUS_OK)
+        return status;
+      vlen = value.nmemb;
+    }
+  else if (flags & SET_FLAG_COMPRESSED)
+    {
+      value.compressed = true;
+    }
+
+  // Values that don't fit in the same bucket as the entry are chunked
   total_size = tlen + key.nmemb + vlen;
+  chunked = (get_size_class (sizeof (CacheEntry) + total_size) == 0);
+  if (chunked)
+    total_size -= vlen;
+
+  // Compressed values are never that big
+  if (value.compressed && chunked)
+    {
+      // Skip the value, see below
+      status = value.base ? STATUS_OK : skip_request_payload (client, vlen);
+      return (status == STATUS_OK) ? STATUS_PROTOCOL_ERROR : status;
+    }
 
+  // Make room for it only if it's hotter than what it would evict
+  begin_admission (&key);
   entry = reserve_and_lock_entry (total_size);
+  end_admission ();
   if (entry == NULL)
-    return STATUS_OUT_OF_MEMORY;
+    {
+      // Skip the value (unless it was read to be compressed) to keep reading
+      // requests where they start
+      status = value.base ? STATUS_OK : skip_request_payload (client, vlen);
+      return (status == STATUS_OK) ? STATUS_OUT_OF_MEMORY : status;
+    }
 
   payload = (u8 *) (entry + 1);
 
@@ -255,18 +540,56 @@ handle_set_request (Client *client, Request *request)
   memcpy (payload, key.base, key.nmemb);
   entry->key.base = payload;
   entry->key.nmemb = key.nmemb;
+  entry->key.hash = key.hash;
   payload += key.nmemb;
-  entry->value.base = payload;
   entry->value.nmemb = vlen;
-  payload += vlen;
+  entry->value.compressed = value.compressed;
+
+  if (chunked)
+    {
+      ValueChunks *chunks;
+
+      begin_admission (&key);
+      chunks = reserve_value_chunks (vlen);
+      end_admission ();
+      if (chunks == NULL)
+        {
+          UNLOCK_ENTRY (entry);
+          release_entry (entry);
+          status = skip_request_payload (client, vlen);
+          return (status == STATUS_OK) ? STATUS_OUT_OF_MEMORY : status;
+        }
+
+      entry->value.chunks = chunks;
+      entry->value.chunked = true;
+
+      // Stream the value straight into its chunks
+      status = STATUS_OK;
+      for (u32 i = 0; (i < chunks->nchunks) && (status == STATUS_OK); ++i)
+        status = read_request_payload (client, chunks->chunks[i],
+                                       get_value_chunk_size (vlen, i));
+    }
+  else
+    {
+      entry->value.base = payload;
+      payload += vlen;
+      if (value.base)
+        memcpy (entry->value.base, value.base, vlen); // Compressed above
+      else
+        status = read_request_payload (client, entry->value.base, vlen);
+    }
 
   cik_assert ((u32) (payload - (u8 *) (entry + 1)) == total_size);
 
-  status = read_request_payload (client, entry->value.base, vlen);
+  // Make sure values compressed by the client decompress, the tags have been
+  // copied out of the payload buffer by now
+  if ((status == STATUS_OK) && (flags & SET_FLAG_COMPRESSED))
+    status = decompress_value (client->worker, entry->value, payload_buffer);
+
   if (status != STATUS_OK)
     {
       UNLOCK_ENTRY (entry);
-      release_memory (entry);
+      release_entry (entry);
       return status;
     }
 
@@ -279,17 +602,20 @@ handle_set_request (Client *client, Request *request)
     {
       cik_assert (old_entry == NULL);
       UNLOCK_ENTRY (entry);
-      release_memory (entry);
+      release_entry (entry);
       return STATUS_OUT_OF_MEMORY;
     }
 
   if (old_entry)
     {
+      // Expiry records only know the key hash so the new entry can have its
+      // record, see expiry.c
+      entry->expiry_second = old_entry->expiry_second;
       // @Speed: Maybe only remove keys missing in new entry
       for (u8 t = 0; t < old_entry->tags.nmemb; ++t)
         remove_key_from_tag (old_entry->tags.base[t], old_entry->key);
       UNLOCK_ENTRY (old_entry);
-      release_memory (old_entry);
+      release_entry (old_entry);
     }
 
   // @Speed: Maybe only add tags missing in old entry.  In general we should
@@ -299,6 +625,8 @@ handle_set_request (Client *client, Request *request)
   for (u8 t = 0; t < entry->tags.nmemb; ++t)
     add_key_to_tag (entry->tags.base[t], entry->key);
 
+  track_expiry (entry);
+
   UNLOCK_ENTRY (entry);
 
   return STATUS_OK;
@@ -319,15 +647,9 @@ delete_entry_by_key (CacheKey key)
   for (u8 t = 0; t < entry->tags.nmemb; ++t)
     remove_key_from_tag (entry->tags.base[t], entry->key);
 
-  do
-    {
-      // Release memory. We loop until we get NULL back from map. See note
-      // about @Bug in `set_locked_cache_entry'.
-      UNLOCK_ENTRY (entry);
-      release_memory (entry);
-      entry = lock_and_unset_cache_entry (get_map_for_key (key), key);
-    }
-  while (entry != NULL);
+  // Release memory, see `release_retired_entries'
+  UNLOCK_ENTRY (entry);
+  retire_entry (entry);
 
   return STATUS_OK;
 }
@@ -344,55 +666,84 @@ handle_del_request (Client *client, Request *request)
     .nmemb = request->d.klen
   };
 
-  status = read_request_key (client, key);
+  status = read_request_key (client, &key);
   if (status != STATUS_OK)
     return status;
 
   ++client->counters.del;
 
-  return delete_entry_by_key (key);
+  status = delete_entry_by_key (key);
+  release_retired_entries ();
+
+  return status;
 }
 
+// Keys of entries cleared by a walk, see `log_cleared_keys'.  Each walk thread
+// has its own.
+struct _ClearCallbackData
+{
+  Payload      *cleared;
+  time_t        now;  // Of CLEAR_MODE_OLD
+  CacheTagArray tags; // Of CLEAR_MODE_MATCH_NONE
+};
+
+// Called from walk threads too, see walk.c
 static bool
-clear_all_callback (CacheEntry *entry, void *user_data)
+clear_all_callback (CacheEntry *entry, struct _ClearCallbackData *data)
 {
-  (void) user_data;
+  Payload *cleared = data->cleared;
 
   cik_assert (entry);
 
-  log_request_del (tss_get (current_client), entry->key);
+  // Only workers have a log queue, so keep the key (as stored) for the CLR
+  // request to log.  Keys that don't fit go unlogged like on a full queue.
+  if (reserve_payload (cleared, cleared->nmemb + 1 + entry->key.nmemb))
+    {
+      cleared->base[cleared->nmemb++] = entry->key.nmemb;
+      memcpy (&cleared->base[cleared->nmemb], entry->key.base,
+              entry->key.nmemb);
+      cleared->nmemb += entry->key.nmemb;
+    }
 
   for (u8 t = 0; t < entry->tags.nmemb; ++t)
     remove_key_from_tag (entry->tags.base[t], entry->key);
 
+  // Released along with the rest of the batch, see `release_retired_entries'
   UNLOCK_ENTRY (entry);
-  release_memory (entry);
+  retire_entry (entry);
 
   return true; // 'true' tells map to unset the entry
 }
 
+// Also called from `clear_expired_entries'
 static bool
-clear_old_callback (CacheEntry *entry, time_t *now)
+clear_old_callback (CacheEntry *entry, struct _ClearCallbackData *data)
 {
   cik_assert (entry);
-  cik_assert (now);
+  cik_assert (data);
 
-  if ((entry->expires == CACHE_EXPIRES_INIT)
-      || (entry->expires >= *now))
+  if (entry->expires == CACHE_EXPIRES_INIT)
     return false;
 
-  return clear_all_callback (entry, NULL);
+  if (entry->expires >= data->now)
+    {
+      // Walking all entries since some are missing from the expiry index
+      track_expiry (entry);
+      return false;
+    }
+
+  return clear_all_callback (entry, data);
 }
 
 static bool
-clear_non_matching_callback (CacheEntry *entry, CacheTagArray *tags)
+clear_non_matching_callback (CacheEntry *entry, struct _ClearCallbackData *data)
 {
   cik_assert (entry);
-  cik_assert (tags);
+  cik_assert (data);
 
-  for (u8 i = 0; i < tags->nmemb; ++i)
+  for (u8 i = 0; i < data->tags.nmemb; ++i)
     {
-      CacheTag *want = &tags->base[i];
+      CacheTag *want = &data->tags.base[i];
       for (u8 j = 0; j < entry->tags.nmemb; ++j)
         {
           CacheTag *have = &entry->tags.base[j];
@@ -404,14 +755,26 @@ clear_non_matching_callback (CacheEntry *entry, CacheTagArray *tags)
         }
     }
 
-  return clear_all_callback (entry, NULL);
+  return clear_all_callback (entry, data);
 }
 
+// Log a DEL for each key the walk threads kept in `cleared' and release them
 static void
-walk_all_entries (void *cb, void *data)
+log_cleared_keys (Client *client, Payload *cleared, u32 nthreads)
 {
-  for (u32 i = 0; i < NUM_CACHE_ENTRY_MAPS; ++i)
-    walk_entries (entry_maps[i], (CacheEntryWalkCb) cb, data);
+  for (u32 t = 0; t < nthreads; ++t)
+    {
+      for (u32 i = 0; i < cleared[t].nmemb; i += 1 + cleared[t].base[i])
+        {
+          CacheKey key = {
+            .base  = &cleared[t].base[i + 1],
+            .nmemb = cleared[t].base[i]
+          };
+          log_request_del (client, key);
+        }
+
+      release_payload (&cleared[t]);
+    }
 }
 
 static StatusCode
@@ -430,26 +793,49 @@ handle_clr_request (Client *client, Request *request)
 
   ++client->counters.clr;
 
+  time_t now = time (NULL);
+  u32 nthreads = get_num_walk_threads ();
+  Payload cleared[nthreads];
+  struct _ClearCallbackData data[nthreads];
+  for (u32 t = 0; t < nthreads; ++t)
+    {
+      cleared[t] = (Payload) {};
+      data[t] = (struct _ClearCallbackData) {
+        .cleared    = &cleared[t],
+        .now        = now,
+        .tags.base  = tags,
+        .tags.nmemb = ntags
+      };
+    }
+
   switch (mode)
     {
     case CLEAR_MODE_ALL:
       log_request_clr_all (client);
-      walk_all_entries (clear_all_callback, NULL);
+      walk_all_entries ((CacheEntryWalkCb) clear_all_callback, data,
+                        sizeof (data[0]));
+      log_cleared_keys (client, cleared, nthreads);
       return STATUS_OK;
     case CLEAR_MODE_OLD:
       {
-        time_t now = time (NULL);
+        u64 nuntracked;
         log_request_clr_old (client);
-        walk_all_entries (clear_old_callback, &now);
+        if (!clear_expired_entries (now, (CacheEntryWalkCb) clear_old_callback,
+                                    &data[0], &nuntracked))
+          {
+            walk_all_entries ((CacheEntryWalkCb) clear_old_callback, data,
+                              sizeof (data[0]));
+            untracked_entries_walked (nuntracked);
+          }
+        log_cleared_keys (client, cleared, nthreads);
         return STATUS_OK;
       }
     case CLEAR_MODE_MATCH_NONE:
-      {
-        CacheTagArray tag_array = { .base = tags, .nmemb = ntags };
-        log_request_clr_match_none (client, tags, ntags);
-        walk_all_entries (clear_non_matching_callback, &tag_array);
-        return STATUS_OK;
-      }
+      log_request_clr_match_none (client, tags, ntags);
+      walk_all_entries ((CacheEntryWalkCb) clear_non_matching_callback, data,
+                        sizeof (data[0]));
+      log_cleared_keys (client, cleared, nthreads);
+      return STATUS_OK;
     case CLEAR_MODE_MATCH_ALL: // Intentional fallthrough
     case CLEAR_MODE_MATCH_ANY:
       {
@@ -467,6 +853,7 @@ handle_clr_request (Client *client, Request *request)
         for (KeyElem **key = &keys; *key; key = &(*key)->next)
           delete_entry_by_key ((*key)->key);
         release_key_list (keys);
+        release_retired_entries ();
 
         return STATUS_OK;
       }
@@ -477,6 +864,22 @@ handle_clr_request (Client *client, Request *request)
   return STATUS_OK;
 }
 
+// Append `nmemb' bytes at `base' with a length prefix to `payload', growing it
+// as needed.  Keys and tags are stored reversed so we reverse them back.
+static bool
+append_to_payload (Payload *payload, u8 *base, u8 nmemb)
+{
+  if (!reserve_payload (payload, payload->nmemb + 1 + nmemb))
+    return false;
+
+  payload->base[payload->nmemb++] = nmemb;
+  memcpy (&payload->base[payload->nmemb], base, nmemb);
+  reverse_bytes (&payload->base[payload->nmemb], nmemb);
+  payload->nmemb += nmemb;
+
+  return true;
+}
+
 struct _ListAllKeysCallbackData
 {
   StatusCode status;
@@ -486,22 +889,11 @@ struct _ListAllKeysCallbackData
 static bool
 list_all_keys_callback (CacheEntry *entry, struct _ListAllKeysCallbackData *data)
 {
-  CacheKey *key     = &entry->key;
-  Payload  *payload = data->payload;
-
   if (data->status != STATUS_OK)
     return false;
 
-  if ((payload->nmemb + 1 + key->nmemb) > payload->cap)
-    {
-      data->status = STATUS_OUT_OF_MEMORY;
-      return false;
-    }
-
-  payload->base[payload->nmemb++] = key->nmemb;
-  memcpy (&payload->base[payload->nmemb], key->base, key->nmemb);
-  reverse_bytes (&payload->base[payload->nmemb], key->nmemb);
-  payload->nmemb += key->nmemb;
+  if (!append_to_payload (data->payload, entry->key.base, entry->key.nmemb))
+    data->status = STATUS_OUT_OF_MEMORY;
 
   return false;
 }
@@ -545,22 +937,51 @@ struct _ListAllTagsCallbackData
 static void
 list_all_tags_callback (CacheTag tag, struct _ListAllTagsCallbackData *data)
 {
-  Payload *payload = data->payload;
-
   if (data->status != STATUS_OK)
     return;
 
-  if ((payload->nmemb + 1 + tag.nmemb) > payload->cap)
+  if (!append_to_payload (data->payload, tag.base, tag.nmemb))
+    data->status = STATUS_OUT_OF_MEMORY;
+}
+
+// Append the keys walk threads listed in `data' (all but the first, which lists
+// to `buffer' itself) to `buffer' and release them
+static StatusCode
+merge_listed_keys (Payload *buffer, struct _ListAllKeysCallbackData *data,
+                   size_t data_size, u32 nthreads)
+{
+  StatusCode status = STATUS_OK;
+
+  for (u32 t = 0; t < nthreads; ++t)
     {
-      data->status = STATUS_OUT_OF_MEMORY;
-      return;
-    }
+      struct _ListAllKeysCallbackData *listed
+        = (struct _ListAllKeysCallbackData *) ((u8 *) data + (t * data_size));
+
+      if (status == STATUS_OK)
+        status = listed->status;
 
-  payload->base[payload->nmemb++] = tag.nmemb;
-  memcpy (&payload->base[payload->nmemb], tag.base, tag.nmemb);
-  reverse_bytes (&payload->base[payload->nmemb], tag.nmemb);
+      if (t == 0)
+        continue;
 
-  payload->nmemb += tag.nmemb;
+      if (status == STATUS_OK)
+        {
+          if (reserve_payload (buffer,
+                               buffer->nmemb + listed->payload->nmemb))
+            {
+              memcpy (&buffer->base[buffer->nmemb], listed->payload->base,
+                      listed->payload->nmemb);
+              buffer->nmemb += listed->payload->nmemb;
+            }
+          else
+            {
+              status = STATUS_OUT_OF_MEMORY;
+            }
+        }
+
+      release_payload (listed->payload);
+    }
+
+  return status;
 }
 
 static StatusCode
@@ -582,15 +1003,23 @@ handle_lst_request (Client *client, Request *request, Payload **response_payload
     {
     case LIST_MODE_ALL_KEYS:
       {
-        struct _ListAllKeysCallbackData data = {
-          .status = STATUS_OK,
-          .payload = buffer
-        };
-        data.payload->nmemb = 0; // We don't care about input tags
+        u32 nthreads = get_num_walk_threads ();
+        Payload listed[nthreads];
+        struct _ListAllKeysCallbackData data[nthreads];
+        for (u32 t = 0; t < nthreads; ++t)
+          {
+            listed[t] = (Payload) {};
+            data[t] = (struct _ListAllKeysCallbackData) {
+              .status  = STATUS_OK,
+              .payload = (t == 0) ? buffer : &listed[t]
+            };
+          }
+        buffer->nmemb = 0; // We don't care about input tags
         log_request_lst_all_keys (client);
-        walk_all_entries (list_all_keys_callback, &data);
-        *response_payload = data.payload;
-        return data.status;
+        walk_all_entries ((CacheEntryWalkCb) list_all_keys_callback, data,
+                          sizeof (data[0]));
+        *response_payload = buffer;
+        return merge_listed_keys (buffer, data, sizeof (data[0]), nthreads);
       }
     case LIST_MODE_ALL_TAGS:
       {
@@ -606,25 +1035,36 @@ handle_lst_request (Client *client, Request *request, Payload **response_payload
       }
     case LIST_MODE_MATCH_NONE:
       {
-        // Make virtual payload since we've already used part of it for tags and
-        // we need to pass them to our walk callback without them being overwritten.
-        Payload alt_payload = {
-          .base  = (buffer->base + buffer->nmemb),
-          .nmemb = 0,
-          .cap   = (buffer->cap - buffer->nmemb)
-        };
-        struct _ListNonMatchingKeysCallbackData data = {
-          .base = {
-            .status  = STATUS_OK,
-            .payload = &alt_payload
-          },
-          .tags.base  = tags,
-          .tags.nmemb = ntags
-        };
+        // Move the tags out of the payload buffer since it may move when it
+        // grows while we pass them to our walk callback.
+        u8 tag_data[buffer->nmemb + 1];
+        if (buffer->nmemb > 0)
+          memcpy (tag_data, buffer->base, buffer->nmemb);
+        for (u8 t = 0; t < ntags; ++t)
+          tags[t].base = tag_data + (tags[t].base - buffer->base);
+        buffer->nmemb = 0;
+
+        u32 nthreads = get_num_walk_threads ();
+        Payload listed[nthreads];
+        struct _ListNonMatchingKeysCallbackData data[nthreads];
+        for (u32 t = 0; t < nthreads; ++t)
+          {
+            listed[t] = (Payload) {};
+            data[t] = (struct _ListNonMatchingKeysCallbackData) {
+              .base = {
+                .status  = STATUS_OK,
+                .payload = (t == 0) ? buffer : &listed[t]
+              },
+              .tags.base  = tags,
+              .tags.nmemb = ntags
+            };
+          }
         log_request_lst_match_none (client, tags, ntags);
-        walk_all_entries (list_non_matching_callback, &data);
-        *response_payload = data.base.payload;
-        return data.base.status;
+        walk_all_entries ((CacheEntryWalkCb) list_non_matching_callback, data,
+                          sizeof (data[0]));
+        *response_payload = buffer;
+        return merge_listed_keys (buffer, &data[0].base, sizeof (data[0]),
+                                  nthreads);
       }
     case LIST_MODE_MATCH_ALL: // Intentional fallthrough
     case LIST_MODE_MATCH_ANY:
@@ -647,16 +1087,11 @@ handle_lst_request (Client *client, Request *request, Payload **response_payload
         for (KeyElem **elem = &list; *elem; elem = &(*elem)->next)
           {
             CacheKey key = (*elem)->key;
-            if ((buffer->nmemb + 1 + key.nmemb) > buffer->cap)
+            if (!append_to_payload (buffer, key.base, key.nmemb))
               {
                 status = STATUS_OUT_OF_MEMORY;
                 break;
               }
-
-            buffer->base[buffer->nmemb++] = key.nmemb;
-            memcpy (&buffer->base[buffer->nmemb], key.base, key.nmemb);
-            reverse_bytes (&buffer->base[buffer->nmemb], key.nmemb);
-            buffer->nmemb += key.nmemb;
           }
 
         release_key_list (list);
@@ -679,8 +1114,11 @@ handle_nfo_request (Client *client, Request *request, Payload **response_payload
   u8                  klen           = request->n.klen;
   Payload            *payload_buffer = &client->worker->payload_buffer;
 
+  payload_buffer->nmemb = 0;
+  if (!reserve_payload (payload_buffer, sizeof (*nfo)))
+    return STATUS_OUT_OF_MEMORY;
+
   nfo = (NFOResponsePayload *) payload_buffer->base;
-  payload_buffer->nmemb = sizeof (*nfo);
   *response_payload = payload_buffer;
 
   ++client->counters.nfo;
@@ -690,12 +1128,13 @@ handle_nfo_request (Client *client, Request *request, Payload **response_payload
       CacheEntry *entry = NULL;
       CacheKey    key;
       u8          tmp_key_data[0xFF];
-      u8         *tag_data = nfo->entry.stream_of_tags;
+      u8         *tag_data = NULL;
+      u32         size     = sizeof (nfo->entry);
 
       key.base  = tmp_key_data;
       key.nmemb = klen;
 
-      status = read_request_key (client, key);
+      status = read_request_key (client, &key);
       if (status != STATUS_OK)
         return status;
 
@@ -705,6 +1144,19 @@ handle_nfo_request (Client *client, Request *request, Payload **response_payload
       if (!entry)
         return STATUS_NOT_FOUND;
 
+      for (u8 t = 0; t < entry->tags.nmemb; ++t)
+        size += 1 + entry->tags.base[t].nmemb;
+
+      if (!reserve_payload (payload_buffer, size))
+        {
+          UNLOCK_ENTRY (entry);
+          return STATUS_OUT_OF_MEMORY;
+        }
+
+      nfo = (NFOResponsePayload *) payload_buffer->base;
+      tag_data = nfo->entry.stream_of_tags;
+      payload_buffer->nmemb = sizeof (nfo->entry);
+
       nfo->entry.expires = htonll (entry->expires);
       nfo->entry.mtime   = htonll (entry->mtime);
 
@@ -712,12 +1164,6 @@ handle_nfo_request (Client *client, Request *request, Payload **response_payload
         {
           CacheTag *tag = &entry->tags.base[t];
 
-          if ((payload_buffer->nmemb + 1 + tag->nmemb) > payload_buffer->cap)
-            {
-              UNLOCK_ENTRY (entry);
-              return STATUS_BUG; // We should always have a buffer big enough
-            }
-
           *(tag_data++) = tag->nmemb;
           memcpy (tag_data, tag->base, tag->nmemb);
           reverse_bytes (tag_data, tag->nmemb);
@@ -729,12 +1175,37 @@ handle_nfo_request (Client *client, Request *request, Payload **response_payload
     }
   else
     {
+      u8 version = request->n.version;
+
       log_request_nfo (client);
-      populate_nfo_response (nfo);
-      nfo->server.bytes_reserved = htonl (nfo->server.bytes_reserved);
-      nfo->server.bytes_used     = htonl (nfo->server.bytes_used);
-      nfo->server.bytes_free     = htonl (nfo->server.bytes_free);
-      nfo->server.bytes_reused   = htonl (nfo->server.bytes_reused);
+
+      if (version == NFO_VERSION_1)
+        {
+          populate_nfo_response (nfo);
+          nfo->server_v1.bytes_reserved = htonll (nfo->server_v1.bytes_reserved);
+          nfo->server_v1.bytes_used     = htonll (nfo->server_v1.bytes_used);
+          nfo->server_v1.bytes_free     = htonll (nfo->server_v1.bytes_free);
+          nfo->server_v1.bytes_reused   = htonll (nfo->server_v1.bytes_reused);
+          payload_buffer->nmemb = sizeof (nfo->server_v1);
+        }
+      else if (version == NFO_VERSION_LEGACY)
+        {
+          // Old clients expect u32 counters so we saturate rather than wrap
+          populate_nfo_response (nfo);
+          u64 bytes_reserved = nfo->server_v1.bytes_reserved;
+          u64 bytes_used     = nfo->server_v1.bytes_used;
+          u64 bytes_free     = nfo->server_v1.bytes_free;
+          u64 bytes_reused   = nfo->server_v1.bytes_reused;
+          nfo->server.bytes_reserved = htonl (SATURATE_U32 (bytes_reserved));
+          nfo->server.bytes_used     = htonl (SATURATE_U32 (bytes_used));
+          nfo->server.bytes_free     = htonl (SATURATE_U32 (bytes_free));
+          nfo->server.bytes_reused   = htonl (SATURATE_U32 (bytes_reused));
+          payload_buffer->nmemb = sizeof (nfo->server);
+        }
+      else
+        {
+          return STATUS_PROTOCOL_ERROR;
+        }
     }
 
   return STATUS_OK;
@@ -765,6 +1236,7 @@ handle_request (Client *client, Request *request, Payload **response_payload)
   tss_set (current_log_queue, &worker->log_queue);
 
   *response_payload = NULL;
+  worker->payload_buffer.compressed = false;
 
   start_tick = get_performance_counter ();
 
@@ -3,7 +3,7 @@
 
 #include "types.h"
 
-int         init_controller (void);
+int         init_controller (const RuntimeConfig *);
 StatusCode  handle_request  (Client *, Request *, Payload **);
 
 #endif /* ! CONTROLLER_H */
@@ -1,15 +1,52 @@
+#include <assert.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
 
 #include "entry.h"
+#include "epoch.h"
 #include "log.h"
+#include "memory.h"
 #include "util.h"
 
-#define LOCK_SLOT(m, s) \
-  do {} while (atomic_flag_test_and_set_explicit (&(map)->guards[s], \
-                                                  memory_order_acquire))
-#define UNLOCK_SLOT(m, s) \
-  atomic_flag_clear_explicit (&(m)->guards[s], memory_order_release)
+#define LOCK_SLOT(s)     acquire_lock (&(s)->guard, LOCK_CLASS_SLOT)
+#define UNLOCK_SLOT(s)   release_lock (&(s)->guard)
+#define TRY_LOCK_SLOT(s) try_acquire_lock (&(s)->guard)
+#define IS_SLOT_LOCKED(s) \
+  (atomic_load_explicit (&(s)->guard, memory_order_acquire) != LOCK_FREE)
+
+// Control bytes hold the hash tag of used slots, see `lock_slot_of_key'
+#define CTRL_EMPTY   0x80
+#define CTRL_DELETED 0xFE
+
+#if GROUP_PROBING
+# define TABLE_CTRL(t) ((u8 *) &(t)->slots[(t)->size])
+# define SET_CTRL(t, s, c) \
+  __atomic_store_n (&TABLE_CTRL (t)[(s) - (t)->slots], (c), __ATOMIC_RELEASE)
+#else
+# define SET_CTRL(t, s, c) do {} while (0)
+#endif
+
+// Slots are written with their lock held but read without by
+// `get_cache_entry', so the state goes last
+#define SET_SLOT(s, st, h, n, e)                                        \
+  do {                                                                  \
+    __atomic_store_n (&(s)->hash, (h), __ATOMIC_RELAXED);               \
+    __atomic_store_n (&(s)->nmemb, (n), __ATOMIC_RELAXED);              \
+    __atomic_store_n (&(s)->entry, (e), __ATOMIC_RELEASE);              \
+    __atomic_store_n (&(s)->state, (st), __ATOMIC_RELEASE);             \
+  } while (0)
+
+// Leave a tombstone so probes for keys stored past the slot don't end there
+#define DELETE_SLOT(t, s)                                               \
+  do {                                                                  \
+    SET_SLOT (s, SLOT_DELETED, 0, 0, NULL);                             \
+    SET_CTRL (t, s, CTRL_DELETED);                                      \
+    atomic_fetch_add_explicit (&(t)->ntombstones, 1, memory_order_relaxed); \
+  } while (0)
 
 #define LOCK_ENTRY_AND_LOG_SPIN(e)                              \
   do {                                                          \
@@ -21,33 +58,184 @@
       }                                                         \
   } while (0)
 
+// Probing: Keys are looked for from the slot their hash maps to until the first
+// empty slot.  Deleted slots are left as tombstones that don't end probes and
+// are reused by later inserts.  A SET holds on to the first free slot while it
+// checks the rest of the probe for the same key, so two requests setting the
+// same key can't both insert it.
+//
+// Group probing: With GROUP_PROBING probes start at the first slot of a group
+// of CACHE_ENTRY_GROUP_SIZE slots.  Each slot has a control byte holding the 7
+// bit tag of its hash (or CTRL_EMPTY or CTRL_DELETED), and the control bytes of
+// a group are compared in one go so lookups only lock the slots with a matching
+// tag.  A probe ends at the first group with an empty slot.  Control bytes are
+// only written with their slot locked, lookups read them without locking and
+// check the slot again once they've locked it.
+//
+// Resizing: Each map starts out with MIN_CACHE_ENTRY_MAP_SIZE slots and once
+// it holds more entries than the load factor allows a table of twice the size
+// is swapped in.  The entries of the old table are then migrated a few slots at
+// a time by the requests hitting the map, so lookups check the old table before
+// the new one until it's empty and released.  An entry is added to the new
+// table before it's removed from the old one so it's always found.  Maps that
+// empty out are shrunk the same way and maps full of tombstones are rehashed
+// into a table of the same size.
+//
+// Tables are only swapped while no thread is using them (see `enter_map').
+// Swaps and migration steps are only ever tried so they never wait for slot or
+// entry locks held by the threads resizing.
+
+static u32 max_load = (u32) (DEFAULT_INDEX_LOAD_FACTOR * 0x100); // In 1/256ths
+
+static _Atomic (u64) num_slots = 0;
+static _Atomic (u64) num_grown_maps = 0;
+static _Atomic (u64) num_shrunk_maps = 0;
+static _Atomic (u64) num_rehashed_maps = 0;
+static _Atomic (u64) num_failed_resizes = 0;
+
+// The high half of the key hash already picked the map (`get_map_index')
 static inline u32
-get_hash (const u8 *base, u32 nmemb)
+get_slot_index (const CacheEntryTable *table, u64 hash)
 {
-  u32 hash = 5381;
-  for (; nmemb > 0; --nmemb)
-    hash = ((hash << 5) + hash) ^ *(base++);
-  return hash;
+#if GROUP_PROBING
+  return (u32) hash & (table->size - 1) & ~(CACHE_ENTRY_GROUP_SIZE - 1);
+#else
+  return (u32) hash & (table->size - 1);
+#endif
 }
 
-static inline u32
-get_key_hash (CacheKey key)
+// Bits of the hash above any slot index, so they differ within a probe
+static inline u8
+get_hash_tag (u64 hash)
 {
-  return get_hash (key.base, key.nmemb);
+  return (hash >> 25) & 0x7F;
 }
 
-void
-init_cache_entry_map (CacheEntryHashMap *map)
+static CacheEntryTable *
+reserve_entry_table (u32 size)
 {
-  cik_assert (map);
+  CacheEntryTable *table;
+  void            *memory;
+
+  cik_assert ((size & (size - 1)) == 0);
+  static_assert ((CACHE_LINE_SIZE % sizeof (CacheEntrySlot)) == 0,
+                 "Slots must not straddle cache lines");
+
+  // Buckets are only aligned to `max_align_t' so reserve enough to align the
+  // slots to a cache line ourselves
+  memory = reserve_memory (CACHE_LINE_SIZE + sizeof (CacheEntryTable)
+                           + (size * sizeof (CacheEntrySlot))
+                           + (GROUP_PROBING ? size : 0));
+  if (memory == NULL)
+    return NULL;
+
+  table = (CacheEntryTable *) (((uintptr_t) memory + CACHE_LINE_SIZE - 1)
+                               & ~(uintptr_t) (CACHE_LINE_SIZE - 1));
+  table->memory = memory;
+  table->size = size;
+  atomic_init (&table->ntombstones, 0);
+  for (u32 i = 0; i < size; ++i)
+    {
+      table->slots[i].state = SLOT_EMPTY;
+      atomic_init (&table->slots[i].guard, LOCK_INIT);
+      table->slots[i].hash  = 0;
+      table->slots[i].entry = NULL;
+      table->slots[i].nmemb = 0;
+    }
+#if GROUP_PROBING
+  memset (TABLE_CTRL (table), CTRL_EMPTY, size);
+#endif
 
-  for (u32 i = 0; i < CACHE_ENTRY_MAP_SIZE; ++i)
+  atomic_fetch_add (&num_slots, size);
+
+  return table;
+}
+
+static void
+release_entry_table (CacheEntryTable *table)
+{
+  wait_for_readers (); // Unlocked lookups might still be probing it
+  atomic_fetch_sub (&num_slots, table->size);
+  release_memory (table->memory);
+}
+
+int
+init_cache_entry_maps (const RuntimeConfig *config)
+{
+  max_load = (u32) (config->index_load_factor * 0x100);
+
+  for (u32 i = 0; i < NUM_CACHE_ENTRY_MAPS; ++i)
     {
-      map->mask[i] = false;
-      map->guards[i] = (atomic_flag) ATOMIC_FLAG_INIT;
-      map->hashes[i] = 0;
-      map->entries[i] = NULL;
+      CacheEntryHashMap *map   = entry_maps[i];
+      CacheEntryTable   *table = reserve_entry_table (MIN_CACHE_ENTRY_MAP_SIZE);
+      if (table == NULL)
+        return ENOMEM;
+
+      atomic_init (&map->table, table);
+      atomic_init (&map->old, NULL);
+      atomic_init (&map->count, 0);
+      atomic_init (&map->nreaders, 0);
+      atomic_init (&map->resizing, false);
+      atomic_init (&map->swaps, 0);
+      atomic_init (&map->migrate_lock, LOCK_INIT);
+      map->migrate_pos = 0;
+      atomic_init (&map->clock_hand, 0);
     }
+
+  return 0;
+}
+
+// Keep the tables of `map' from being swapped (and released) until we leave
+static inline void
+enter_map (CacheEntryHashMap *map)
+{
+  for (;;)
+    {
+      atomic_fetch_add (&map->nreaders, 1);
+      if (!atomic_load (&map->resizing))
+        return;
+      atomic_fetch_sub (&map->nreaders, 1);
+      // Swaps are quick but the swapping thread might not be running
+      for (u32 i = 0;
+           atomic_load_explicit (&map->resizing, memory_order_relaxed); ++i)
+        {
+          if (i < LOCK_SPIN_LIMIT)
+            CPU_RELAX ();
+          else
+            thrd_yield ();
+        }
+    }
+}
+
+static inline void
+leave_map (CacheEntryHashMap *map)
+{
+  atomic_fetch_sub (&map->nreaders, 1);
+}
+
+static inline bool
+try_begin_swap (CacheEntryHashMap *map)
+{
+  bool expected = false;
+
+  if (!atomic_compare_exchange_strong (&map->resizing, &expected, true))
+    return false;
+
+  if (atomic_load (&map->nreaders) == 0)
+    {
+      atomic_fetch_add (&map->swaps, 1); // Odd while swapping
+      return true;
+    }
+
+  atomic_store (&map->resizing, false);
+  return false;
+}
+
+static inline void
+end_swap (CacheEntryHashMap *map)
+{
+  atomic_fetch_add (&map->swaps, 1);
+  atomic_store (&map->resizing, false);
 }
 
 // @Note: Segfaults if any key base ptr is NULL
@@ -59,177 +247,643 @@ init_cache_entry_map (CacheEntryHashMap *map)
 // @Note: Evaluates to false if both entries are NULL
 #define CMP_ENTRY_KEYS(a, b) (((a) && (b)) && CMP_KEYS((a)->key, (b)->key))
 
-CacheEntry *
-lock_and_get_cache_entry (CacheEntryHashMap *map, CacheKey key)
+// Check if the locked slot `s' holds `key'.  If so its entry is locked too,
+// unless it's `locked' since the caller already holds it.  Keys of mapped
+// entries never change so there's no need to lock the entry to compare them.
+static inline bool
+lock_entry_of_key (CacheEntrySlot *s, CacheKey key, CacheEntry *locked)
 {
-  u32 hash, slot, pos;
+  if ((s->state != SLOT_USED) || (s->hash != key.hash)
+      || (s->nmemb != key.nmemb))
+    return false;
+  if (s->entry == locked)
+    return true;
+  if (!CMP_KEYS (s->entry->key, key))
+    return false;
+  LOCK_ENTRY_AND_LOG_SPIN (s->entry);
+  return true;
+}
 
-  cik_assert (map);
-  cik_assert (key.base);
+// Check if `s' holds `key' without locking it.  The entry might be unmapped
+// and released right after, see epoch.c.  Returns BUSY_ENTRY if the slot is
+// locked since walk callbacks release entries before the walk unmaps them.
+// Whoever locks it after we've looked waits for us before releasing anything.
+static inline CacheEntry *
+get_entry_of_key (CacheEntrySlot *s, CacheKey key)
+{
+  CacheEntry *entry;
 
-  hash = get_key_hash (key);
-  slot = hash % CACHE_ENTRY_MAP_SIZE;
-  pos  = slot;
+  if ((__atomic_load_n (&s->state, __ATOMIC_ACQUIRE) != SLOT_USED)
+      || (__atomic_load_n (&s->hash, __ATOMIC_RELAXED) != key.hash)
+      || (__atomic_load_n (&s->nmemb, __ATOMIC_RELAXED) != key.nmemb))
+    return NULL;
+
+  if (IS_SLOT_LOCKED (s))
+    return BUSY_ENTRY;
+
+  // The slot may have been reused since we read its state.  Keys of mapped
+  // entries never change so checking the key is enough.
+  entry = __atomic_load_n (&s->entry, __ATOMIC_ACQUIRE);
+  if (entry && (entry->key.hash == key.hash) && CMP_KEYS (entry->key, key))
+    return entry;
+
+  return NULL;
+}
+
+#if GROUP_PROBING
+
+// Bit mask of the control bytes of a group that are `c'
+static inline u32
+match_group (const u8 *ctrl, u8 c)
+{
+#ifdef __SSE2__
+  __m128i group = _mm_loadu_si128 ((const __m128i *) ctrl);
+  return (u32) _mm_movemask_epi8 (_mm_cmpeq_epi8 (group,
+                                                  _mm_set1_epi8 ((char) c)));
+#else
+  u32 mask = 0;
+  for (u32 i = 0; i < CACHE_ENTRY_GROUP_SIZE; ++i)
+    mask |= (u32) (__atomic_load_n (&ctrl[i], __ATOMIC_ACQUIRE) == c) << i;
+  return mask;
+#endif
+}
+
+// Find the slot of `key' in `table' and return it locked along with its entry.
+// The entry isn't locked if it's `locked' since the caller already holds it.
+static CacheEntrySlot *
+lock_slot_of_key (CacheEntryTable *table, CacheKey key, CacheEntry *locked)
+{
+  u32 mask  = table->size - 1;
+  u32 group = get_slot_index (table, key.hash);
+  u32 pos   = group;
+  u8  tag   = get_hash_tag (key.hash);
 
   do
     {
-      LOCK_SLOT (map, pos);
-      if (map->mask[pos])
+      const u8 *ctrl = &TABLE_CTRL (table)[pos];
+
+      for (u32 match = match_group (ctrl, tag); match; match &= match - 1)
         {
-          if (map->hashes[pos] == hash)
-            {
-              LOCK_ENTRY_AND_LOG_SPIN (map->entries[pos]);
-              if (CMP_KEYS (map->entries[pos]->key, key))
-                {
-                  UNLOCK_SLOT (map, pos);
-                  return map->entries[pos]; // Caller now owns entry lock
-                }
-              UNLOCK_ENTRY (map->entries[pos]);
-            }
+          CacheEntrySlot *s = &table->slots[pos + __builtin_ctz (match)];
+          LOCK_SLOT (s);
+          if (lock_entry_of_key (s, key, locked))
+            return s; // Caller now owns slot and entry lock
+          UNLOCK_SLOT (s);
         }
-      UNLOCK_SLOT (map, pos);
-      ++pos;
-      if (pos >= CACHE_ENTRY_MAP_SIZE)
-        pos = 0;
+
+      if (match_group (ctrl, CTRL_EMPTY))
+        return NULL; // End of probe
+
+      pos = (pos + CACHE_ENTRY_GROUP_SIZE) & mask;
+    }
+  while (pos != group);
+
+  return NULL;
+}
+
+// Like `lock_slot_of_key' but without locking anything, see `get_cache_entry'
+static CacheEntry *
+find_entry_of_key (CacheEntryTable *table, CacheKey key)
+{
+  u32 mask  = table->size - 1;
+  u32 group = get_slot_index (table, key.hash);
+  u32 pos   = group;
+  u8  tag   = get_hash_tag (key.hash);
+
+  do
+    {
+      const u8 *ctrl = &TABLE_CTRL (table)[pos];
+
+      for (u32 match = match_group (ctrl, tag); match; match &= match - 1)
+        {
+          CacheEntrySlot *s = &table->slots[pos + __builtin_ctz (match)];
+          CacheEntry *entry = get_entry_of_key (s, key);
+          if (entry)
+            return entry;
+        }
+
+      if (match_group (ctrl, CTRL_EMPTY))
+        return NULL; // End of probe
+
+      pos = (pos + CACHE_ENTRY_GROUP_SIZE) & mask;
+    }
+  while (pos != group);
+
+  return NULL;
+}
+
+#else
+
+// Find the slot of `key' in `table' and return it locked along with its entry.
+// The entry isn't locked if it's `locked' since the caller already holds it.
+static CacheEntrySlot *
+lock_slot_of_key (CacheEntryTable *table, CacheKey key, CacheEntry *locked)
+{
+  u32 mask = table->size - 1;
+  u32 slot = get_slot_index (table, key.hash);
+  u32 pos  = slot;
+
+  do
+    {
+      CacheEntrySlot *s = &table->slots[pos];
+      LOCK_SLOT (s);
+      if (s->state == SLOT_EMPTY)
+        {
+          UNLOCK_SLOT (s);
+          return NULL; // End of probe
+        }
+      if (lock_entry_of_key (s, key, locked))
+        return s; // Caller now owns slot and entry lock
+      UNLOCK_SLOT (s);
+      pos = (pos + 1) & mask;
     }
   while (pos != slot);
 
   return NULL;
 }
 
-CacheEntry *
-lock_and_unset_cache_entry (CacheEntryHashMap *map, CacheKey key)
+// Like `lock_slot_of_key' but without locking anything, see `get_cache_entry'
+static CacheEntry *
+find_entry_of_key (CacheEntryTable *table, CacheKey key)
 {
-  u32 hash, slot, pos;
+  u32 mask = table->size - 1;
+  u32 slot = get_slot_index (table, key.hash);
+  u32 pos  = slot;
 
-  cik_assert (map);
-  cik_assert (key.base);
+  do
+    {
+      CacheEntrySlot *s = &table->slots[pos];
+      CacheEntry *entry;
+
+      if (__atomic_load_n (&s->state, __ATOMIC_ACQUIRE) == SLOT_EMPTY)
+        return NULL; // End of probe
 
-  hash = get_key_hash (key);
-  slot = hash % CACHE_ENTRY_MAP_SIZE;
+      entry = get_entry_of_key (s, key);
+      if (entry)
+        return entry;
+
+      pos = (pos + 1) & mask;
+    }
+  while (pos != slot);
+
+  return NULL;
+}
+
+#endif /* GROUP_PROBING */
+
+// Find the slot to put `entry' in.  Returns it locked, with its entry locked
+// too if it holds one with the same key.  Otherwise it's the first free slot
+// of the probe, which we keep locked while checking the rest of the probe.
+static CacheEntrySlot *
+lock_slot_for_entry (CacheEntryTable *table, CacheEntry *entry)
+{
+  u32 mask = table->size - 1;
+  u32 slot = get_slot_index (table, entry->key.hash);
+  u32 pos;
+  CacheEntrySlot *free;
+
+ retry:
+  free = NULL;
   pos  = slot;
 
   do
     {
-      LOCK_SLOT (map, pos);
-      if (map->mask[pos])
+      CacheEntrySlot *s = &table->slots[pos];
+
+      if (!free)
         {
-          if (map->hashes[pos] == hash)
+          LOCK_SLOT (s);
+        }
+      else if (!TRY_LOCK_SLOT (s))
+        {
+          // Never wait for a slot while holding another, that could deadlock
+          // with a SET probing the other way round a full table
+          UNLOCK_SLOT (free);
+          thrd_yield ();
+          goto retry;
+        }
+
+      if (s->state == SLOT_EMPTY)
+        {
+          if (!free)
+            return s;
+          UNLOCK_SLOT (s);
+          return free;
+        }
+
+      if (s->state == SLOT_DELETED)
+        {
+          if (!free)
             {
-              LOCK_ENTRY_AND_LOG_SPIN (map->entries[pos]);
-              if (CMP_KEYS (map->entries[pos]->key, key))
-                {
-                  CacheEntry *entry = map->entries[pos];
-                  map->mask[pos] = false;
-                  map->hashes[pos] = 0;
-                  map->entries[pos] = NULL;
-                  UNLOCK_SLOT (map, pos);
-                  return entry; // Caller now owns entry lock
-                }
-              UNLOCK_ENTRY (map->entries[pos]);
+              free = s; // Keep it locked
+              pos = (pos + 1) & mask;
+              continue;
             }
         }
-      UNLOCK_SLOT (map, pos);
-      ++pos;
-      if (pos >= CACHE_ENTRY_MAP_SIZE)
-        pos = 0;
+      else if ((s->hash == entry->key.hash) && (s->nmemb == entry->key.nmemb))
+        {
+          CacheEntry *occupant = s->entry;
+          cik_assert (occupant != NULL);
+          if ((occupant == entry) || CMP_ENTRY_KEYS (occupant, entry))
+            {
+              if (occupant != entry)
+                LOCK_ENTRY_AND_LOG_SPIN (occupant);
+              if (free)
+                UNLOCK_SLOT (free);
+              return s; // Caller now owns slot and entry lock
+            }
+        }
+
+      UNLOCK_SLOT (s);
+      pos = (pos + 1) & mask;
     }
   while (pos != slot);
 
-  return NULL;
+  return free; // No empty slot in the whole table
+}
+
+// Move the entry of the locked slot `from' to the first free slot of `table'.
+// Gives up if that slot is busy.
+static bool
+try_migrate_slot (CacheEntryTable *table, CacheEntrySlot *from)
+{
+  u32 mask = table->size - 1;
+  u32 slot = get_slot_index (table, from->hash);
+  u32 pos  = slot;
+
+  do
+    {
+      CacheEntrySlot *s = &table->slots[pos];
+      if (!TRY_LOCK_SLOT (s))
+        return false;
+      if (s->state != SLOT_USED)
+        {
+          if (s->state == SLOT_DELETED)
+            atomic_fetch_sub_explicit (&table->ntombstones, 1,
+                                       memory_order_relaxed);
+          SET_SLOT (s, SLOT_USED, from->hash, from->nmemb, from->entry);
+          SET_CTRL (table, s, get_hash_tag (from->hash));
+          UNLOCK_SLOT (s);
+          return true;
+        }
+      UNLOCK_SLOT (s);
+      pos = (pos + 1) & mask;
+    }
+  while (pos != slot);
+
+  return false;
+}
+
+// Migrate a few slots of the old table and release it once it's empty
+static void
+migrate_slots (CacheEntryHashMap *map)
+{
+  CacheEntryTable *old, *table;
+
+  if (!try_acquire_lock (&map->migrate_lock))
+    return; // Someone else is on it
+
+  enter_map (map);
+  old   = atomic_load (&map->old);
+  table = atomic_load (&map->table);
+  for (u32 n = 0;
+       old && (n < CACHE_ENTRY_MIGRATE_SLOTS) && (map->migrate_pos < old->size);
+       ++n)
+    {
+      CacheEntrySlot *from = &old->slots[map->migrate_pos];
+      bool migrated = true;
+
+      if (!TRY_LOCK_SLOT (from))
+        break;
+      if (from->state == SLOT_USED)
+        {
+          // Lookups in the old table must still go on past it
+          migrated = try_migrate_slot (table, from);
+          if (migrated)
+            DELETE_SLOT (old, from);
+        }
+      UNLOCK_SLOT (from);
+      if (!migrated)
+        break;
+
+      ++map->migrate_pos;
+    }
+  leave_map (map);
+
+  if (old && (map->migrate_pos == old->size) && try_begin_swap (map))
+    {
+      atomic_store (&map->old, NULL);
+      end_swap (map);
+      release_entry_table (old);
+    }
+
+  release_lock (&map->migrate_lock);
+}
+
+static void
+try_resize_map (CacheEntryHashMap *map, u32 size, u32 new_size)
+{
+  CacheEntryTable *table;
+
+  if (!try_acquire_lock (&map->migrate_lock))
+    return;
+
+  table = reserve_entry_table (new_size);
+  if (table == NULL)
+    {
+      atomic_fetch_add (&num_failed_resizes, 1);
+    }
+  else
+    {
+      if (try_begin_swap (map))
+        {
+          CacheEntryTable *current = atomic_load (&map->table);
+          if (!atomic_load (&map->old) && (current->size == size))
+            {
+              atomic_store (&map->old, current);
+              atomic_store (&map->table, table);
+              map->migrate_pos = 0;
+              atomic_fetch_add ((new_size > size) ? &num_grown_maps
+                                : (new_size < size) ? &num_shrunk_maps
+                                : &num_rehashed_maps, 1);
+              table = NULL;
+            }
+          end_swap (map);
+        }
+
+      if (table)
+        release_entry_table (table); // Lost a race
+    }
+
+  release_lock (&map->migrate_lock);
+}
+
+// Move resizing along: Migrate some slots if a resize is under way or start
+// one if the map is too full or too empty.  Must not be called while holding
+// a slot lock of the map.
+static void
+maintain_map (CacheEntryHashMap *map)
+{
+  u32 size, count, ntombstones;
+
+  if (atomic_load (&map->old))
+    {
+      migrate_slots (map);
+      return;
+    }
+
+  enter_map (map);
+  size = atomic_load (&map->table)->size;
+  ntombstones = atomic_load_explicit (&atomic_load (&map->table)->ntombstones,
+                                      memory_order_relaxed);
+  leave_map (map);
+  count = atomic_load (&map->count);
+
+  if (((u64) count * 0x100 > (u64) size * max_load)
+      && (size < MAX_CACHE_ENTRY_MAP_SIZE))
+    try_resize_map (map, size, size * 2);
+  else if (((u64) count * 0x400 < (u64) size * max_load)
+           && (size > MIN_CACHE_ENTRY_MAP_SIZE))
+    try_resize_map (map, size, size / 2); // Less than a quarter of the target
+  else if ((ntombstones > 0)
+           && ((u64) (count + ntombstones) * 0x100 > (u64) size * max_load))
+    try_resize_map (map, size, size); // Too few empty slots left to end probes
+}
+
+CacheEntry *
+lock_and_get_cache_entry (CacheEntryHashMap *map, CacheKey key)
+{
+  CacheEntryTable *old;
+  CacheEntrySlot  *slot;
+  CacheEntry      *entry = NULL;
+
+  cik_assert (map);
+  cik_assert (key.base);
+
+  enter_map (map);
+  old  = atomic_load (&map->old);
+  slot = old ? lock_slot_of_key (old, key, NULL) : NULL;
+  if (!slot)
+    slot = lock_slot_of_key (atomic_load (&map->table), key, NULL);
+  if (slot)
+    {
+      entry = slot->entry; // Caller now owns entry lock
+      UNLOCK_SLOT (slot);
+    }
+  leave_map (map);
+
+  if (atomic_load (&map->old))
+    migrate_slots (map);
+
+  return entry;
+}
+
+// Find the entry of `key' without locking the map or the entry.  Must be called
+// between `begin_unlocked_read' and `end_unlocked_read' and the entry may only
+// be read until then.  Entries are never changed once mapped (other than their
+// expiry time and hit counters) so they can be read as is.  Returns BUSY_ENTRY
+// if its slot is locked, in which case the entry has to be locked instead.
+CacheEntry *
+get_cache_entry (CacheEntryHashMap *map, CacheKey key)
+{
+  cik_assert (map);
+  cik_assert (key.base);
+
+  for (;;)
+    {
+      u32 swaps = atomic_load (&map->swaps);
+      CacheEntryTable *old, *table;
+      CacheEntry *entry;
+
+      if (swaps & 1)
+        continue; // Tables are being swapped, which is quick
+
+      old   = atomic_load (&map->old);
+      table = atomic_load (&map->table);
+      entry = old ? find_entry_of_key (old, key) : NULL;
+      if (!entry)
+        entry = find_entry_of_key (table, key);
+
+      // Entries are added to the new table before they're removed from the
+      // old one, but if tables were swapped meanwhile we may have missed it
+      if (entry || (atomic_load (&map->swaps) == swaps))
+        return entry;
+    }
+}
+
+CacheEntry *
+lock_and_unset_cache_entry (CacheEntryHashMap *map, CacheKey key)
+{
+  CacheEntryTable *table;
+  CacheEntrySlot  *slot;
+  CacheEntry      *entry = NULL;
+
+  cik_assert (map);
+  cik_assert (key.base);
+
+  enter_map (map);
+  table = atomic_load (&map->old);
+  slot  = table ? lock_slot_of_key (table, key, NULL) : NULL;
+  if (!slot)
+    {
+      table = atomic_load (&map->table);
+      slot  = lock_slot_of_key (table, key, NULL);
+    }
+  if (slot)
+    {
+      entry = slot->entry; // Caller now owns entry lock
+      DELETE_SLOT (table, slot);
+      UNLOCK_SLOT (slot);
+      atomic_fetch_sub (&map->count, 1);
+    }
+  leave_map (map);
+
+  if (entry)
+    maintain_map (map);
+
+  return entry;
 }
 
 bool
 set_locked_cache_entry (CacheEntryHashMap *map, CacheEntry *entry,
                         CacheEntry **old_entry)
 {
-  bool found = false;
-  u32 hash, slot, pos;
+  CacheEntryTable *table;
+  CacheEntrySlot  *slot;
 
   cik_assert (map);
   cik_assert (entry->key.base);
   cik_assert (entry->value.base);
   cik_assert (old_entry != NULL);
 
-  hash = get_key_hash (entry->key);
-  slot = hash % CACHE_ENTRY_MAP_SIZE;
-  pos  = slot;
+  enter_map (map);
 
-  do
+  // An entry with the same key that's yet to be migrated is replaced in place
+  table = atomic_load (&map->old);
+  slot  = table ? lock_slot_of_key (table, entry->key, entry) : NULL;
+  if (!slot)
     {
-      LOCK_SLOT (map, pos);
-      if (map->mask[pos])
-        {
-          if (map->hashes[pos] == hash)
-            {
-              CacheEntry *occupant = map->entries[pos];
-              cik_assert (occupant != NULL);
-              if (occupant == entry)
-                {
-                  err_print ("ALREADY SET \"%.*s\"\n",
-                             entry->key.nmemb, entry->key.base);
-                  UNLOCK_SLOT (map, pos);
-                  return true;
-                }
-
-              LOCK_ENTRY_AND_LOG_SPIN (occupant);
-              if (CMP_ENTRY_KEYS (occupant, entry))
-                {
-                  cik_assert (*old_entry != entry);
-                  *old_entry = occupant; // Caller now own entry lock
-                  found = true;
-                  break; // slot is still locked
-                }
-              UNLOCK_ENTRY (occupant);
-            }
-          UNLOCK_SLOT (map, pos);
-          // @Bug: We can get duplicate keys.  Since the same key can get
-          // different pos'es depending on what else is currently in the map we
-          // /can/ get duplicate keys.  But in that case the most recently added
-          // entry will be closest to the initially calculated pos and hence
-          // matched before the older duplicate.  This inconsistency has to be
-          // handled in a higher layer for now.  Ensuring consistency here would
-          // impact @Speed.
-          ++pos;
-          if (pos >= CACHE_ENTRY_MAP_SIZE)
-            pos = 0;
-        }
-      else
-        {
-          found = true;
-          break; // slot is still locked
-        }
+      table = atomic_load (&map->table);
+      slot  = lock_slot_for_entry (table, entry);
     }
-  while (pos != slot);
 
-  if (!found)
+  if (!slot)
     {
+      leave_map (map);
       err_print ("No slot found for \"%.*s\"\n",
                  entry->key.nmemb, entry->key.base);
+      maintain_map (map);
       return false;
     }
 
-  map->mask[pos] = true;
-  map->hashes[pos] = hash;
-  map->entries[pos] = entry;
-  UNLOCK_SLOT (map, pos);
+  if (slot->entry == entry)
+    {
+      err_print ("ALREADY SET \"%.*s\"\n",
+                 entry->key.nmemb, entry->key.base);
+      UNLOCK_SLOT (slot);
+      leave_map (map);
+      return true;
+    }
+
+  if (slot->state == SLOT_USED)
+    {
+      cik_assert (*old_entry != entry);
+      *old_entry = slot->entry; // Caller now owns entry lock
+    }
+  else
+    {
+      if (slot->state == SLOT_DELETED)
+        atomic_fetch_sub_explicit (&table->ntombstones, 1,
+                                   memory_order_relaxed);
+      atomic_fetch_add (&map->count, 1);
+    }
+
+  SET_SLOT (slot, SLOT_USED, entry->key.hash, entry->key.nmemb, entry);
+  SET_CTRL (table, slot, get_hash_tag (entry->key.hash));
+  UNLOCK_SLOT (slot);
+
+  leave_map (map);
+
+  maintain_map (map);
 
   return true;
 }
 
+static void
+walk_table (CacheEntryHashMap *map, CacheEntryTable *table,
+            CacheEntryWalkCb callback, void *user_data)
+{
+  for (u32 pos = 0; pos < table->size; ++pos)
+    {
+      CacheEntrySlot *slot = &table->slots[pos];
+      LOCK_SLOT (slot);
+      if (slot->state == SLOT_USED)
+        {
+          CacheEntry *entry = slot->entry;
+          cik_assert (entry != NULL);
+
+          LOCK_ENTRY_AND_LOG_SPIN (entry);
+
+          if (callback (entry, user_data))
+            {
+              // Caller now owns entry lock
+              DELETE_SLOT (table, slot);
+              atomic_fetch_sub (&map->count, 1);
+            }
+          else
+            {
+              UNLOCK_ENTRY (entry);
+            }
+        }
+      UNLOCK_SLOT (slot);
+    }
+}
+
 void
 walk_entries (CacheEntryHashMap *map, CacheEntryWalkCb callback,
               void *user_data)
 {
+  CacheEntryTable *old;
+
   cik_assert (map);
   cik_assert (callback);
 
-  for (u32 pos = 0; pos < CACHE_ENTRY_MAP_SIZE; ++pos)
+  // Hold off migration so no entry is visited twice
+  acquire_lock (&map->migrate_lock, LOCK_CLASS_MIGRATE);
+
+  enter_map (map);
+  old = atomic_load (&map->old);
+  if (old)
+    walk_table (map, old, callback, user_data);
+  walk_table (map, atomic_load (&map->table), callback, user_data);
+  leave_map (map);
+
+  release_lock (&map->migrate_lock);
+
+  maintain_map (map);
+}
+
+// Visit the slots of one table on the probe of `hash' until it ends
+static void
+walk_probe (CacheEntryHashMap *map, CacheEntryTable *table, u64 hash,
+            CacheEntryWalkCb callback, void *user_data)
+{
+  u32 mask = table->size - 1;
+  u32 slot = get_slot_index (table, hash);
+  u32 pos  = slot;
+
+  do
     {
-      LOCK_SLOT (map, pos);
-      if (map->mask[pos])
+      CacheEntrySlot *s = &table->slots[pos];
+      LOCK_SLOT (s);
+      if (s->state == SLOT_EMPTY)
+        {
+          UNLOCK_SLOT (s);
+          return; // End of probe
+        }
+      if ((s->state == SLOT_USED) && (s->hash == hash))
         {
-          CacheEntry *entry = map->entries[pos];
+          CacheEntry *entry = s->entry;
           cik_assert (entry != NULL);
 
           LOCK_ENTRY_AND_LOG_SPIN (entry);
@@ -237,19 +891,156 @@ walk_entries (CacheEntryHashMap *map, CacheEntryWalkCb callback,
           if (callback (entry, user_data))
             {
               // Caller now owns entry lock
-              map->mask[pos] = false;
-              map->hashes[pos] = 0;
-              map->entries[pos] = NULL;
+              DELETE_SLOT (table, s);
+              atomic_fetch_sub (&map->count, 1);
             }
           else
             {
               UNLOCK_ENTRY (entry);
             }
         }
-      UNLOCK_SLOT (map, pos);
+      UNLOCK_SLOT (s);
+      pos = (pos + 1) & mask;
+    }
+  while (pos != slot);
+}
+
+// Like `walk_entries' but only visits the entries with a key hashing to
+// `hash', without having to know the keys.  Inserts go to the first free slot
+// of a probe in both probing modes, so a linear probe finds them all.  An entry
+// migrated while we're at it may be visited twice.
+void
+walk_entries_of_hash (CacheEntryHashMap *map, u64 hash,
+                      CacheEntryWalkCb callback, void *user_data)
+{
+  CacheEntryTable *old;
+
+  cik_assert (map);
+  cik_assert (callback);
+
+  enter_map (map);
+  old = atomic_load (&map->old);
+  if (old)
+    walk_probe (map, old, hash, callback, user_data);
+  walk_probe (map, atomic_load (&map->table), hash, callback, user_data);
+  leave_map (map);
+
+  maintain_map (map);
+}
+
+// Like `walk_entries' but only visits `nslots' slots from `start' (wrapping
+// around) and skips any slot or entry that is currently locked.  Slots of a
+// table being migrated come before the ones of the new table.  This never
+// blocks so it's safe to call while holding other locks.
+void
+try_walk_entries (CacheEntryHashMap *map, u32 start, u32 nslots,
+                  CacheEntryWalkCb callback, void *user_data)
+{
+  CacheEntryTable *old, *table;
+  u32 nold, total;
+
+  cik_assert (map);
+  cik_assert (callback);
+
+  enter_map (map);
+  old   = atomic_load (&map->old);
+  table = atomic_load (&map->table);
+  nold  = old ? old->size : 0;
+  total = nold + table->size;
+
+  if (nslots > total)
+    nslots = total;
+
+  for (u32 pos = start % total; nslots > 0; --nslots)
+    {
+      CacheEntryTable *t    = (pos < nold) ? old : table;
+      CacheEntrySlot  *slot = &t->slots[(pos < nold) ? pos : (pos - nold)];
+      if (TRY_LOCK_SLOT (slot))
+        {
+          CacheEntry *entry = slot->entry;
+          if ((slot->state == SLOT_USED) && TRY_LOCK_ENTRY (entry))
+            {
+              if (callback (entry, user_data))
+                {
+                  // Caller now owns entry lock
+                  DELETE_SLOT (t, slot);
+                  atomic_fetch_sub (&map->count, 1);
+                }
+              else
+                {
+                  UNLOCK_ENTRY (entry);
+                }
+            }
+          UNLOCK_SLOT (slot);
+        }
+      if (++pos >= total)
+        pos = 0;
+    }
+
+  leave_map (map);
+}
+
+// Visit the next `nslots' slots of `map' after the ones visited last time, see
+// `try_walk_entries'
+void
+try_sweep_entries (CacheEntryHashMap *map, u32 nslots,
+                   CacheEntryWalkCb callback, void *user_data)
+{
+  u32 start = atomic_fetch_add_explicit (&map->clock_hand, nslots,
+                                         memory_order_relaxed);
+  try_walk_entries (map, start, nslots, callback, user_data);
+}
+
+static void
+try_move_table_entries (CacheEntryTable *table, CacheEntryMoveCb callback,
+                        void *user_data)
+{
+  for (u32 pos = 0; pos < table->size; ++pos)
+    {
+      CacheEntrySlot *slot = &table->slots[pos];
+      if (TRY_LOCK_SLOT (slot))
+        {
+          CacheEntry *entry = slot->entry;
+          if ((slot->state == SLOT_USED) && TRY_LOCK_ENTRY (entry))
+            {
+              entry = callback (entry, user_data);
+              cik_assert (entry != NULL);
+              __atomic_store_n (&slot->entry, entry, __ATOMIC_RELEASE);
+              UNLOCK_ENTRY (entry);
+            }
+          UNLOCK_SLOT (slot);
+        }
     }
 }
 
+// Let `callback' move every entry of `map' that isn't currently locked.  The
+// callback returns the entry to keep in the slot, either the one it was given
+// or a locked copy of it.  Since both the slot and the entry are locked nobody
+// else can be holding on to the old entry.
+void
+try_move_entries (CacheEntryHashMap *map, CacheEntryMoveCb callback,
+                  void *user_data)
+{
+  CacheEntryTable *old;
+
+  cik_assert (map);
+  cik_assert (callback);
+
+  enter_map (map);
+  old = atomic_load (&map->old);
+  if (old)
+    try_move_table_entries (old, callback, user_data);
+  try_move_table_entries (atomic_load (&map->table), callback, user_data);
+  leave_map (map);
+}
+
+// Total number of slots in all maps
+u64
+get_num_cache_entry_slots (void)
+{
+  return atomic_load (&num_slots);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // STATS / DEBUG
 
@@ -277,6 +1068,63 @@ write_entry_stats_cb (CacheEntry *entry, StatsCbData *data)
   return false;
 }
 
+void
+write_cache_entry_map_stats (int fd)
+{
+  u64 nentries = 0, nmigrating = 0, ntombstones = 0;
+  u64 slots = atomic_load (&num_slots);
+  u32 min_size = MAX_CACHE_ENTRY_MAP_SIZE, max_size = 0;
+  u32 min_count = (u32) -1, max_count = 0;
+  u32 occupancy[33] = {}; // Number of maps by log2 of their entry count
+
+  for (u32 i = 0; i < NUM_CACHE_ENTRY_MAPS; ++i)
+    {
+      CacheEntryHashMap *map = entry_maps[i];
+      u32 size, count;
+
+      enter_map (map);
+      size = atomic_load (&map->table)->size;
+      ntombstones += atomic_load (&atomic_load (&map->table)->ntombstones);
+      nmigrating += (atomic_load (&map->old) != NULL);
+      leave_map (map);
+
+      count = atomic_load (&map->count);
+      nentries += count;
+      if (count < min_count)
+        min_count = count;
+      if (count > max_count)
+        max_count = count;
+      ++occupancy[count ? (32 - __builtin_clz (count)) : 0];
+
+      if (size < min_size)
+        min_size = size;
+      if (size > max_size)
+        max_size = size;
+    }
+
+  dprintf (fd, "%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n",
+           "Maps", "Probing", "Slots", "Entries", "Tombstones", "Load",
+           "MinSize", "MaxSize", "Migrating", "Grown", "Shrunk", "Rehashed",
+           "FailedResizes");
+  dprintf (fd, "%u\t%s\t%lu\t%lu\t%lu\t%.3f\t%u\t%u\t%lu\t%lu\t%lu\t%lu\t%lu\n",
+           NUM_CACHE_ENTRY_MAPS, GROUP_PROBING ? "group" : "slot", slots,
+           nentries, ntombstones,
+           slots ? ((double) nentries / slots) : 0., min_size, max_size,
+           nmigrating, atomic_load (&num_grown_maps),
+           atomic_load (&num_shrunk_maps), atomic_load (&num_rehashed_maps),
+           atomic_load (&num_failed_resizes));
+
+  // Keys should spread evenly over maps, see `get_map_for_key'
+  dprintf (fd, "\n%s\t%s\t%s\n", "MinMapEntries", "MaxMapEntries",
+           "MeanMapEntries");
+  dprintf (fd, "%u\t%u\t%.1f\n", min_count, max_count,
+           (double) nentries / NUM_CACHE_ENTRY_MAPS);
+  dprintf (fd, "\n%s\t%s\n", "MapEntries", "Maps");
+  for (u32 i = 0; i < 33; ++i)
+    if (occupancy[i])
+      dprintf (fd, "%u\t%u\n", i ? (1U << (i - 1)) : 0, occupancy[i]);
+}
+
 void
 write_entry_stats (int fd, CacheEntryHashMap **maps, u32 nmaps)
 {
@@ -309,7 +1157,8 @@ debug_print_entry (CacheEntry *entry)
              entry->mtime,
              entry->tags.nmemb,
              entry->key.nmemb, entry->key.base,
-             entry->value.nmemb, entry->value.base
+             entry->value.chunked ? 0 : entry->value.nmemb,
+             entry->value.chunked ? NULL : entry->value.base
              );
 #else
   (void) entry;
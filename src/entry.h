@@ -1,6 +1,7 @@
 #ifndef ENTRY_H
 #define ENTRY_H 1
 
+#include "lock.h"
 #include "types.h"
 
 #define CACHE_KEY_INIT     {}
@@ -15,24 +16,56 @@
   .value   = CACHE_VALUE_INIT,          \
   .expires = CACHE_EXPIRES_INIT,        \
   .mtime   = CACHE_MTIME_INIT,          \
+  .expiry_second = 0,                   \
   .nhits   = 0,                         \
-  .guard   = ATOMIC_FLAG_INIT           \
+  .referenced = false,                  \
+  .guard   = LOCK_INIT                  \
 }
 
-#define LOCK_ENTRY(e) \
-  do {} while (atomic_flag_test_and_set_explicit (&(e)->guard, memory_order_acquire))
-#define UNLOCK_ENTRY(e) \
-  atomic_flag_clear_explicit (&(e)->guard, memory_order_release)
-#define TRY_LOCK_ENTRY(e) \
-  (!atomic_flag_test_and_set_explicit (&(e)->guard, memory_order_acquire))
+#define LOCK_ENTRY(e)     acquire_lock (&(e)->guard, LOCK_CLASS_ENTRY)
+#define UNLOCK_ENTRY(e)   release_lock (&(e)->guard)
+#define TRY_LOCK_ENTRY(e) try_acquire_lock (&(e)->guard)
 
-void        init_cache_entry_map        (CacheEntryHashMap *);
+// Pass as slot count to `try_walk_entries' to visit every slot of a map
+#define ALL_SLOTS ((u32) -1)
+
+// Returned by `get_cache_entry' for entries that have to be locked to be read
+#define BUSY_ENTRY ((CacheEntry *) 1)
+
+// Mark entry as recently used so the eviction clock passes it by once.  Only
+// written if not set already since GET requests don't lock the entry.
+#define TOUCH_ENTRY(e)                                                  \
+  do {                                                                  \
+    if (!__atomic_load_n (&(e)->referenced, __ATOMIC_RELAXED))          \
+      __atomic_store_n (&(e)->referenced, true, __ATOMIC_RELAXED);      \
+  } while (0)
+
+// The high half of the key hash scaled to [0, NUM_CACHE_ENTRY_MAPS), the low
+// half is left for the slot index
+static inline u32
+get_map_index (u64 hash)
+{
+  return ((hash >> 32) * NUM_CACHE_ENTRY_MAPS) >> 32;
+}
+
+int         init_cache_entry_maps       (const RuntimeConfig *);
 CacheEntry *lock_and_get_cache_entry    (CacheEntryHashMap *, CacheKey);
+CacheEntry *get_cache_entry             (CacheEntryHashMap *, CacheKey);
 CacheEntry *lock_and_unset_cache_entry  (CacheEntryHashMap *, CacheKey);
 bool        set_locked_cache_entry      (CacheEntryHashMap *, CacheEntry *,
                                          CacheEntry **);
 void        walk_entries                (CacheEntryHashMap *, CacheEntryWalkCb,
                                          void *);
+void        walk_entries_of_hash        (CacheEntryHashMap *, u64,
+                                         CacheEntryWalkCb, void *);
+void        try_walk_entries            (CacheEntryHashMap *, u32, u32,
+                                         CacheEntryWalkCb, void *);
+void        try_sweep_entries           (CacheEntryHashMap *, u32,
+                                         CacheEntryWalkCb, void *);
+void        try_move_entries            (CacheEntryHashMap *, CacheEntryMoveCb,
+                                         void *);
+u64         get_num_cache_entry_slots   (void);
+void        write_cache_entry_map_stats (int);
 void        write_entry_stats           (int, CacheEntryHashMap **, u32);
 void        debug_print_entry           (CacheEntry *);
 
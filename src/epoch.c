@@ -0,0 +1,84 @@
+#include <stdio.h>
+
+#include "epoch.h"
+
+// GET requests read entries and entry tables without locking them, see
+// `get_cache_entry'.  Memory they may be reading must not be reused until
+// they're done, so anything that releases an unmapped entry or table first
+// waits for the workers that were reading when it was unmapped.
+//
+// Each worker has an epoch of its own, on a cache line of its own, which is
+// odd while it's reading.  Readers only ever write their own epoch and waiting
+// is a scan of NUM_WORKERS epochs, waiting out the odd ones until they change.
+// Reads never wait for anything, so it's fine to wait while holding locks as
+// long as we're not reading ourselves.
+
+typedef struct
+{
+  _Atomic (u64) epoch;
+} __attribute__ ((aligned (CACHE_LINE_SIZE))) ReaderEpoch;
+
+static ReaderEpoch readers[NUM_WORKERS];
+
+static _Atomic (u64) num_waits = 0;
+static _Atomic (u64) num_waited_readers = 0;
+
+void
+begin_unlocked_read (u32 reader)
+{
+  _Atomic (u64) *epoch = &readers[reader].epoch;
+
+  cik_assert (reader < NUM_WORKERS);
+  cik_assert ((atomic_load_explicit (epoch, memory_order_relaxed) & 1) == 0);
+
+  // Sequentially consistent so the loads that follow can't be reordered before
+  // it, see `wait_for_readers'
+  atomic_store (epoch, atomic_load_explicit (epoch, memory_order_relaxed) + 1);
+}
+
+void
+end_unlocked_read (u32 reader)
+{
+  _Atomic (u64) *epoch = &readers[reader].epoch;
+
+  cik_assert (reader < NUM_WORKERS);
+
+  atomic_store_explicit (epoch,
+                         atomic_load_explicit (epoch, memory_order_relaxed) + 1,
+                         memory_order_release);
+}
+
+// Wait until every worker that may have seen memory we've unmapped is done
+// reading.  Must not be called between `begin_unlocked_read' and
+// `end_unlocked_read'.
+void
+wait_for_readers (void)
+{
+  // Order the unmapping stores before loading the epochs.  Either a reader's
+  // epoch is odd by now or it begins reading after the unmapping.
+  atomic_thread_fence (memory_order_seq_cst);
+
+  atomic_fetch_add_explicit (&num_waits, 1, memory_order_relaxed);
+
+  for (u32 i = 0; i < NUM_WORKERS; ++i)
+    {
+      u64 epoch = atomic_load (&readers[i].epoch);
+      if (epoch & 1)
+        {
+          atomic_fetch_add_explicit (&num_waited_readers, 1,
+                                     memory_order_relaxed);
+          // Reads are short but the reader might not be running
+          while (atomic_load_explicit (&readers[i].epoch, memory_order_acquire)
+                 == epoch)
+            thrd_yield ();
+        }
+    }
+}
+
+void
+write_epoch_stats (int fd)
+{
+  dprintf (fd, "\n%s\t%s\n", "ReaderWaits", "WaitedReaders");
+  dprintf (fd, "%lu\t%lu\n", atomic_load (&num_waits),
+           atomic_load (&num_waited_readers));
+}
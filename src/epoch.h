@@ -0,0 +1,11 @@
+#ifndef EPOCH_H
+#define EPOCH_H 1
+
+#include "types.h"
+
+void begin_unlocked_read  (u32);
+void end_unlocked_read    (u32);
+void wait_for_readers     (void);
+void write_epoch_stats    (int);
+
+#endif /* ! EPOCH_H */
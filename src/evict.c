@@ -0,0 +1,325 @@
+#include <stdio.h>
+
+#include "admission.h"
+#include "entry.h"
+#include "epoch.h"
+#include "evict.h"
+#include "log.h"
+#include "memory.h"
+#include "tag.h"
+
+// CLOCK eviction: A shared hand goes round the entry maps, sweeping the next
+// EVICTION_SWEEP_SLOTS slots of each map it visits.  Entries that have
+// been read since the hand last passed get a second chance, the first one that
+// hasn't is evicted and its bucket is handed straight to the caller.  We prefer
+// entries from the size class we need memory from but settle for a bigger one
+// if the hand doesn't come across any.  Otherwise small allocations (tag key
+// lists etc.) could starve once big entries hold all the memory.
+//
+// Entries with chunked values are judged by the size of their first (biggest)
+// chunk, which is what gets handed over.  The rest of the chunks and the entry
+// itself are released.  Chunks being streamed by a GET request are skipped.
+//
+// A SET of a size no entry is big enough for would sweep the whole index every
+// time, so we give up after EVICTION_IDLE_SWEEPS steps without coming across a
+// big enough entry.  The failed reservation makes the rebalancer move a slab.
+//
+// Eviction for a new entry is subject to admission, see admission.c.  If the
+// entry picked isn't colder than the new one we stop and evict nothing.
+//
+// Everything here is try-locked and skipped if busy.  Eviction is triggered
+// from `reserve_memory' which may be called while holding slot, entry or tag
+// locks so we can never wait for one.
+
+typedef struct
+{
+  u32   min_size;
+  u32   max_size;
+  void *memory;
+  bool  rejected; // The new entry isn't admitted
+  u32   ncandidates; // Entries seen that are big enough
+} EvictionSweep;
+
+static atomic_uint_fast64_t clock_hand = ATOMIC_VAR_INIT (0);
+
+static bool
+evict_if_unreferenced (CacheEntry *entry, EvictionSweep *sweep)
+{
+  ValueChunks *chunks = entry->value.chunked ? entry->value.chunks : NULL;
+  u32 size_class;
+
+  if (sweep->memory || sweep->rejected)
+    return false;
+
+  if (chunks && (atomic_load (&chunks->refs) != 1))
+    return false; // Being streamed, we hold the entry so no new refs are taken
+
+  size_class = get_memory_size_class (chunks
+                                      ? (void *) chunks->chunks[0]
+                                      : (void *) entry);
+  if (size_class < sweep->min_size)
+    return false;
+
+  ++sweep->ncandidates;
+  if (size_class > sweep->max_size)
+    return false;
+
+  if (__atomic_load_n (&entry->referenced, __ATOMIC_RELAXED))
+    {
+      // Second chance
+      __atomic_store_n (&entry->referenced, false, __ATOMIC_RELAXED);
+      return false;
+    }
+
+  if (!admit_instead_of (entry))
+    {
+      sweep->rejected = true;
+      return false;
+    }
+
+  if (!try_remove_key_from_tags (entry->tags.base, entry->tags.nmemb,
+                                 entry->key))
+    return false;
+
+  UNLOCK_ENTRY (entry);
+
+  if (chunks)
+    {
+      sweep->memory = chunks->chunks[0];
+      chunks->chunks[0] = NULL;
+      release_entry (entry);
+    }
+  else
+    {
+      sweep->memory = entry;
+    }
+
+  return true; // 'true' tells map to unset the entry
+}
+
+// Evict an entry stored in a bucket big enough to hold `size' bytes and return
+// that bucket, or NULL if no entry could be evicted.  The bucket is still
+// accounted as used; the caller takes over ownership as if it was reserved.
+void *
+evict_entry (u32 size)
+{
+  EvictionSweep sweep = {
+    .min_size = size,
+    .max_size = get_size_class (size),
+    .memory      = NULL,
+    .rejected    = false,
+    .ncandidates = 0
+  };
+  u64 sweeps_per_turn;
+  u32 nidle = 0; // Sweeps since the last candidate
+
+  if (sweep.max_size == 0)
+    return NULL;
+
+  // Maps grow about evenly so this is roughly how many sweeps it takes to get
+  // round the whole index
+  sweeps_per_turn = (get_num_cache_entry_slots () / EVICTION_SWEEP_SLOTS
+                     + NUM_CACHE_ENTRY_MAPS);
+
+  // Entries may be few and far between so we might have to sweep the whole
+  // index.  The second turn is for when all candidates were referenced.
+  for (u64 nsweeps = 0;
+       (!sweep.memory && !sweep.rejected && (nidle < EVICTION_IDLE_SWEEPS)
+        && (nsweeps < EVICTION_MAX_TURNS * sweeps_per_turn));
+       ++nsweeps)
+    {
+      u64 hand = atomic_fetch_add_explicit (&clock_hand, 1,
+                                            memory_order_relaxed);
+      u32 ncandidates = sweep.ncandidates;
+
+      if (nsweeps == EVICTION_EXACT_SWEEPS)
+        sweep.max_size = MAX_BUCKET_SIZE; // Settle for any size class
+
+      try_sweep_entries (entry_maps[hand % NUM_CACHE_ENTRY_MAPS],
+                         EVICTION_SWEEP_SLOTS,
+                         (CacheEntryWalkCb) evict_if_unreferenced, &sweep);
+
+      nidle = (sweep.ncandidates == ncandidates) ? nidle + 1 : 0;
+    }
+
+  if (sweep.memory)
+    wait_for_readers (); // GET requests might still be reading the entry
+
+  return sweep.memory;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// RANGE EVICTION
+//
+// The rebalancer empties a slab by evicting every entry that holds a bucket in
+// it.  That's only worth it if entries are all that hold its buckets, so one
+// walk of the index counts the buckets entries hold in each of a few candidate
+// slabs and remembers the entries, and only then are the entries of the first
+// slab they'd leave empty evicted.
+
+typedef struct
+{
+  CacheEntry *entry;
+  u64         hash;
+  u32         target;
+} EvictionCandidate;
+
+// Only used by the rebalancer thread
+static EvictionCandidate eviction_candidates[MAX_EVICTION_CANDIDATES];
+
+typedef struct
+{
+  EvictionTarget *targets;
+  u32             ntargets;
+  u32             ncandidates;
+  u32             nbuckets[REBALANCE_MAX_VICTIMS];   // Held by entries
+  bool            overflowed[REBALANCE_MAX_VICTIMS]; // Too many to remember
+} EvictionSearch;
+
+typedef struct
+{
+  EvictionTarget *target;
+  CacheEntry     *entry; // Only evict this one if set
+  u32             nevicted;
+} EvictionRange;
+
+static inline bool
+is_in_range (void *memory, EvictionTarget *target)
+{
+  return (((u8 *) memory >= (u8 *) target->begin)
+          && ((u8 *) memory < (u8 *) target->end));
+}
+
+// Count the buckets of `entry' in `target', or none if it's being streamed
+static u32
+count_buckets_in_range (CacheEntry *entry, EvictionTarget *target)
+{
+  u32 nbuckets = is_in_range (entry, target) ? 1 : 0;
+
+  if (entry->value.chunked)
+    {
+      ValueChunks *chunks = entry->value.chunks;
+
+      if (atomic_load (&chunks->refs) != 1)
+        return 0;
+
+      nbuckets += is_in_range (chunks, target) ? 1 : 0;
+      for (u32 i = 0; i < chunks->nchunks; ++i)
+        nbuckets += is_in_range (chunks->chunks[i], target) ? 1 : 0;
+    }
+
+  return nbuckets;
+}
+
+static bool
+collect_if_in_range (CacheEntry *entry, EvictionSearch *search)
+{
+  for (u32 t = 0; t < search->ntargets; ++t)
+    {
+      u32 nbuckets = count_buckets_in_range (entry, &search->targets[t]);
+      if (nbuckets == 0)
+        continue;
+
+      search->nbuckets[t] += nbuckets;
+      if (search->ncandidates < MAX_EVICTION_CANDIDATES)
+        {
+          eviction_candidates[search->ncandidates++] = (EvictionCandidate) {
+            .entry  = entry,
+            .hash   = entry->key.hash,
+            .target = t
+          };
+        }
+      else
+        {
+          search->overflowed[t] = true;
+        }
+    }
+
+  return false;
+}
+
+static bool
+evict_if_in_range (CacheEntry *entry, EvictionRange *range)
+{
+  if ((range->entry && (entry != range->entry))
+      || (count_buckets_in_range (entry, range->target) == 0))
+    return false;
+
+  if (!try_remove_key_from_tags (entry->tags.base, entry->tags.nmemb,
+                                 entry->key))
+    return false;
+
+  UNLOCK_ENTRY (entry);
+  retire_evicted_entry (entry);
+  ++range->nevicted;
+
+  return true; // 'true' tells map to unset the entry
+}
+
+// Evict the entries holding buckets in the first of `targets' that they'd
+// leave empty, going by the buckets held in each one after the walk.  Entries
+// are evicted regardless of use so this is only meant for the memory
+// rebalancer.  Returns the index of the target evicted from or `ntargets' if
+// none can be emptied.
+u32
+evict_entries_to_empty (EvictionTarget *targets, u32 ntargets)
+{
+  EvictionSearch search = {
+    .targets     = targets,
+    .ntargets    = ntargets,
+    .ncandidates = 0
+  };
+  EvictionRange range;
+  u32 t;
+
+  cik_assert (ntargets <= REBALANCE_MAX_VICTIMS);
+
+  for (u32 i = 0; i < NUM_CACHE_ENTRY_MAPS; ++i)
+    try_walk_entries (entry_maps[i], 0, ALL_SLOTS,
+                      (CacheEntryWalkCb) collect_if_in_range, &search);
+
+  for (t = 0; t < ntargets; ++t)
+    {
+      if (search.nbuckets[t] >= atomic_load (targets[t].num_held))
+        break;
+    }
+
+  if (t == ntargets)
+    return ntargets;
+
+  range = (EvictionRange) {
+    .target   = &targets[t],
+    .entry    = NULL,
+    .nevicted = 0
+  };
+
+  if (search.overflowed[t])
+    {
+      // Couldn't remember them all, evict whatever is in range
+      for (u32 i = 0; i < NUM_CACHE_ENTRY_MAPS; ++i)
+        {
+          try_walk_entries (entry_maps[i], 0, ALL_SLOTS,
+                            (CacheEntryWalkCb) evict_if_in_range, &range);
+          release_retired_entries ();
+        }
+    }
+  else
+    {
+      for (u32 i = 0; i < search.ncandidates; ++i)
+        {
+          EvictionCandidate *candidate = &eviction_candidates[i];
+          if (candidate->target != t)
+            continue;
+          range.entry = candidate->entry;
+          walk_entries_of_hash (entry_maps[get_map_index (candidate->hash)],
+                                candidate->hash,
+                                (CacheEntryWalkCb) evict_if_in_range, &range);
+        }
+      release_retired_entries ();
+    }
+
+  dbg_print ("Evicted %u entries to empty %p\n", range.nevicted,
+             targets[t].begin);
+
+  return t;
+}
@@ -0,0 +1,17 @@
+#ifndef EVICT_H
+#define EVICT_H 1
+
+#include "types.h"
+
+// A range of memory the rebalancer wants emptied, see `evict_entries_to_empty'
+typedef struct
+{
+  void          *begin;
+  void          *end;
+  _Atomic (u32) *num_held; // Buckets in range that aren't free
+} EvictionTarget;
+
+void *evict_entry            (u32);
+u32   evict_entries_to_empty (EvictionTarget *, u32);
+
+#endif /* ! EVICT_H */
@@ -0,0 +1,610 @@
+#include <stdio.h>
+
+#include "entry.h"
+#include "expiry.h"
+#include "lock.h"
+#include "memory.h"
+#include "tag.h"
+
+// Expired entries used to stay mapped until a CLR OLD walked the whole index,
+// GETs only ever report them as expired.  Now every SET with a TTL also files
+// the key hash and expiry time in a hierarchical timer wheel and a reaper
+// thread unmaps and releases entries `active_expiry_delay' seconds after they
+// expire.  The delay is for GETs that ignore expiry times.
+//
+// The wheel has EXPIRY_WHEEL_LEVELS levels of 64 buckets.  Level 0 buckets
+// hold records of a single second and level `l' buckets the records of 64^l
+// seconds.  A record goes to the lowest level that reaches its second from the
+// wheel time, and once the wheel gets to the first second of a higher level
+// bucket its records are filed again a level down or more.  Level 0 buckets
+// are handed to the reaper as their second comes.
+//
+// Records only know the key hash and second, and entries keep the second of
+// their record so there's one record per entry at most.  An entry given a
+// later expiry time keeps its record and the reaper files it again when it
+// finds the entry isn't due, an entry replacing another takes over its record.
+// Records of deleted entries, or of entries that were filed again for an
+// earlier second, are stale and dropped when the reaper or a move down the
+// wheel finds no entry of their hash with their second.  Records never go
+// further than the wheel reaches and the number of records is capped at
+// 1/EXPIRY_MEMORY_SHARE of the memory, entries that can't get one are counted
+// as untracked.
+//
+// The wheel doubles as an index of expired entries for CLR OLD requests.  It's
+// moved on whether `active_expiry' is on or not, and without it due records
+// are just kept for the next CLR OLD.  That takes the due records along with
+// the records of the buckets that start before the current second, so it only
+// visits entries that are expired or about to.
+
+typedef struct
+{
+  u64    hash;
+  time_t expires;
+} ExpiryRecord;
+
+typedef struct ExpiryBlock
+{
+  struct ExpiryBlock *next;
+  u32 nrecords;
+  ExpiryRecord records[];
+} ExpiryBlock;
+
+#define EXPIRY_BLOCK_RECORDS                                            \
+  ((EXPIRY_BLOCK_SIZE - sizeof (ExpiryBlock)) / sizeof (ExpiryRecord))
+#define EXPIRY_WHEEL_SIZE (1 << EXPIRY_WHEEL_BITS)
+#define EXPIRY_WHEEL_MASK (EXPIRY_WHEEL_SIZE - 1)
+#define EXPIRY_WHEEL_SPAN ((time_t) 1 << (EXPIRY_WHEEL_BITS * EXPIRY_WHEEL_LEVELS))
+
+typedef struct
+{
+  CacheLock    lock;
+  ExpiryBlock *blocks; // First one is the one being filled
+} __attribute__ ((aligned (CACHE_LINE_SIZE))) ExpiryBucket;
+
+typedef struct
+{
+  time_t           deadline;
+  time_t           second;  // Of the record being reaped
+  bool             matched; // Found the entry of the record
+  CacheEntryWalkCb release; // Unmaps and releases due entries
+  void            *release_data;
+  u32              nreaped;
+  u64              nbytes;
+} ReapData;
+
+static struct
+{
+  _Atomic (time_t) time; // Last second handed to the reaper
+  ExpiryBucket buckets[EXPIRY_WHEEL_LEVELS][EXPIRY_WHEEL_SIZE];
+} wheel;
+
+// Records of passed seconds, only touched with `reap_lock' held.  Moving the
+// wheel on takes it too so bucket times don't change during a CLR OLD.
+static CacheLock    reap_lock = LOCK_INIT;
+static ExpiryBlock *due = NULL;
+
+static bool   active_expiry = false;
+static time_t active_expiry_delay = 0;
+
+static u64 max_records = 0;
+
+static _Atomic (u64) num_records = 0;
+static _Atomic (u64) num_tracked = 0;
+static _Atomic (u64) num_untracked = 0; // No memory or room for the record
+static _Atomic (u64) num_stale = 0;
+static _Atomic (u64) num_reaped = 0;
+static _Atomic (u64) bytes_reaped = 0;
+static _Atomic (u64) num_reaped_per_min = 0;
+static _Atomic (u64) bytes_reaped_per_min = 0;
+static _Atomic (u64) num_cleared = 0; // By CLR OLD
+
+void
+init_expiry (const RuntimeConfig *config)
+{
+  active_expiry = config->active_expiry;
+  active_expiry_delay = config->active_expiry_delay;
+  max_records = (config->memory_limit / EXPIRY_MEMORY_SHARE)
+    / sizeof (ExpiryRecord);
+
+  atomic_init (&wheel.time, time (NULL) - active_expiry_delay);
+  for (u32 l = 0; l < EXPIRY_WHEEL_LEVELS; ++l)
+    {
+      for (u32 b = 0; b < EXPIRY_WHEEL_SIZE; ++b)
+        {
+          atomic_init (&wheel.buckets[l][b].lock, LOCK_INIT);
+          wheel.buckets[l][b].blocks = NULL;
+        }
+    }
+}
+
+// Get the second to file a record of an entry expiring at `expires' with the
+// wheel at `now'.  The bucket of `now' has been handed to the reaper already so
+// records that are due go to the next second.  Records of entries expiring
+// past the reach of the wheel are filed again once the wheel gets there.
+static time_t
+get_record_second (time_t now, time_t expires)
+{
+  if (expires <= now)
+    return now + 1;
+
+  if (expires - now >= EXPIRY_WHEEL_SPAN)
+    return now + EXPIRY_WHEEL_SPAN - 1;
+
+  return expires;
+}
+
+// Get the bucket for a record of second `expires' with the wheel at `now'
+static ExpiryBucket *
+get_expiry_bucket (time_t now, time_t expires)
+{
+  time_t delta;
+  u32    level = 0;
+
+  if (expires < now)
+    expires = now;
+
+  delta = expires - now;
+  while (delta >> (EXPIRY_WHEEL_BITS * (level + 1)))
+    ++level;
+
+  return &wheel.buckets[level][(expires >> (EXPIRY_WHEEL_BITS * level))
+                               & EXPIRY_WHEEL_MASK];
+}
+
+// Add a record to the locked `bucket'.  Returns false if out of memory.
+static bool
+file_record (ExpiryBucket *bucket, u64 hash, time_t expires)
+{
+  ExpiryBlock *block = bucket->blocks;
+
+  if (!block || (block->nrecords == EXPIRY_BLOCK_RECORDS))
+    {
+      block = reserve_memory (EXPIRY_BLOCK_SIZE);
+      if (!block)
+        return false;
+
+      block->next = bucket->blocks;
+      block->nrecords = 0;
+      bucket->blocks = block;
+    }
+
+  block->records[block->nrecords++] = (ExpiryRecord) {
+    .hash    = hash,
+    .expires = expires
+  };
+
+  return true;
+}
+
+static ExpiryBlock *
+take_blocks (ExpiryBucket *bucket)
+{
+  ExpiryBlock *blocks;
+
+  acquire_lock (&bucket->lock, LOCK_CLASS_EXPIRY);
+  blocks = bucket->blocks;
+  bucket->blocks = NULL;
+  release_lock (&bucket->lock);
+
+  return blocks;
+}
+
+// Remember to reap `entry' once it's past its expiry time.  Called with the
+// entry locked after setting it with a TTL or giving it a new one.  Nothing is
+// filed if the entry has a record for the same second or an earlier one.
+void
+track_expiry (CacheEntry *entry)
+{
+  if (entry->expires == CACHE_EXPIRES_INIT)
+    return;
+
+  for (;;)
+    {
+      time_t        now    = atomic_load (&wheel.time);
+      time_t        second = get_record_second (now, entry->expires);
+      ExpiryBucket *bucket;
+      bool          filed;
+
+      if (entry->expiry_second && ((time_t) entry->expiry_second <= second))
+        return; // The reaper files it again if it comes too early
+
+      if (atomic_fetch_add_explicit (&num_records, 1, memory_order_relaxed)
+          >= max_records)
+        {
+          atomic_fetch_sub_explicit (&num_records, 1, memory_order_relaxed);
+          filed = false;
+        }
+      else
+        {
+          bucket = get_expiry_bucket (now, second);
+
+          acquire_lock (&bucket->lock, LOCK_CLASS_EXPIRY);
+          if (atomic_load (&wheel.time) != now)
+            {
+              // The wheel moved on, our bucket may be for a later second now
+              release_lock (&bucket->lock);
+              atomic_fetch_sub_explicit (&num_records, 1,
+                                         memory_order_relaxed);
+              continue;
+            }
+          filed = file_record (bucket, entry->key.hash, second);
+          release_lock (&bucket->lock);
+
+          if (!filed)
+            atomic_fetch_sub_explicit (&num_records, 1, memory_order_relaxed);
+        }
+
+      // A record filed before for a later second is stale now
+      entry->expiry_second = filed ? (u32) second : 0;
+
+      if (filed)
+        atomic_fetch_add_explicit (&num_tracked, 1, memory_order_relaxed);
+      else
+        atomic_fetch_add_explicit (&num_untracked, 1, memory_order_relaxed);
+      return;
+    }
+}
+
+// Called from `walk_entries_of_hash' with the entry locked
+static bool
+match_record_callback (CacheEntry *entry, ReapData *data)
+{
+  if (entry->expiry_second == (u32) data->second)
+    data->matched = true;
+
+  return false;
+}
+
+// Check if no entry has `record' any more, see `track_expiry'
+static bool
+is_record_stale (const ExpiryRecord *record)
+{
+  ReapData data = { .second = record->expires, .matched = false };
+
+  walk_entries_of_hash (entry_maps[get_map_index (record->hash)],
+                        record->hash, (CacheEntryWalkCb) match_record_callback,
+                        &data);
+
+  return !data.matched;
+}
+
+// Drop a record for good
+static inline void
+drop_record (bool stale)
+{
+  atomic_fetch_sub_explicit (&num_records, 1, memory_order_relaxed);
+  if (stale)
+    atomic_fetch_add_explicit (&num_stale, 1, memory_order_relaxed);
+}
+
+// Move the wheel on by a second, filing the records of any higher level bucket
+// starting there again and taking the records due.  The new time is published
+// before any bucket is emptied, see `track_expiry'.
+static void
+advance_wheel (void)
+{
+  time_t       now = atomic_load (&wheel.time) + 1;
+  ExpiryBlock *blocks;
+
+  atomic_store (&wheel.time, now);
+
+  for (u32 level = EXPIRY_WHEEL_LEVELS - 1; level > 0; --level)
+    {
+      u32 shift = EXPIRY_WHEEL_BITS * level;
+      if (now & (((time_t) 1 << shift) - 1))
+        continue;
+
+      blocks = take_blocks (&wheel.buckets[level][(now >> shift)
+                                                  & EXPIRY_WHEEL_MASK]);
+      while (blocks)
+        {
+          ExpiryBlock *next = blocks->next;
+          u32 nkept = 0;
+
+          for (u32 i = 0; i < blocks->nrecords; ++i)
+            {
+              ExpiryRecord *record = &blocks->records[i];
+              ExpiryBucket *bucket;
+              bool          filed;
+
+              if (is_record_stale (record))
+                {
+                  drop_record (true);
+                  continue;
+                }
+
+              bucket = get_expiry_bucket (now, record->expires);
+              acquire_lock (&bucket->lock, LOCK_CLASS_EXPIRY);
+              filed = file_record (bucket, record->hash, record->expires);
+              release_lock (&bucket->lock);
+
+              // Out of memory, let the reaper file it again when it finds
+              // the entry isn't due yet
+              if (!filed)
+                blocks->records[nkept++] = *record;
+            }
+
+          if (nkept)
+            {
+              blocks->nrecords = nkept;
+              blocks->next = due;
+              due = blocks;
+            }
+          else
+            {
+              release_memory (blocks);
+            }
+          blocks = next;
+        }
+    }
+
+  blocks = take_blocks (&wheel.buckets[0][now & EXPIRY_WHEEL_MASK]);
+  while (blocks)
+    {
+      ExpiryBlock *next = blocks->next;
+      blocks->next = due;
+      due = blocks;
+      blocks = next;
+    }
+}
+
+// Reaper's `ReapData.release', called with the entry locked
+static bool
+release_expired_entry (CacheEntry *entry, void *data)
+{
+  (void) data;
+
+  for (u8 t = 0; t < entry->tags.nmemb; ++t)
+    remove_key_from_tag (entry->tags.base[t], entry->key);
+
+  UNLOCK_ENTRY (entry);
+  retire_entry (entry);
+
+  return true; // 'true' tells map to unset the entry
+}
+
+// Called from `walk_entries_of_hash' with the entry locked
+static bool
+reap_callback (CacheEntry *entry, ReapData *data)
+{
+  u64 nbytes;
+
+  cik_assert (entry);
+  cik_assert (data);
+
+  if (entry->expiry_second != (u32) data->second)
+    return false; // Another entry with the same hash or its record is stale
+
+  data->matched = true;
+
+  if ((entry->expires != CACHE_EXPIRES_INIT)
+      && (entry->expires < data->deadline))
+    {
+      nbytes = get_memory_size_class (entry);
+      if (entry->value.chunked)
+        nbytes += entry->value.nmemb;
+
+      if (data->release (entry, data->release_data))
+        {
+          data->nbytes += nbytes;
+          ++data->nreaped;
+          return true;
+        }
+    }
+
+  // Got a new TTL, or is within the reaper's delay
+  entry->expiry_second = 0;
+  track_expiry (entry);
+
+  return false;
+}
+
+// Release the entry of `record' if it's past `data->deadline' or file it again
+// for its new expiry time.  Either way the record is done with.
+static void
+reap_record (const ExpiryRecord *record, ReapData *data)
+{
+  data->second  = record->expires;
+  data->matched = false;
+
+  walk_entries_of_hash (entry_maps[get_map_index (record->hash)],
+                        record->hash, (CacheEntryWalkCb) reap_callback, data);
+
+  drop_record (!data->matched);
+}
+
+// Release the entries of the records past `now' in `bucket' and leave the rest.
+// Records aren't moved between buckets while `reap_lock' is held.
+static void
+reap_bucket (ExpiryBucket *bucket, time_t now, ReapData *data)
+{
+  ExpiryBlock *blocks = take_blocks (bucket);
+  ExpiryBlock *kept = NULL, **tail = &kept;
+
+  while (blocks)
+    {
+      ExpiryBlock *next = blocks->next;
+      u32 nkept = 0;
+
+      for (u32 i = 0; i < blocks->nrecords; ++i)
+        {
+          if (blocks->records[i].expires < now)
+            reap_record (&blocks->records[i], data);
+          else
+            blocks->records[nkept++] = blocks->records[i];
+        }
+
+      if (nkept)
+        {
+          blocks->nrecords = nkept;
+          *tail = blocks;
+          tail = &blocks->next;
+        }
+      else
+        {
+          release_memory (blocks);
+        }
+      blocks = next;
+    }
+
+  if (kept)
+    {
+      // Put them back behind any records filed in the meantime
+      acquire_lock (&bucket->lock, LOCK_CLASS_EXPIRY);
+      *tail = bucket->blocks;
+      bucket->blocks = kept;
+      release_lock (&bucket->lock);
+    }
+}
+
+// Release the entries of at most `max' due records if `active_expiry' is on.
+// Returns the number of records handled, 0 once there are none due.
+u32
+reap_expired_entries (u32 max)
+{
+  static time_t minute = 0;
+  static u64    num_at_minute = 0;
+  static u64    bytes_at_minute = 0;
+
+  time_t   now = time (NULL);
+  ReapData data = {
+    .deadline     = now - active_expiry_delay,
+    .release      = release_expired_entry,
+    .release_data = NULL,
+    .nreaped      = 0,
+    .nbytes       = 0
+  };
+  u32 n = 0;
+
+  acquire_lock (&reap_lock, LOCK_CLASS_EXPIRY);
+
+  // Records of second `t' are due once it's past the deadline
+  while (atomic_load (&wheel.time) + 1 < data.deadline)
+    advance_wheel ();
+
+  while (active_expiry && due && (n < max))
+    {
+      if (due->nrecords == 0)
+        {
+          ExpiryBlock *next = due->next;
+          release_memory (due);
+          due = next;
+          continue;
+        }
+
+      reap_record (&due->records[--due->nrecords], &data);
+      ++n;
+    }
+
+  release_lock (&reap_lock);
+
+  release_retired_entries ();
+
+  if (data.nreaped)
+    {
+      atomic_fetch_add_explicit (&num_reaped, data.nreaped,
+                                 memory_order_relaxed);
+      atomic_fetch_add_explicit (&bytes_reaped, data.nbytes,
+                                 memory_order_relaxed);
+    }
+
+  if (now - minute >= 60)
+    {
+      u64 num   = atomic_load (&num_reaped);
+      u64 bytes = atomic_load (&bytes_reaped);
+      atomic_store (&num_reaped_per_min, num - num_at_minute);
+      atomic_store (&bytes_reaped_per_min, bytes - bytes_at_minute);
+      num_at_minute = num;
+      bytes_at_minute = bytes;
+      minute = now;
+    }
+
+  return n;
+}
+
+// Call `callback' with every entry that expired before `now', locked, for a
+// CLR OLD request to unmap and release it.  Returns false without doing so if
+// the index is missing records, in which case the request has to walk all
+// entries and call `untracked_entries_walked' with `*nuntracked' after.
+bool
+clear_expired_entries (time_t now, CacheEntryWalkCb callback, void *user_data,
+                       u64 *nuntracked)
+{
+  ReapData data = {
+    .deadline     = now,
+    .release      = callback,
+    .release_data = user_data,
+    .nreaped      = 0,
+    .nbytes       = 0
+  };
+  time_t wheel_time;
+
+  *nuntracked = atomic_load (&num_untracked);
+  if (*nuntracked > 0)
+    return false; // Ran out of memory or room for records at some point
+
+  acquire_lock (&reap_lock, LOCK_CLASS_EXPIRY);
+
+  while (due)
+    {
+      ExpiryBlock *next = due->next;
+      for (u32 i = 0; i < due->nrecords; ++i)
+        reap_record (&due->records[i], &data);
+      release_memory (due);
+      due = next;
+    }
+
+  // Level `l' buckets hold the records of the next 64 spans of 64^l seconds
+  // after the one of the wheel time, see `get_expiry_bucket'.  Records filed
+  // when they were due already are in the bucket of the second after it.
+  wheel_time = atomic_load (&wheel.time);
+  for (u32 level = 0; level < EXPIRY_WHEEL_LEVELS; ++level)
+    {
+      u32    shift = EXPIRY_WHEEL_BITS * level;
+      time_t first = (wheel_time >> shift) + 1;
+      for (u32 b = 0; b < EXPIRY_WHEEL_SIZE; ++b)
+        {
+          time_t span = first + ((b - first) & EXPIRY_WHEEL_MASK);
+          if ((span << shift) <= now)
+            reap_bucket (&wheel.buckets[level][b], now, &data);
+        }
+    }
+
+  release_lock (&reap_lock);
+
+  release_retired_entries (); // Of `callback'
+
+  atomic_fetch_add_explicit (&num_cleared, data.nreaped,
+                             memory_order_relaxed);
+
+  return true;
+}
+
+// A walk of all entries for a CLR OLD request that started with `nuntracked'
+// entries missing from the index is done.  It cleared the expired ones and
+// filed the others again, see `track_expiry', so they're tracked unless they
+// were counted again.
+void
+untracked_entries_walked (u64 nuntracked)
+{
+  atomic_fetch_sub_explicit (&num_untracked, nuntracked, memory_order_relaxed);
+}
+
+void
+write_expiry_stats (int fd)
+{
+  time_t lag = (time (NULL) - active_expiry_delay) - atomic_load (&wheel.time);
+
+  dprintf (fd, "\n%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n",
+           "ActiveExpiry", "Records", "MaxRecords", "Tracked", "Untracked",
+           "Stale", "Reaped", "ReapedBytes", "ReapedPerMin", "BytesPerMin",
+           "Cleared", "WheelLag");
+  dprintf (fd, "%s\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\t%ld\n",
+           active_expiry ? "yes" : "no",
+           atomic_load (&num_records), max_records,
+           atomic_load (&num_tracked), atomic_load (&num_untracked),
+           atomic_load (&num_stale), atomic_load (&num_reaped),
+           atomic_load (&bytes_reaped), atomic_load (&num_reaped_per_min),
+           atomic_load (&bytes_reaped_per_min), atomic_load (&num_cleared),
+           (long) lag);
+}
@@ -0,0 +1,13 @@
+#ifndef EXPIRY_H
+#define EXPIRY_H 1
+
+#include "types.h"
+
+void init_expiry              (const RuntimeConfig *);
+void track_expiry             (CacheEntry *);
+u32  reap_expired_entries     (u32);
+bool clear_expired_entries    (time_t, CacheEntryWalkCb, void *, u64 *);
+void untracked_entries_walked (u64);
+void write_expiry_stats       (int);
+
+#endif /* ! EXPIRY_H */
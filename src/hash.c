@@ -0,0 +1,110 @@
+#include <string.h>
+
+#include "hash.h"
+
+// A 64 bit hash in the style of wyhash (public domain).  It reads the key a
+// word at a time and mixes words with 64x64->128 bit multiplies, so keys with
+// long shared prefixes or suffixes still spread over all bits of the hash.
+
+static const u64 secret[4] = {
+  0xA0761D6478BD642FULL, 0xE7037ED1A0B428DBULL,
+  0x8EBC6AF09C88C6E3ULL, 0x589965CC75374CC3ULL
+};
+
+static inline u64
+read_u64 (const u8 *p)
+{
+  u64 v;
+  memcpy (&v, p, sizeof (v));
+  return v;
+}
+
+static inline u64
+read_u32 (const u8 *p)
+{
+  u32 v;
+  memcpy (&v, p, sizeof (v));
+  return v;
+}
+
+// Spread 1 to 3 bytes over a word
+static inline u64
+read_small (const u8 *p, u32 n)
+{
+  return (((u64) p[0]) << 16) | (((u64) p[n >> 1]) << 8) | p[n - 1];
+}
+
+// Replace `a' and `b' with the low and high words of their 128 bit product
+static inline void
+multiply (u64 *a, u64 *b)
+{
+  __uint128_t r = (__uint128_t) *a * *b;
+  *a = (u64) r;
+  *b = (u64) (r >> 64);
+}
+
+static inline u64
+mix (u64 a, u64 b)
+{
+  multiply (&a, &b);
+  return a ^ b;
+}
+
+u64
+hash_bytes (const u8 *base, u32 nmemb)
+{
+  const u8 *p    = base;
+  u64       seed = mix (secret[0], secret[1]);
+  u64       a, b;
+
+  if (nmemb <= 16)
+    {
+      if (nmemb >= 4)
+        {
+          u32 skip = (nmemb >> 3) << 2;
+          a = (read_u32 (p) << 32) | read_u32 (p + skip);
+          b = (read_u32 (p + nmemb - 4) << 32) | read_u32 (p + nmemb - 4 - skip);
+        }
+      else if (nmemb > 0)
+        {
+          a = read_small (p, nmemb);
+          b = 0;
+        }
+      else
+        {
+          a = b = 0;
+        }
+    }
+  else
+    {
+      u32 n = nmemb;
+      if (n > 48)
+        {
+          u64 seed1 = seed, seed2 = seed;
+          do
+            {
+              seed  = mix (read_u64 (p)      ^ secret[1], read_u64 (p + 8)  ^ seed);
+              seed1 = mix (read_u64 (p + 16) ^ secret[2], read_u64 (p + 24) ^ seed1);
+              seed2 = mix (read_u64 (p + 32) ^ secret[3], read_u64 (p + 40) ^ seed2);
+              p += 48;
+              n -= 48;
+            }
+          while (n > 48);
+          seed ^= seed1 ^ seed2;
+        }
+      while (n > 16)
+        {
+          seed = mix (read_u64 (p) ^ secret[1], read_u64 (p + 8) ^ seed);
+          p += 16;
+          n -= 16;
+        }
+      // Last 16 bytes, overlapping what was already mixed if need be
+      a = read_u64 (p + n - 16);
+      b = read_u64 (p + n - 8);
+    }
+
+  a ^= secret[1];
+  b ^= seed;
+  multiply (&a, &b);
+  return mix (a ^ secret[0] ^ nmemb, b ^ secret[1]);
+}
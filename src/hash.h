@@ -0,0 +1,8 @@
+#ifndef HASH_H
+#define HASH_H 1
+
+#include "types.h"
+
+u64 hash_bytes (const u8 *, u32);
+
+#endif /* ! HASH_H */
@@ -0,0 +1,119 @@
+#include <linux/futex.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "lock.h"
+#include "profiler.h"
+
+// Slot, entry and tag key list locks are usually held for a handful of
+// instructions but some holders take much longer, like a CLR walk or a copy of
+// a long tag key list.  Waiters spin LOCK_SPIN_LIMIT times hoping the holder is
+// quick and then sleep on a futex until the lock is released.
+//
+// A lock is LOCK_FREE, LOCK_TAKEN or LOCK_WAITED.  Sleepers leave it
+// LOCK_WAITED so `release_lock' knows to wake one of them, and a woken sleeper
+// takes it as LOCK_WAITED again since it can't know if there are others.  The
+// fast paths are in lock.h, only waiting is done here.
+
+typedef struct
+{
+  _Atomic (u64) ncontended; // Acquired after spinning
+  _Atomic (u64) nslept;     // Acquired after sleeping
+  _Atomic (u64) wait_time;  // Spent in `wait_for_lock'
+} __attribute__ ((aligned (CACHE_LINE_SIZE))) LockClassStats;
+
+static LockClassStats lock_stats[NUM_LOCK_CLASSES] = {};
+
+static const char *lock_class_names[NUM_LOCK_CLASSES] = {
+  [LOCK_CLASS_SLOT]    = "Slot",
+  [LOCK_CLASS_ENTRY]   = "Entry",
+  [LOCK_CLASS_KEYS]    = "TagKeys",
+  [LOCK_CLASS_EXPIRY]  = "Expiry",
+  [LOCK_CLASS_MIGRATE] = "Migrate"
+};
+
+static inline void
+futex_wait (_Atomic (u32) *address, u32 value)
+{
+  // Returns right away if `address' isn't `value' anymore.  Interrupted and
+  // spurious wakeups are fine, callers check the value again.
+  (void) syscall (SYS_futex, address, FUTEX_WAIT_PRIVATE, value, NULL, NULL,
+                  0);
+}
+
+static inline void
+futex_wake (_Atomic (u32) *address, u32 count)
+{
+  (void) syscall (SYS_futex, address, FUTEX_WAKE_PRIVATE, count, NULL, NULL,
+                  0);
+}
+
+void
+wait_for_lock (CacheLock *lock, LockClass lock_class)
+{
+  LockClassStats *stats = &lock_stats[lock_class];
+  u64 start = get_performance_counter ();
+  bool slept = false;
+
+  for (u32 i = 0; i < LOCK_SPIN_LIMIT; ++i)
+    {
+      CPU_RELAX ();
+      if ((atomic_load_explicit (lock, memory_order_relaxed) == LOCK_FREE)
+          && try_acquire_lock (lock))
+        goto acquired;
+    }
+
+  while (atomic_exchange_explicit (lock, LOCK_WAITED, memory_order_acquire)
+         != LOCK_FREE)
+    {
+      futex_wait (lock, LOCK_WAITED);
+      slept = true;
+    }
+
+ acquired:
+  atomic_fetch_add_explicit (&stats->ncontended, 1, memory_order_relaxed);
+  if (slept)
+    atomic_fetch_add_explicit (&stats->nslept, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit (&stats->wait_time,
+                             get_performance_counter () - start,
+                             memory_order_relaxed);
+}
+
+// The lock may have been reused by now (entries are released right after being
+// unlocked) but waking a futex nobody sleeps on is harmless
+void
+wake_lock_waiter (CacheLock *lock)
+{
+  futex_wake (lock, 1);
+}
+
+// Sleep until `*address' isn't `value' anymore.  Whoever changes it must call
+// `wake_all_waiters' after.
+void
+wait_for_change (_Atomic (u32) *address, u32 value)
+{
+  while (atomic_load_explicit (address, memory_order_acquire) == value)
+    futex_wait (address, value);
+}
+
+void
+wake_all_waiters (_Atomic (u32) *address)
+{
+  futex_wake (address, INT32_MAX);
+}
+
+void
+write_lock_stats (int fd)
+{
+  float to_ms = 1000.f / get_performance_frequency ();
+
+  dprintf (fd, "\n%s\t%s\t%s\t%s\n",
+           "Lock", "Contended", "Slept", "Wait(t)");
+
+  for (u32 i = 0; i < NUM_LOCK_CLASSES; ++i)
+    dprintf (fd, "%s\t%lu\t%lu\t%.3f\n", lock_class_names[i],
+             atomic_load (&lock_stats[i].ncontended),
+             atomic_load (&lock_stats[i].nslept),
+             to_ms * atomic_load (&lock_stats[i].wait_time));
+}
@@ -0,0 +1,62 @@
+#ifndef LOCK_H
+#define LOCK_H 1
+
+#include "types.h"
+
+#define LOCK_INIT 0
+
+#if defined (__x86_64__) || defined (__i386__)
+# define CPU_RELAX() __builtin_ia32_pause ()
+#else
+# define CPU_RELAX() atomic_signal_fence (memory_order_seq_cst)
+#endif
+
+typedef enum
+{
+  LOCK_CLASS_SLOT = 0,
+  LOCK_CLASS_ENTRY,
+  LOCK_CLASS_KEYS,
+  LOCK_CLASS_EXPIRY,
+  LOCK_CLASS_MIGRATE,
+  NUM_LOCK_CLASSES
+} LockClass;
+
+// States of a `CacheLock'
+enum
+{
+  LOCK_FREE = 0,
+  LOCK_TAKEN,
+  LOCK_WAITED  // Taken and someone may be sleeping on it
+};
+
+void wait_for_lock    (CacheLock *, LockClass);
+void wake_lock_waiter (CacheLock *);
+void wait_for_change  (_Atomic (u32) *, u32);
+void wake_all_waiters (_Atomic (u32) *);
+void write_lock_stats (int);
+
+static inline bool
+try_acquire_lock (CacheLock *lock)
+{
+  u32 expected = LOCK_FREE;
+  return atomic_compare_exchange_strong_explicit (lock, &expected, LOCK_TAKEN,
+                                                  memory_order_acquire,
+                                                  memory_order_relaxed);
+}
+
+static inline void
+acquire_lock (CacheLock *lock, LockClass lock_class)
+{
+  if (!try_acquire_lock (lock))
+    wait_for_lock (lock, lock_class);
+}
+
+static inline void
+release_lock (CacheLock *lock)
+{
+  if (atomic_exchange_explicit (lock, LOCK_FREE, memory_order_release)
+      == LOCK_WAITED)
+    wake_lock_waiter (lock);
+}
+
+#endif /* ! LOCK_H */
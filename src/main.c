@@ -13,20 +13,31 @@
 # include <systemd/sd-daemon.h>
 #endif
 
+#include "admission.h"
+#include "compact.h"
 #include "controller.h"
+#include "expiry.h"
 #include "memory.h"
+#include "numa.h"
 #include "entry.h"
 #include "tag.h"
 #include "server.h"
 #include "profiler.h"
 #include "util.h"
 #include "log.h"
+#include "walk.h"
 
 atomic_bool quit;
 atomic_bool do_write_stats;
 static thrd_t logging_thread;
+static thrd_t rebalancer_thread;
+static thrd_t prefault_thread;
+static thrd_t expiry_thread;
 
 static int run_logging_thread (const char *);
+static int run_rebalancer_thread (const RuntimeConfig *);
+static int run_prefault_thread (void *);
+static int run_expiry_thread (void *);
 static void sigint_handler (int);
 static void sigterm_handler (int);
 static void sigusr1_handler (int);
@@ -89,7 +100,10 @@ main (int argc, char **argv)
   // Ignore to avoid killing by typo. Might be used later for GC or sth maybe.
   signal (SIGUSR2, SIG_IGN);
 
-  if (0 > init_memory ())
+  if (0 != init_numa (config->numa))
+    return EXIT_FAILURE;
+
+  if (0 != init_memory (config))
     return EXIT_FAILURE;
 
   atomic_init (&quit, false);
@@ -107,14 +121,31 @@ main (int argc, char **argv)
       return EXIT_FAILURE;
     }
 
-  if (0 != init_controller ())
+  if (0 != init_controller (config))
     {
       err_print ("Failed to init controller: %s\n", strerror (errno));
       return EXIT_FAILURE;
     }
 
-  for (u32 i = 0; i < NUM_CACHE_ENTRY_MAPS; ++i)
-    init_cache_entry_map (entry_maps[i]);
+  if (0 != init_cache_entry_maps (config))
+    {
+      err_print ("Failed to init entry maps: %s\n", strerror (ENOMEM));
+      return EXIT_FAILURE;
+    }
+
+  if (0 != init_admission (config))
+    {
+      err_print ("Failed to init admission: %s\n", strerror (ENOMEM));
+      return EXIT_FAILURE;
+    }
+
+  init_expiry (config);
+
+  if (0 != start_walk_threads (config))
+    {
+      err_print ("Failed to start walk threads: %s\n", strerror (errno));
+      return EXIT_FAILURE;
+    }
 
   nfo_print ("Starting server on %d.%d.%d.%d:%d\n",
              (ntohl (config->listen_address) & 0xFF000000) >> 24,
@@ -151,6 +182,19 @@ main (int argc, char **argv)
                    (void *) config->log_filename) != thrd_success)
     err_print ("%s\n", strerror (errno));
 
+  if (thrd_create (&rebalancer_thread, (thrd_start_t) run_rebalancer_thread,
+                   config) != thrd_success)
+    err_print ("%s\n", strerror (errno));
+
+  if (config->prefault_memory
+      && (thrd_create (&prefault_thread, (thrd_start_t) run_prefault_thread,
+                       NULL) != thrd_success))
+    err_print ("%s\n", strerror (errno));
+
+  if (thrd_create (&expiry_thread, (thrd_start_t) run_expiry_thread,
+                   NULL) != thrd_success)
+    err_print ("%s\n", strerror (errno));
+
   load_request_log (persistence_fd);
 
 #ifdef HAVE_SYSTEMD
@@ -177,10 +221,20 @@ main (int argc, char **argv)
   nfo_print ("Shutting down %s\n", "..");
 
   stop_server ();
+  stop_walk_threads ();
 
   if (0 > thrd_join (logging_thread, NULL))
     err_print ("%s\n", strerror (errno));
 
+  if (0 > thrd_join (rebalancer_thread, NULL))
+    err_print ("%s\n", strerror (errno));
+
+  if (config->prefault_memory && (0 > thrd_join (prefault_thread, NULL)))
+    err_print ("%s\n", strerror (errno));
+
+  if (0 > thrd_join (expiry_thread, NULL))
+    err_print ("%s\n", strerror (errno));
+
   // Persist current state
   ftruncate (persistence_fd, 0);
   lseek (persistence_fd, SEEK_SET, 0);
@@ -224,6 +278,64 @@ run_logging_thread (const char *logfile)
   return thrd_success;
 }
 
+// Rebalances memory and, in between, compacts it a little at a time.  Doing
+// both on the same thread keeps them from fighting over slabs.
+static int
+run_rebalancer_thread (const RuntimeConfig *config)
+{
+  struct timespec delay = {.tv_sec = REBALANCE_INTERVAL, .tv_nsec = 0};
+  struct timespec step_delay = {.tv_sec = 0, .tv_nsec = COMPACTION_STEP_DELAY};
+  time_t next_rebalance = 0;
+
+  while (!atomic_load (&quit))
+    {
+      if (time (NULL) >= next_rebalance)
+        {
+          rebalance_memory ();
+          next_rebalance = time (NULL) + REBALANCE_INTERVAL;
+        }
+
+      if (config->compaction && compact_memory ())
+        thrd_sleep (&step_delay, NULL);
+      else
+        thrd_sleep (&delay, NULL);
+    }
+
+  return thrd_success;
+}
+
+static int
+run_prefault_thread (void *unused)
+{
+  (void) unused;
+
+  while (!atomic_load (&quit) && prefault_memory ())
+    thrd_yield ();
+
+  return thrd_success;
+}
+
+// Moves the expiry wheel on and reaps expired entries a batch at a time, see
+// expiry.c
+static int
+run_expiry_thread (void *unused)
+{
+  struct timespec delay = {.tv_sec = 1, .tv_nsec = 0};
+  struct timespec step_delay = {.tv_sec = 0, .tv_nsec = EXPIRY_STEP_DELAY};
+
+  (void) unused;
+
+  while (!atomic_load (&quit))
+    {
+      if (reap_expired_entries (EXPIRY_REAP_BATCH) == EXPIRY_REAP_BATCH)
+        thrd_sleep (&step_delay, NULL);
+      else
+        thrd_sleep (&delay, NULL);
+    }
+
+  return thrd_success;
+}
+
 static void
 unlock_and_close_fd_ptr (int *fd)
 {
@@ -266,7 +378,8 @@ write_entry_as_set_request_callback (CacheEntry *entry, int *fd)
   request.op            = CMD_BYTE_SET;
   request.s.klen        = entry->key.nmemb;
   request.s.ntags       = entry->tags.nmemb;
-  request.s.flags       = SET_FLAG_NONE;
+  request.s.flags       = (entry->value.compressed
+                           ? SET_FLAG_COMPRESSED : SET_FLAG_NONE);
   request.s._padding[0] = 0;
   request.s.vlen        = htonl (entry->value.nmemb);
   request.s.ttl         = htonl (0xFFFFFFFF);
@@ -289,7 +402,17 @@ write_entry_as_set_request_callback (CacheEntry *entry, int *fd)
       reverse_bytes (entry->tags.base[t].base, tlen);
       write (*fd, entry->tags.base[t].base, tlen);
     }
-  write (*fd, entry->value.base, entry->value.nmemb);
+  if (entry->value.chunked)
+    {
+      ValueChunks *chunks = entry->value.chunks;
+      for (u32 i = 0; i < chunks->nchunks; ++i)
+        write (*fd, chunks->chunks[i],
+               get_value_chunk_size (entry->value.nmemb, i));
+    }
+  else
+    {
+      write (*fd, entry->value.base, entry->value.nmemb);
+    }
 
   return true;
 }
@@ -8,9 +8,18 @@
 
 #include <sys/mman.h>
 
+#ifndef MADV_FREE
+# define MADV_FREE MADV_DONTNEED // Kernel headers older than 4.5
+#endif
+
 #include "memory.h"
+#include "admission.h"
 #include "entry.h"
+#include "epoch.h"
+#include "expiry.h"
+#include "evict.h"
 #include "log.h"
+#include "numa.h"
 
 #define PADDING(s)                                         \
   ((alignof (max_align_t) - ((s) % alignof (max_align_t))) \
@@ -21,51 +30,329 @@
 #define PADDED(s)  ((s) + PADDING (s))
 #define TPADDED(T) (sizeof (T) + TPADDING (T))
 
-typedef struct _Partition Partition;
-typedef struct _Bucket    Bucket;
+#define SMALL_SLAB_SIZE (SLAB_SIZE / SMALL_SLABS_PER_SLAB)
+
+typedef struct _Node         Node;
+typedef struct _Partition    Partition;
+typedef struct _Slab         Slab;
+typedef struct _Bucket       Bucket;
+typedef struct _MagazineRack MagazineRack;
+typedef struct _RetireList   RetireList;
 
 struct _Bucket
 {
-  u8        *data;
   Partition *partition;
-  _Atomic (Bucket *) next;
+  union
+  {
+    _Atomic (Bucket *) next; // While free
+    u32 nrequested;          // While reserved
+  };
+};
+
+// A slab is a SLAB_SIZE chunk of the arena that is carved into buckets of a
+// single partition.  Slabs can be handed over to another partition once none
+// of their buckets are held (see `rebalance_memory').  Small object slabs are
+// packed SMALL_SLABS_PER_SLAB to a slab, see `take_free_small_slab'.
+struct _Slab
+{
+  Partition *partition;
+  Slab      *next;
+  u8        *end;
+  atomic_uintptr_t cursor;   // Next bucket to carve
+  _Atomic (u32) num_held;    // Buckets carved and not on the free list
+  u32        compaction_backoff; // Only touched by the compactor
+  u32        num_packed;     // Small object slabs in use if packed
+  bool       packed;         // Split into small object slabs
 };
 
 struct _Partition
 {
   u32        size;
+  u32        stride;   // Bytes between buckets
+  bool       small;    // Headerless small object slots, see `reserve_small_memory'
+  u32        index;
+  Node      *node;
   Partition *next;
   _Atomic (Bucket *) free_buckets;
+  _Atomic (Slab *) current_slab;
+  Slab      *slabs;
+  atomic_flag slabs_lock;
+  u32        num_failures_seen; // Only touched by the rebalancer
+  _Atomic (u32) num_slabs;
+  _Atomic (u32) num_slabs_in;
+  _Atomic (u32) num_slabs_out;
+  _Atomic (u32) num_failures;
   _Atomic (u32) num_used;
   _Atomic (u32) num_free;
   _Atomic (u32) num_reused;
+  _Atomic (u32) num_evicted;
+  _Atomic (u32) num_magazine_hits;
+  _Atomic (u32) num_refills;
+  _Atomic (u32) num_drains;
+  _Atomic (u32) drain_requests; // Bumped to have magazines drained
+  _Atomic (u64) bytes_requested;
+};
+
+// Slab memory is split evenly between NUMA nodes (just one unless enabled in
+// the config) and each node has its own set of partitions and free slabs, so
+// memory is only shared across nodes when a node runs out.
+struct _Node
+{
+  u32        index;
+  Partition *partitions;
+  Partition *partition_table[MAX_NUM_BUCKETS];
+  Partition *small_partitions;
+  Partition *small_partition_table[MAX_SMALL_OBJECT_SIZE / SMALL_OBJECT_STEP];
+  Slab      *free_slabs;
+  Slab      *free_small_slabs;
+  atomic_flag free_slabs_lock; // Of both free lists
+  _Atomic (u32) num_free_slabs;
+  _Atomic (u32) num_free_small_slabs;
+  u8        *memory;
+  u8        *memory_end;
+  atomic_uintptr_t memory_cursor; // Next never used slab
 };
 
 CacheEntryHashMap **entry_maps = NULL;
 
-static Partition *partitions = NULL;
+static Node nodes[MAX_NUMA_NODES] = {};
+static u32  num_nodes = 1;
+
+static tss_t current_magazine_rack = (tss_t) -1;
+static tss_t current_retire_list = (tss_t) -1;
 
 static void *main_memory = NULL;
+static u8 *slab_memory = NULL;
+static Slab *small_slabs = NULL; // Headers of small object slabs
+static size_t total_memory = 0;
 static atomic_uintptr_t memory_cursor = 0;
+static uintptr_t committed_memory_end = 0;
+static atomic_flag commit_lock = ATOMIC_FLAG_INIT;
+static atomic_uintptr_t prefault_cursor = 0;
+static HugePageMode huge_page_mode = HUGE_PAGES_NONE;
+static PageReleaseMode page_release_mode = PAGE_RELEASE_NONE;
+static size_t page_release_threshold = 0;
+
+static const char *huge_page_mode_names[] = {
+  [HUGE_PAGES_NONE]        = "none",
+  [HUGE_PAGES_TRANSPARENT] = "transparent",
+  [HUGE_PAGES_EXPLICIT]    = "explicit"
+};
+
+static const char *page_release_mode_names[] = {
+  [PAGE_RELEASE_NONE]     = "none",
+  [PAGE_RELEASE_DONTNEED] = "dontneed",
+  [PAGE_RELEASE_FREE]     = "free"
+};
+
+// The slab being compacted and its buckets that are free or have been moved
+// out of.  Only touched by the compactor (which is also the rebalancer).
+static Slab   *compaction_slab = NULL;
+static Bucket *compaction_buckets = NULL;
+static Bucket *compaction_buckets_tail = NULL;
+static u32     num_compaction_buckets = 0;
+
+static _Atomic (u64) num_compacted_slabs = 0;
+static _Atomic (u64) num_aborted_compactions = 0;
+static _Atomic (u64) num_moved_buckets = 0;
+static _Atomic (u64) bytes_moved = 0;
+static _Atomic (u64) bytes_released = 0;
+
+static _Atomic (u64) num_released_buckets = 0;
+static _Atomic (u64) bucket_bytes_released = 0;
+
 static size_t total_system_size = 0;
 static size_t total_partition_size = 0;
 static size_t total_hash_map_array_size = 0;
 static size_t total_hash_maps_size = 0;
+static size_t total_small_slab_size = 0;
+
+static void release_magazine_rack (MagazineRack *);
+static void release_retire_list   (RetireList *);
+
+#define LOG2(x) ((u32) __builtin_ctz (x)) // Only for powers of 2
+
+// Size classes grow geometrically by SIZE_CLASS_STEPS classes per doubling, so
+// each is between 1 + 1/STEPS and 1 + 1/(2 * STEPS) times bigger than the last.
+static inline u32
+get_next_size_class (u32 size)
+{
+  u32 power = (u32) 1 << (31 - __builtin_clz (size));
+  return size + (power / SIZE_CLASS_STEPS);
+}
+
+// Make sure the arena is readable and writable up to `end'.  The arena is
+// mapped without backing so we commit it in chunks as we go instead of up
+// front, but pages still don't take up any RSS until they are touched.
+static bool
+commit_memory (uintptr_t end)
+{
+  bool committed = true;
+
+  if (end <= __atomic_load_n (&committed_memory_end, __ATOMIC_ACQUIRE))
+    return true;
+
+  while (atomic_flag_test_and_set_explicit (&commit_lock, memory_order_acquire))
+    thrd_yield ();
+
+  if (end > committed_memory_end)
+    {
+      uintptr_t arena_end = (uintptr_t) main_memory + total_memory;
+      uintptr_t new_end   = end + MEMORY_COMMIT_SIZE - 1;
+      new_end -= (new_end - (uintptr_t) main_memory) % MEMORY_COMMIT_SIZE;
+      if (new_end > arena_end)
+        new_end = arena_end;
+
+      if (0 == mprotect ((void *) committed_memory_end,
+                         new_end - committed_memory_end,
+                         PROT_READ | PROT_WRITE))
+        {
+          __atomic_store_n (&committed_memory_end, new_end, __ATOMIC_RELEASE);
+        }
+      else
+        {
+          err_print ("Failed to commit %zu bytes: %s\n",
+                     (size_t) (new_end - committed_memory_end),
+                     strerror (errno));
+          committed = false;
+        }
+    }
+
+  atomic_flag_clear_explicit (&commit_lock, memory_order_release);
+
+  return committed;
+}
 
 static void *
-push_memory (u32 size)
+push_memory (size_t size)
 {
   uintptr_t ptr = atomic_fetch_add (&memory_cursor, size);
-  if ((ptr + size) > ((uintptr_t) main_memory + MAX_TOTAL_MEMORY))
+  if ((ptr + size) > ((uintptr_t) main_memory + total_memory))
+    return NULL;
+  if (!commit_memory (ptr + size))
     return NULL;
   return (void *) ptr;
 }
 
+// Maps `total_memory' bytes of address space for the arena, backed by huge
+// pages if `mode' asks for it.  Sets `huge_page_mode' to what we actually got.
+static void *
+map_arena (HugePageMode mode)
+{
+  u8 *base, *aligned;
+  size_t size;
+
+  huge_page_mode = HUGE_PAGES_NONE;
+
+  if (mode == HUGE_PAGES_EXPLICIT)
+    {
+      // No MAP_NORESERVE here so that a too small huge page pool fails the
+      // mapping rather than SIGBUS'ing on first touch
+      base = mmap ((void *) 0, total_memory, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (base != MAP_FAILED)
+        {
+          huge_page_mode = HUGE_PAGES_EXPLICIT;
+          return base;
+        }
+
+      wrn_print ("Failed to map %zu bytes of huge pages, falling back to"
+                 " transparent huge pages: %s\n", total_memory, strerror (errno));
+      mode = HUGE_PAGES_TRANSPARENT;
+    }
+
+  if (mode == HUGE_PAGES_NONE)
+    return mmap ((void *) 0, total_memory, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+  // Transparent huge pages are only used for huge page aligned ranges so
+  // over-map by one huge page and trim the ends to get an aligned arena
+  size = total_memory + HUGE_PAGE_SIZE;
+  base = mmap ((void *) 0, size, PROT_NONE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED)
+    return base;
+
+  aligned = base + ((HUGE_PAGE_SIZE - ((uintptr_t) base % HUGE_PAGE_SIZE))
+                    % HUGE_PAGE_SIZE);
+  if (aligned > base)
+    munmap (base, aligned - base);
+  if ((base + size) > (aligned + total_memory))
+    munmap (aligned + total_memory, (base + size) - (aligned + total_memory));
+
+  if (0 == madvise (aligned, total_memory, MADV_HUGEPAGE))
+    huge_page_mode = HUGE_PAGES_TRANSPARENT;
+  else
+    wrn_print ("Transparent huge pages unavailable: %s\n", strerror (errno));
+
+  return aligned;
+}
+
+// Small object partitions hand out slots without a bucket header.  Their size
+// class is found through the slab they're in (see `release_small_memory').
+static void
+init_partition (Partition *partition, Node *node, u32 size, u32 index,
+                bool small)
+{
+  partition->size = size;
+  partition->stride = small ? size : (TPADDED (Bucket) + PADDED (size));
+  partition->small = small;
+  partition->index = index;
+  partition->node = node;
+  partition->next = NULL;
+  atomic_init (&partition->free_buckets, NULL);
+  atomic_init (&partition->current_slab, NULL);
+  partition->slabs = NULL;
+  partition->slabs_lock = (atomic_flag) ATOMIC_FLAG_INIT;
+  partition->num_failures_seen = 0;
+  atomic_init (&partition->num_slabs, 0);
+  atomic_init (&partition->num_slabs_in, 0);
+  atomic_init (&partition->num_slabs_out, 0);
+  atomic_init (&partition->num_failures, 0);
+  atomic_init (&partition->num_used, 0);
+  atomic_init (&partition->num_free, 0);
+  atomic_init (&partition->num_reused, 0);
+  atomic_init (&partition->num_evicted, 0);
+  atomic_init (&partition->num_magazine_hits, 0);
+  atomic_init (&partition->num_refills, 0);
+  atomic_init (&partition->num_drains, 0);
+  atomic_init (&partition->drain_requests, 0);
+  atomic_init (&partition->bytes_requested, 0);
+}
+
 int
-init_memory ()
+init_memory (const RuntimeConfig *config)
 {
-  for (u32 size = MIN_BUCKET_SIZE; size <= MAX_BUCKET_SIZE; size <<= 1)
-    total_partition_size += sizeof (Partition);
+  size_t memory_limit = config->memory_limit;
+  size_t node_size;
+  size_t page_size;
+  u32 num_classes = 0;
+  int err;
+
+  assert ((SLAB_SIZE % SLAB_ALIGNMENT) == 0);
+  assert (SLAB_SIZE >= (TPADDED (Slab) + TPADDED (Bucket)
+                        + PADDED (MAX_BUCKET_SIZE)));
+  assert ((MIN_BUCKET_SIZE & (MIN_BUCKET_SIZE - 1)) == 0);
+  assert ((MAX_BUCKET_SIZE & (MAX_BUCKET_SIZE - 1)) == 0);
+  assert ((SIZE_CLASS_STEPS & (SIZE_CLASS_STEPS - 1)) == 0);
+  assert (((MIN_BUCKET_SIZE / SIZE_CLASS_STEPS) % alignof (max_align_t)) == 0);
+  assert ((SMALL_OBJECT_STEP % alignof (max_align_t)) == 0);
+  assert (SMALL_OBJECT_STEP >= sizeof (Bucket)); // Free slots are linked
+  assert ((MAX_SMALL_OBJECT_SIZE % SMALL_OBJECT_STEP) == 0);
+  assert (MAX_SMALL_FALLBACK_SIZE >= MIN_BUCKET_SIZE);
+  assert ((SLAB_SIZE % SMALL_SLABS_PER_SLAB) == 0);
+  assert ((SMALL_SLAB_SIZE % alignof (max_align_t)) == 0);
+  assert (SMALL_SLAB_SIZE >= (TPADDED (Slab) + MAX_SMALL_OBJECT_SIZE));
+
+  num_nodes = get_num_numa_nodes ();
+  cik_assert (num_nodes > 0 && num_nodes <= MAX_NUMA_NODES);
+
+  for (u32 size = MIN_BUCKET_SIZE; size <= MAX_BUCKET_SIZE;
+       size = get_next_size_class (size))
+    ++num_classes;
+  assert (num_classes <= MAX_NUM_BUCKETS);
+  num_classes += MAX_SMALL_OBJECT_SIZE / SMALL_OBJECT_STEP;
+  total_partition_size  = num_nodes * num_classes * sizeof (Partition);
   total_partition_size += PADDING (total_partition_size);
 
   total_hash_map_array_size  = NUM_CACHE_ENTRY_MAPS * sizeof (CacheEntryHashMap *);
@@ -73,44 +360,107 @@ init_memory ()
   total_hash_maps_size       = NUM_CACHE_ENTRY_MAPS * (sizeof (CacheEntryHashMap)
                                                        + TPADDING (CacheEntryHashMap));
 
+  total_memory = memory_limit;
+  if (config->huge_pages != HUGE_PAGES_NONE)
+    total_memory += (HUGE_PAGE_SIZE - (total_memory % HUGE_PAGE_SIZE))
+      % HUGE_PAGE_SIZE;
+
+  // One header for every small object slab the arena could be split into
+  total_small_slab_size  = ((total_memory / SLAB_SIZE) * SMALL_SLABS_PER_SLAB
+                            * sizeof (Slab));
+  total_small_slab_size += PADDING (total_small_slab_size);
+
   total_system_size = (total_partition_size
                        + total_hash_map_array_size
-                       + total_hash_maps_size);
+                       + total_hash_maps_size
+                       + total_small_slab_size);
 
-  // Try to allocate memory
-  dbg_print ("Reserving %u bytes\n", MAX_TOTAL_MEMORY);
-  main_memory = mmap ((void *) 0, MAX_TOTAL_MEMORY,
-                      PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-  if (main_memory == MAP_FAILED)
+  if (memory_limit < (total_system_size + SLAB_ALIGNMENT
+                      + (num_nodes * SLAB_SIZE)))
     {
-      err_print ("Failed to map %u bytes: %s\n",
-                 MAX_TOTAL_MEMORY, strerror (errno));
-      return errno;
+      err_print ("Memory limit must be at least %zu bytes\n",
+                 total_system_size + SLAB_ALIGNMENT + (num_nodes * SLAB_SIZE));
+      return EINVAL;
     }
 
-  dbg_print ("Committing %u bytes\n", MAX_TOTAL_MEMORY);
-  if (0 != mprotect (main_memory, MAX_TOTAL_MEMORY, PROT_READ | PROT_WRITE))
+  // Try to allocate memory
+  dbg_print ("Reserving %zu bytes\n", total_memory);
+  main_memory = map_arena (config->huge_pages);
+  if (main_memory == MAP_FAILED)
     {
-      err_print ("Failed to commit %u bytes: %s\n",
-                 MAX_TOTAL_MEMORY, strerror (errno));
+      err_print ("Failed to map %zu bytes: %s\n",
+                 total_memory, strerror (errno));
       return errno;
     }
 
+  dbg_print ("Using %s huge pages\n", huge_page_mode_names[huge_page_mode]);
+
+  // Huge pages can't be partly released and prefaulting wants RSS
+  if ((huge_page_mode == HUGE_PAGES_NONE) && !config->prefault_memory)
+    page_release_mode = config->release_pages;
+  page_release_threshold = config->release_pages_above;
+
+  committed_memory_end = (uintptr_t) main_memory;
   atomic_init (&memory_cursor, (uintptr_t) main_memory);
+  atomic_init (&prefault_cursor, (uintptr_t) main_memory);
   assert (((intptr_t) memory_cursor % alignof (max_align_t)) == 0);
 
-  for (u32 size = MAX_BUCKET_SIZE; size >= MIN_BUCKET_SIZE; size >>= 1)
+  err = tss_create (&current_magazine_rack,
+                    (tss_dtor_t) release_magazine_rack);
+  cik_assert (err == thrd_success);
+  cik_assert (current_magazine_rack != (tss_t) -1);
+  if (err != thrd_success)
+    return err;
+
+  tss_set (current_magazine_rack, NULL);
+
+  err = tss_create (&current_retire_list, (tss_dtor_t) release_retire_list);
+  cik_assert (err == thrd_success);
+  cik_assert (current_retire_list != (tss_t) -1);
+  if (err != thrd_success)
+    return err;
+
+  tss_set (current_retire_list, NULL);
+
+  for (u32 n = 0; n < num_nodes; ++n)
     {
-      Partition *partition = push_memory (sizeof (Partition));
-      partition->size = size;
-      partition->next = partitions;
-      partitions = partition;
-      atomic_init (&partition->free_buckets, NULL);
-      atomic_init (&partition->num_used, 0);
-      atomic_init (&partition->num_free, 0);
-      atomic_init (&partition->num_reused, 0);
+      Node *node = &nodes[n];
+      Partition **tail = &node->partitions;
+      u32 index = 0;
+
+      node->index = n;
+      node->partitions = NULL;
+      node->small_partitions = NULL;
+      node->free_slabs = NULL;
+      node->free_small_slabs = NULL;
+      node->free_slabs_lock = (atomic_flag) ATOMIC_FLAG_INIT;
+      atomic_init (&node->num_free_slabs, 0);
+      atomic_init (&node->num_free_small_slabs, 0);
+
+      for (u32 size = MIN_BUCKET_SIZE; size <= MAX_BUCKET_SIZE;
+           size = get_next_size_class (size))
+        {
+          Partition *partition = push_memory (sizeof (Partition));
+          init_partition (partition, node, size, index, false);
+          node->partition_table[index++] = partition;
+          *tail = partition;
+          tail = &partition->next;
+        }
+
+      tail = &node->small_partitions;
+      index = 0;
+      for (u32 size = SMALL_OBJECT_STEP; size <= MAX_SMALL_OBJECT_SIZE;
+           size += SMALL_OBJECT_STEP)
+        {
+          Partition *partition = push_memory (sizeof (Partition));
+          init_partition (partition, node, size, index, true);
+          node->small_partition_table[index++] = partition;
+          *tail = partition;
+          tail = &partition->next;
+        }
     }
-  push_memory (PADDING (total_partition_size));
+  push_memory (total_partition_size
+               - (num_nodes * num_classes * sizeof (Partition)));
 
   entry_maps = push_memory (total_hash_map_array_size);
   for (u32 i = 0; i < NUM_CACHE_ENTRY_MAPS; ++i)
@@ -120,9 +470,41 @@ init_memory ()
       assert (((intptr_t) memory_cursor % alignof (max_align_t)) == 0);
     }
 
+  small_slabs = push_memory (total_small_slab_size);
+
   // Make sure all allocations are accounted for
   assert ((size_t) (memory_cursor - (uintptr_t) main_memory) == total_system_size);
 
+  // The rest is handed out as page aligned slabs, an equal share per node
+  push_memory ((SLAB_ALIGNMENT - (total_system_size % SLAB_ALIGNMENT))
+               % SLAB_ALIGNMENT);
+  slab_memory = (u8 *) atomic_load (&memory_cursor);
+
+  node_size  = ((u8 *) main_memory + total_memory - slab_memory) / num_nodes;
+  node_size -= node_size % SLAB_SIZE;
+  page_size  = ((huge_page_mode == HUGE_PAGES_EXPLICIT)
+                ? HUGE_PAGE_SIZE : SLAB_ALIGNMENT);
+
+  for (u32 n = 0; n < num_nodes; ++n)
+    {
+      Node *node = &nodes[n];
+      uintptr_t first, last;
+
+      node->memory = slab_memory + (n * node_size);
+      node->memory_end = node->memory + node_size;
+      atomic_init (&node->memory_cursor, (uintptr_t) node->memory);
+
+      if (num_nodes == 1)
+        continue;
+
+      // Memory policies apply to whole pages so we leave out partial pages at
+      // either end and let them land wherever they're first touched.
+      first = (((uintptr_t) node->memory + page_size - 1) / page_size) * page_size;
+      last  = ((uintptr_t) node->memory_end / page_size) * page_size;
+      if (last > first)
+        bind_memory_to_numa_node ((void *) first, last - first, n);
+    }
+
   return 0;
 }
 
@@ -135,166 +517,1871 @@ init_memory ()
 #define WRITE_POINTER(p, v) \
   atomic_store ((p), (v))
 
-void *
-reserve_memory (u32 size)
-{
-  Bucket    *bucket    = NULL;
-  Partition *partition = NULL;
-  _Atomic (Bucket *) *free_list = NULL;
+#define LOCK_SLABS(l) \
+  do {} while (atomic_flag_test_and_set_explicit ((l), memory_order_acquire))
+#define UNLOCK_SLABS(l) \
+  atomic_flag_clear_explicit ((l), memory_order_release)
 
-  for (Partition **p = &partitions; *p; p = &(*p)->next)
-    {
-      if ((*p)->size >= size)
-        {
-          partition = *p;
-          break;
-        }
-    }
+#define BUCKET_STRIDE(partition) ((partition)->stride)
 
-  if (!partition)
+#define BUCKET_DATA(bucket) (((u8 *) (bucket)) + TPADDED (Bucket))
+
+static inline Partition *
+get_partition_for_size (Node *node, u32 size)
+{
+  Partition **partition_table = node->partition_table;
+  u32 power, index;
+
+  if (size <= MIN_BUCKET_SIZE)
+    return partition_table[0];
+  if (size > MAX_BUCKET_SIZE)
     return NULL;
 
-  free_list = &partition->free_buckets;
+  // Find the power of 2 below `size' and then the step above it
+  power = 31 - __builtin_clz (size - 1);
+  index = (1 + ((power - LOG2 (MIN_BUCKET_SIZE)) * SIZE_CLASS_STEPS)
+           + (((size - 1) - ((u32) 1 << power))
+              >> (power - LOG2 (SIZE_CLASS_STEPS))));
+
+  cik_assert (partition_table[index]->size >= size);
+  cik_assert ((index == 0) || (partition_table[index - 1]->size < size));
+
+  return partition_table[index];
+}
+
+static inline Bucket *
+get_bucket (void *memory)
+{
+  return (Bucket *) (((u8 *) memory) - TPADDED (Bucket));
+}
+
+static inline void
+account_reserved (Bucket *bucket, u32 size)
+{
+  bucket->nrequested = size;
+  atomic_fetch_add_explicit (&bucket->partition->bytes_requested, size,
+                             memory_order_relaxed);
+}
+
+static inline void
+account_released (Bucket *bucket)
+{
+  atomic_fetch_sub_explicit (&bucket->partition->bytes_requested,
+                             bucket->nrequested, memory_order_relaxed);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// SLABS
+
+static inline Slab *
+get_slab (Bucket *bucket)
+{
+  size_t offset = (u8 *) bucket - slab_memory;
+  Slab  *slab   = (Slab *) (slab_memory + (offset - (offset % SLAB_SIZE)));
+
+  if (slab->packed)
+    return &small_slabs[offset / SMALL_SLAB_SIZE];
+
+  return slab;
+}
+
+// Small object slab headers don't live in the slab they're for, so that a
+// `carve_bucket' call with a stale slab pointer never writes to a bucket once
+// the slab they're packed into is back to being a regular slab.
+static inline bool
+is_small_slab (Slab *slab)
+{
+  return ((u8 *) slab < slab_memory);
+}
+
+// Get the slab that small object slab `slab' is packed into
+static inline Slab *
+get_packed_slab (Slab *slab)
+{
+  return ((Slab *) (slab_memory + (((slab - small_slabs) / SMALL_SLABS_PER_SLAB)
+                                   * SLAB_SIZE)));
+}
+
+// Get the first byte of `slab' to carve into buckets
+static inline u8 *
+get_slab_begin (Slab *slab)
+{
+  size_t index;
+
+  if (!is_small_slab (slab))
+    return (u8 *) slab + TPADDED (Slab);
+
+  index = slab - small_slabs;
+  if ((index % SMALL_SLABS_PER_SLAB) == 0)
+    return slab_memory + (index * SMALL_SLAB_SIZE) + TPADDED (Slab);
+
+  return slab_memory + (index * SMALL_SLAB_SIZE);
+}
+
+// Get the byte following the memory of `slab'
+static inline u8 *
+get_slab_limit (Slab *slab)
+{
+  if (!is_small_slab (slab))
+    return (u8 *) slab + SLAB_SIZE;
+
+  return slab_memory + (((slab - small_slabs) + 1) * SMALL_SLAB_SIZE);
+}
+
+// Map a never used slab from the memory of `node'
+static Slab *
+push_slab (Node *node)
+{
+  uintptr_t ptr = atomic_load (&node->memory_cursor);
 
-  if (MARK_POINTER (free_list))
+  do
     {
-      bucket = READ_POINTER (free_list);
-      if (bucket)
-        {
-          WRITE_POINTER (free_list, bucket->next);
-          atomic_fetch_sub_explicit (&partition->num_free, 1,
-                                     memory_order_relaxed);
-          atomic_fetch_add_explicit (&partition->num_reused, 1,
-                                     memory_order_relaxed);
-        }
-      else
-        UNMARK_POINTER (free_list);
+      if ((ptr + SLAB_SIZE) > (uintptr_t) node->memory_end)
+        return NULL;
     }
+  while (!atomic_compare_exchange_weak (&node->memory_cursor, &ptr,
+                                        ptr + SLAB_SIZE));
+
+  if (!commit_memory (ptr + SLAB_SIZE))
+    return NULL;
 
-  // We push new memory if the free-list is empty
-  // .. or if we lost a @Race to pop from the free-list.
+  return (Slab *) ptr;
+}
 
-  if (!bucket)
+static Slab *
+take_free_slab (Node *node)
+{
+  Slab *slab;
+
+  LOCK_SLABS (&node->free_slabs_lock);
+  slab = node->free_slabs;
+  if (slab)
     {
-      bucket = push_memory (TPADDED (Bucket) + PADDED (partition->size));
-      if (!bucket)
-        return NULL;
-      bucket->data = ((u8 *) bucket) + TPADDED (Bucket);
-      bucket->partition = partition;
+      node->free_slabs = slab->next;
+      atomic_fetch_sub (&node->num_free_slabs, 1);
     }
+  UNLOCK_SLABS (&node->free_slabs_lock);
 
-  atomic_fetch_add_explicit (&partition->num_used, 1, memory_order_relaxed);
+  if (!slab)
+    slab = push_slab (node);
 
-  return bucket->data;
+  return slab;
 }
 
-void
-release_memory (void *memory)
+static void
+put_free_slab (Node *node, Slab *slab)
 {
-  Partition *partition = NULL;
-  Bucket    *bucket    = NULL;
-  _Atomic (Bucket *) *free_list = NULL;
+  LOCK_SLABS (&node->free_slabs_lock);
+  slab->next = node->free_slabs;
+  node->free_slabs = slab;
+  atomic_fetch_add (&node->num_free_slabs, 1);
+  UNLOCK_SLABS (&node->free_slabs_lock);
+}
 
-  cik_assert (memory != NULL);
+// Take a free small object slab of `node'.  Once there are none left we take
+// a free slab and split it into SMALL_SLABS_PER_SLAB of them, so the small size
+// classes share slabs rather than each taking a whole one.
+static Slab *
+take_free_small_slab (Node *node)
+{
+  Slab *slab, *packed, *first;
 
-  bucket    = (Bucket *) (((u8 *) memory) - TPADDED (Bucket));
-  partition = bucket->partition;
+  LOCK_SLABS (&node->free_slabs_lock);
+  slab = node->free_small_slabs;
+  if (slab)
+    {
+      node->free_small_slabs = slab->next;
+      atomic_fetch_sub (&node->num_free_small_slabs, 1);
+      ++get_packed_slab (slab)->num_packed;
+    }
+  UNLOCK_SLABS (&node->free_slabs_lock);
 
-  free_list = &partition->free_buckets;
+  if (slab)
+    return slab;
 
-  do
+  packed = take_free_slab (node);
+  if (!packed)
+    return NULL;
+
+  // `num_held' of the small object slabs is left alone, see `init_slab'
+  first = &small_slabs[((u8 *) packed - slab_memory) / SMALL_SLAB_SIZE];
+  for (u32 i = 0; i < SMALL_SLABS_PER_SLAB; ++i)
+    first[i].partition = NULL;
+
+  LOCK_SLABS (&node->free_slabs_lock);
+  packed->partition = NULL;
+  packed->packed = true;
+  packed->num_packed = 1;
+  for (u32 i = 1; i < SMALL_SLABS_PER_SLAB; ++i)
     {
-      bucket->next = READ_POINTER (free_list);
+      first[i].next = node->free_small_slabs;
+      node->free_small_slabs = &first[i];
     }
-  while (!atomic_compare_exchange_weak (free_list,
-                                        (Bucket **) &bucket->next,
-                                        bucket));
+  atomic_fetch_add (&node->num_free_small_slabs, SMALL_SLABS_PER_SLAB - 1);
+  UNLOCK_SLABS (&node->free_slabs_lock);
 
-  atomic_fetch_add_explicit (&partition->num_free, 1, memory_order_relaxed);
-  atomic_fetch_sub_explicit (&partition->num_used, 1, memory_order_relaxed);
+  return first;
 }
 
-CacheEntry *
-reserve_and_lock_entry (size_t payload_size)
+// Put small object slab `slab' back in the pool of `node'.  Once every small
+// object slab of the slab they're packed into is free it's a slab again.
+static void
+put_free_small_slab (Node *node, Slab *slab)
 {
-  CacheEntry *entry = NULL;
-  size_t total_size = sizeof (CacheEntry) + payload_size;
+  Slab *packed = get_packed_slab (slab);
+  Slab *first  = slab - ((slab - small_slabs) % SMALL_SLABS_PER_SLAB);
 
-  entry = reserve_memory (total_size);
-  if (entry == NULL)
-    return NULL;
+  LOCK_SLABS (&node->free_slabs_lock);
+  slab->next = node->free_small_slabs;
+  node->free_small_slabs = slab;
+  atomic_fetch_add (&node->num_free_small_slabs, 1);
 
-  *entry = CACHE_ENTRY_INIT;
-  LOCK_ENTRY (entry);
+  if (--packed->num_packed == 0)
+    {
+      for (Slab **s = &node->free_small_slabs; *s;)
+        {
+          if ((*s >= first) && (*s < (first + SMALL_SLABS_PER_SLAB)))
+            *s = (*s)->next;
+          else
+            s = &(*s)->next;
+        }
+      atomic_fetch_sub (&node->num_free_small_slabs, SMALL_SLABS_PER_SLAB);
 
-  return entry;
+      packed->packed = false;
+      packed->next = node->free_slabs;
+      node->free_slabs = packed;
+      atomic_fetch_add (&node->num_free_slabs, 1);
+    }
+  UNLOCK_SLABS (&node->free_slabs_lock);
 }
 
-bool
-reserve_biggest_possible_payload (Payload *payload)
+static void
+init_slab (Slab *slab, Partition *partition)
 {
-  cik_assert (payload != NULL);
-  payload->base = reserve_memory (MAX_BUCKET_SIZE);
-  if (payload->base != NULL)
+  u32 stride   = BUCKET_STRIDE (partition);
+  u8 *first    = get_slab_begin (slab);
+  u32 nbuckets = (get_slab_limit (slab) - first) / stride;
+
+  slab->partition = partition;
+  slab->next = NULL;
+  slab->end = first + (nbuckets * stride);
+  slab->compaction_backoff = 0;
+  atomic_init (&slab->cursor, (uintptr_t) first);
+
+  // `num_held' is left alone.  It's zero for new (mapped) and reclaimed slabs
+  // but a `carve_bucket' call with a stale slab pointer may briefly hold it.
+}
+
+// Carve a never used bucket out of the current slab of `partition'.
+static Bucket *
+carve_bucket (Partition *partition)
+{
+  u32 stride = BUCKET_STRIDE (partition);
+
+  for (;;)
     {
-      payload->nmemb = 0;
-      payload->cap = MAX_BUCKET_SIZE;
-      return true;
+      Slab *slab = atomic_load (&partition->current_slab);
+      Slab *fresh;
+      Partition *owner;
+
+      if (slab)
+        {
+          uintptr_t ptr;
+
+          // We hold our bucket before we check that `slab' is still current so
+          // the rebalancer can't reclaim it from under us.  Slabs are only
+          // replaced once full so if it is we know the cursor is valid.
+          atomic_fetch_add (&slab->num_held, 1);
+          if (slab == atomic_load (&partition->current_slab))
+            {
+              ptr = atomic_fetch_add (&slab->cursor, stride);
+              if ((ptr + stride) <= (uintptr_t) slab->end)
+                {
+                  Bucket *bucket = (Bucket *) ptr;
+                  bucket->partition = partition;
+                  return bucket;
+                }
+            }
+          atomic_fetch_sub (&slab->num_held, 1);
+          if (slab != atomic_load (&partition->current_slab))
+            continue; // Someone else installed a new slab
+        }
+
+      fresh = (partition->small
+               ? take_free_small_slab (partition->node)
+               : take_free_slab (partition->node));
+      if (!fresh)
+        return NULL;
+
+      owner = fresh->partition;
+      init_slab (fresh, partition);
+
+      if (!atomic_compare_exchange_strong (&partition->current_slab, &slab,
+                                           fresh))
+        {
+          // We lost a @Race to install a new slab
+          fresh->partition = owner;
+          if (partition->small)
+            put_free_small_slab (partition->node, fresh);
+          else
+            put_free_slab (partition->node, fresh);
+          continue;
+        }
+
+      if ((owner != NULL) && (owner != partition))
+        atomic_fetch_add (&partition->num_slabs_in, 1);
+
+      LOCK_SLABS (&partition->slabs_lock);
+      fresh->next = partition->slabs;
+      partition->slabs = fresh;
+      UNLOCK_SLABS (&partition->slabs_lock);
+      atomic_fetch_add (&partition->num_slabs, 1);
     }
-  return false;
 }
 
-void
-release_all_memory ()
+// Pop up to `max' buckets off the global free list of `partition' and return
+// them as a NULL terminated chain.  We wait for the list if another thread is
+// popping from it rather than pushing new memory (which would leak buckets).
+static Bucket *
+pop_free_buckets (Partition *partition, u32 max, u32 *count)
 {
-  if (0 != munmap (main_memory, MAX_TOTAL_MEMORY))
+  _Atomic (Bucket *) *free_list = &partition->free_buckets;
+  Bucket *first, *last;
+  u32 n = 0;
+
+  cik_assert (max > 0);
+
+  if (READ_POINTER (free_list) == NULL)
+    return NULL; // Don't bother locking an empty list
+
+  while (!MARK_POINTER (free_list))
+    thrd_yield ();
+
+  first = last = READ_POINTER (free_list);
+  if (first == NULL)
+    {
+      UNMARK_POINTER (free_list);
+      return NULL;
+    }
+
+  atomic_fetch_add (&get_slab (first)->num_held, 1);
+  for (n = 1; (n < max) && (last->next != NULL); ++n)
     {
-      err_print ("Failed to unmap %u bytes: %s\n",
-                 MAX_TOTAL_MEMORY, strerror (errno));
+      last = last->next;
+      atomic_fetch_add (&get_slab (last)->num_held, 1);
     }
+
+  WRITE_POINTER (free_list, last->next);
+  last->next = NULL;
+
+  *count = n;
+  return first;
 }
 
-void
-populate_nfo_response (NFOResponsePayload *nfo)
+// Push the chain `first' .. `last' onto the global free list of `partition'.
+static void
+push_free_buckets (Partition *partition, Bucket *first, Bucket *last)
 {
-  cik_assert (nfo != NULL);
+  _Atomic (Bucket *) *free_list = &partition->free_buckets;
 
-  nfo->server.bytes_reserved = MAX_TOTAL_MEMORY - total_system_size;
-  nfo->server.bytes_used     = 0;
-  nfo->server.bytes_free     = 0;
-  nfo->server.bytes_reused   = 0;
+  for (Bucket *bucket = first; bucket != last; bucket = bucket->next)
+    atomic_fetch_sub (&get_slab (bucket)->num_held, 1);
+  atomic_fetch_sub (&get_slab (last)->num_held, 1);
 
-  for (Partition **p = &partitions; *p; p = &(*p)->next)
+  do
     {
-      Partition *partition = *p;
-      u32 num_used   = atomic_load (&partition->num_used);
-      u32 num_free   = atomic_load (&partition->num_free);
-      u32 num_reused = atomic_load (&partition->num_reused);
-      nfo->server.bytes_used   += partition->size * num_used;
-      nfo->server.bytes_free   += partition->size * num_free;
-      nfo->server.bytes_reused += partition->size * num_reused;
+      last->next = READ_POINTER (free_list);
     }
+  while (!atomic_compare_exchange_weak (free_list,
+                                        (Bucket **) &last->next,
+                                        first));
 }
 
-void
-write_memory_stats (int fd)
+////////////////////////////////////////////////////////////////////////////////
+// MAGAZINES
+//
+// Each thread keeps a small stack ("magazine") of free buckets per size class
+// so most reservations and releases never touch the shared free lists.  Empty
+// magazines are refilled and full ones drained by half their capacity at a
+// time.  Magazines are capped in bytes so big size classes aren't hoarded by
+// idle threads; classes where not even one bucket fits bypass them entirely.
+// A thread's magazines only hold buckets of the node it first allocated on.
+// The rebalancer can't reclaim a slab with buckets in magazines, so it asks
+// for them back and threads drain the whole magazine the next time they use
+// it.
+
+typedef struct
+{
+  u32     count;
+  u32     cap;
+  u32     drains_seen; // Of the partition's `drain_requests'
+  Bucket *buckets[MAGAZINE_SIZE];
+} Magazine;
+
+struct _MagazineRack
+{
+  Node    *node;
+  Magazine magazines[MAX_NUM_BUCKETS];
+};
+
+static void
+drain_magazine (Partition *partition, Magazine *magazine, u32 count)
+{
+  cik_assert (count <= magazine->count);
+
+  if (count == 0)
+    return;
+
+  // Drain from the bottom, the top buckets are the most recently used
+  for (u32 i = 1; i < count; ++i)
+    magazine->buckets[i]->next = magazine->buckets[i - 1];
+  push_free_buckets (partition, magazine->buckets[count - 1],
+                     magazine->buckets[0]);
+
+  magazine->count -= count;
+  memmove (&magazine->buckets[0], &magazine->buckets[count],
+           magazine->count * sizeof (Bucket *));
+
+  atomic_fetch_add_explicit (&partition->num_drains, 1, memory_order_relaxed);
+}
+
+static void
+refill_magazine (Partition *partition, Magazine *magazine)
 {
-  u32 memory_used = atomic_load (&memory_cursor) - (uintptr_t) main_memory;
-  u32 memory_left = 0;
+  u32 count = 0;
+  Bucket *bucket = pop_free_buckets (partition, (magazine->cap + 1) / 2,
+                                     &count);
+
+  if (bucket == NULL)
+    return;
+
+  for (; bucket; bucket = bucket->next)
+    magazine->buckets[magazine->count++] = bucket;
+
+  cik_assert (magazine->count <= magazine->cap);
+
+  atomic_fetch_add_explicit (&partition->num_refills, 1, memory_order_relaxed);
+}
 
-  if (MAX_TOTAL_MEMORY > memory_used)
-    memory_left = MAX_TOTAL_MEMORY - memory_used;
+static void
+release_magazine_rack (MagazineRack *rack)
+{
+  Bucket *bucket = get_bucket (rack);
 
-  dprintf (fd, "%s\t%s\t%s\t%s\t%s\n",
-           "Size", "Used", "Free", "Reused", "Available");
+  account_released (bucket);
 
-  for (Partition **p = &partitions; *p; p = &(*p)->next)
+  for (Partition **p = &rack->node->partitions; *p; p = &(*p)->next)
     {
-      Partition *partition = *p;
-      u32 num_used   = atomic_load (&partition->num_used);
-      u32 num_free   = atomic_load (&partition->num_free);
-      u32 num_reused = atomic_load (&partition->num_reused);
-      dprintf (fd, "%u\t%u\t%u\t%u\t%u\n", partition->size, num_used, num_free,
-               num_reused, memory_left / partition->size);
+      Magazine *magazine = &rack->magazines[(*p)->index];
+      drain_magazine (*p, magazine, magazine->count);
     }
+
+  // Bypass `release_memory', this thread has no magazines anymore
+  push_free_buckets (bucket->partition, bucket, bucket);
+  atomic_fetch_add_explicit (&bucket->partition->num_free, 1,
+                             memory_order_relaxed);
+  atomic_fetch_sub_explicit (&bucket->partition->num_used, 1,
+                             memory_order_relaxed);
+}
+
+static MagazineRack *
+create_magazine_rack (Node *node)
+{
+  Partition    *partition = get_partition_for_size (node,
+                                                    sizeof (MagazineRack));
+  MagazineRack *rack      = NULL;
+  Bucket       *bucket    = NULL;
+  u32           count     = 0;
+
+  bucket = pop_free_buckets (partition, 1, &count);
+  if (!bucket)
+    bucket = carve_bucket (partition);
+  if (!bucket)
+    return NULL;
+
+  atomic_fetch_add_explicit (&partition->num_used, 1, memory_order_relaxed);
+  if (count > 0)
+    {
+      atomic_fetch_sub_explicit (&partition->num_free, 1, memory_order_relaxed);
+      atomic_fetch_add_explicit (&partition->num_reused, 1,
+                                 memory_order_relaxed);
+    }
+
+  account_reserved (bucket, sizeof (MagazineRack));
+
+  rack = (MagazineRack *) BUCKET_DATA (bucket);
+  rack->node = node;
+  for (Partition **p = &node->partitions; *p; p = &(*p)->next)
+    {
+      Magazine *magazine = &rack->magazines[(*p)->index];
+      magazine->count = 0;
+      magazine->drains_seen = atomic_load (&(*p)->drain_requests);
+      magazine->cap = MAX_MAGAZINE_BYTES / (*p)->size;
+      if (magazine->cap > MAGAZINE_SIZE)
+        magazine->cap = MAGAZINE_SIZE;
+    }
+
+  tss_set (current_magazine_rack, rack);
+
+  return rack;
+}
+
+// Get the calling thread's magazine for `partition' or NULL if it has none
+static inline Magazine *
+get_magazine (Partition *partition, bool create)
+{
+  MagazineRack *rack = tss_get (current_magazine_rack);
+  Magazine     *magazine;
+  u32           drain_requests;
+
+  if (!rack && create)
+    rack = create_magazine_rack (partition->node);
+  if (!rack || (rack->node != partition->node))
+    return NULL;
+
+  magazine = &rack->magazines[partition->index];
+  if (magazine->cap == 0)
+    return NULL;
+
+  drain_requests = atomic_load_explicit (&partition->drain_requests,
+                                         memory_order_relaxed);
+  if (magazine->drains_seen != drain_requests)
+    {
+      drain_magazine (partition, magazine, magazine->count);
+      magazine->drains_seen = drain_requests;
+    }
+
+  return magazine;
+}
+
+static void *
+take_memory (Node *node, u32 size, bool local)
+{
+  Bucket    *bucket    = NULL;
+  Partition *partition = get_partition_for_size (node, size);
+  Magazine  *magazine  = NULL;
+
+  if (!partition)
+    return NULL;
+
+  magazine = get_magazine (partition, local);
+  if (magazine)
+    {
+      if (magazine->count == 0)
+        refill_magazine (partition, magazine);
+      if (magazine->count > 0)
+        {
+          bucket = magazine->buckets[--magazine->count];
+          atomic_fetch_add_explicit (&partition->num_magazine_hits, 1,
+                                     memory_order_relaxed);
+        }
+    }
+  else
+    {
+      u32 count = 0;
+      bucket = pop_free_buckets (partition, 1, &count);
+    }
+
+  if (bucket)
+    {
+      atomic_fetch_sub_explicit (&partition->num_free, 1,
+                                 memory_order_relaxed);
+      atomic_fetch_add_explicit (&partition->num_reused, 1,
+                                 memory_order_relaxed);
+    }
+  else
+    {
+      // Free-list is empty so we carve new memory
+      bucket = carve_bucket (partition);
+      if (!bucket)
+        {
+          atomic_fetch_add_explicit (&partition->num_failures, 1,
+                                     memory_order_relaxed);
+          return NULL;
+        }
+    }
+
+  atomic_fetch_add_explicit (&partition->num_used, 1, memory_order_relaxed);
+  account_reserved (bucket, size);
+
+  return BUCKET_DATA (bucket);
+}
+
+void *
+reserve_memory (u32 size)
+{
+  u32   local  = get_current_numa_node ();
+  void *memory = take_memory (&nodes[local], size, true);
+
+  // Rather use memory of another node than evict anything
+  for (u32 n = 1; !memory && (n < num_nodes); ++n)
+    memory = take_memory (&nodes[(local + n) % num_nodes], size, false);
+
+  // Take over the bucket of an evicted cache entry if we're out of memory
+  if (!memory)
+    {
+      memory = evict_entry (size);
+      if (memory)
+        {
+          Bucket *bucket = get_bucket (memory);
+          atomic_fetch_add_explicit (&bucket->partition->num_evicted, 1,
+                                     memory_order_relaxed);
+          account_released (bucket);
+          account_reserved (bucket, size);
+        }
+    }
+
+  return memory;
+}
+
+// Give the whole pages between `begin' and `end' back to the OS.  Returns the
+// number of bytes released.
+static size_t
+release_pages (void *begin, void *end)
+{
+  uintptr_t first = (((uintptr_t) begin + SLAB_ALIGNMENT - 1)
+                     & ~((uintptr_t) SLAB_ALIGNMENT - 1));
+  uintptr_t last  = (uintptr_t) end & ~((uintptr_t) SLAB_ALIGNMENT - 1);
+
+  if ((page_release_mode == PAGE_RELEASE_NONE) || (last <= first))
+    return 0;
+
+  if (0 != madvise ((void *) first, last - first,
+                    (page_release_mode == PAGE_RELEASE_FREE)
+                    ? MADV_FREE : MADV_DONTNEED))
+    {
+      wrn_print ("Failed to release pages: %s\n", strerror (errno));
+      return 0;
+    }
+
+  return last - first;
+}
+
+// Release the data pages of a big bucket that's being freed, so a deleted or
+// evicted value doesn't pin its RSS until the bucket is reused.  This has to
+// happen before the bucket is published, since whoever takes it next may
+// already be writing to it.
+static inline void
+release_bucket_pages (Bucket *bucket)
+{
+  size_t size = bucket->partition->size;
+
+  if (size < page_release_threshold)
+    return;
+
+  size = release_pages (BUCKET_DATA (bucket), BUCKET_DATA (bucket) + size);
+  if (size)
+    {
+      atomic_fetch_add_explicit (&num_released_buckets, 1,
+                                 memory_order_relaxed);
+      atomic_fetch_add_explicit (&bucket_bytes_released, size,
+                                 memory_order_relaxed);
+    }
+}
+
+void
+release_memory (void *memory)
+{
+  Partition *partition = NULL;
+  Bucket    *bucket    = NULL;
+  Magazine  *magazine  = NULL;
+
+  cik_assert (memory != NULL);
+
+  bucket    = get_bucket (memory);
+  partition = bucket->partition;
+
+  account_released (bucket);
+  release_bucket_pages (bucket);
+
+  magazine = get_magazine (partition, false);
+  if (magazine)
+    {
+      if (magazine->count == magazine->cap)
+        drain_magazine (partition, magazine, (magazine->cap + 1) / 2);
+      magazine->buckets[magazine->count++] = bucket;
+    }
+  else
+    {
+      push_free_buckets (partition, bucket, bucket);
+    }
+
+  atomic_fetch_add_explicit (&partition->num_free, 1, memory_order_relaxed);
+  atomic_fetch_sub_explicit (&partition->num_used, 1, memory_order_relaxed);
+}
+
+// Release the memory of a cache entry evicted by the rebalancer.  This bypasses
+// the magazines so the bucket is reclaimable right away.
+void
+release_evicted_memory (void *memory)
+{
+  Bucket    *bucket    = get_bucket (memory);
+  Partition *partition = bucket->partition;
+
+  account_released (bucket);
+  release_bucket_pages (bucket);
+  push_free_buckets (partition, bucket, bucket);
+
+  atomic_fetch_add_explicit (&partition->num_evicted, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit (&partition->num_free, 1, memory_order_relaxed);
+  atomic_fetch_sub_explicit (&partition->num_used, 1, memory_order_relaxed);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// SMALL OBJECTS
+//
+// Objects of at most MAX_SMALL_OBJECT_SIZE bytes, like the key elements and
+// nodes of the tag index, would be mostly padding in a bucket.  They get slabs
+// of their own, carved into headerless slots in SMALL_OBJECT_STEP size classes.
+// Those slabs are SMALL_SLABS_PER_SLAB times smaller than regular ones and are
+// packed into regular slabs, so a size class that's barely used doesn't tie up
+// a whole slab.  Small objects skip the magazines and can't be evicted, so once
+// we're out of slabs they fall back to free regular buckets of the smallest
+// classes until the rebalancer hands them a new slab.
+
+static void *
+take_small_memory (Node *node, u32 size)
+{
+  Partition *partition = node->small_partition_table[(size - 1)
+                                                     / SMALL_OBJECT_STEP];
+  Bucket    *slot      = NULL;
+  u32        count     = 0;
+
+  slot = pop_free_buckets (partition, 1, &count);
+  if (slot)
+    {
+      atomic_fetch_sub_explicit (&partition->num_free, 1,
+                                 memory_order_relaxed);
+      atomic_fetch_add_explicit (&partition->num_reused, 1,
+                                 memory_order_relaxed);
+    }
+  else
+    {
+      slot = carve_bucket (partition);
+      if (!slot)
+        {
+          atomic_fetch_add_explicit (&partition->num_failures, 1,
+                                     memory_order_relaxed);
+          return NULL;
+        }
+    }
+
+  atomic_fetch_add_explicit (&partition->num_used, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit (&partition->bytes_requested, size,
+                             memory_order_relaxed);
+
+  return slot;
+}
+
+// Take a free bucket of the smallest size class of `node' that has one, up to
+// MAX_SMALL_FALLBACK_SIZE so a small object never pins a big bucket
+static void *
+take_free_small_bucket (Node *node, u32 size)
+{
+  for (Partition *partition = get_partition_for_size (node, size);
+       partition && (partition->size <= MAX_SMALL_FALLBACK_SIZE);
+       partition = partition->next)
+    {
+      u32 count = 0;
+      Bucket *bucket = pop_free_buckets (partition, 1, &count);
+      if (bucket)
+        {
+          atomic_fetch_sub_explicit (&partition->num_free, 1,
+                                     memory_order_relaxed);
+          atomic_fetch_add_explicit (&partition->num_reused, 1,
+                                     memory_order_relaxed);
+          atomic_fetch_add_explicit (&partition->num_used, 1,
+                                     memory_order_relaxed);
+          account_reserved (bucket, size);
+          return BUCKET_DATA (bucket);
+        }
+    }
+
+  return NULL;
+}
+
+// Reserve `size' bytes from the small object slabs if it's small enough.
+// Memory from here must be released with `release_small_memory'.
+void *
+reserve_small_memory (u32 size)
+{
+  u32   local  = get_current_numa_node ();
+  void *memory = NULL;
+
+  cik_assert (size > 0);
+
+  if (size > MAX_SMALL_OBJECT_SIZE)
+    return reserve_memory (size);
+
+  for (u32 n = 0; !memory && (n < num_nodes); ++n)
+    memory = take_small_memory (&nodes[(local + n) % num_nodes], size);
+
+  // Rather settle for a free small bucket than evict something
+  for (u32 n = 0; !memory && (n < num_nodes); ++n)
+    memory = take_free_small_bucket (&nodes[(local + n) % num_nodes], size);
+
+  if (!memory)
+    memory = reserve_memory (size);
+
+  return memory;
+}
+
+// Release memory from `reserve_small_memory'.  Slots have no header so we go
+// by the partition of the slab they're in.
+void
+release_small_memory (void *memory, u32 size)
+{
+  Partition *partition;
+
+  cik_assert (memory != NULL);
+
+  partition = get_slab (memory)->partition;
+  if (!partition->small)
+    {
+      release_memory (memory);
+      return;
+    }
+
+  cik_assert (partition->size >= size);
+  cik_assert ((partition->size - size) < SMALL_OBJECT_STEP);
+
+  push_free_buckets (partition, memory, memory);
+
+  atomic_fetch_sub_explicit (&partition->bytes_requested, size,
+                             memory_order_relaxed);
+  atomic_fetch_add_explicit (&partition->num_free, 1, memory_order_relaxed);
+  atomic_fetch_sub_explicit (&partition->num_used, 1, memory_order_relaxed);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// REBALANCING
+
+// Take `slab' away from its partition and put it in the free slab pool (or the
+// small object slab pool), but only if none of its buckets are held.
+static bool
+try_reclaim_slab (Slab *slab)
+{
+  Partition *partition = slab->partition;
+  _Atomic (Bucket *) *free_list = &partition->free_buckets;
+  Bucket *head, *prev = NULL, *next;
+  u32 nbuckets = 0;
+
+  cik_assert (slab != atomic_load (&partition->current_slab));
+
+  while (!MARK_POINTER (free_list))
+    thrd_yield ();
+
+  // Buckets are only held by popping them off the free list (which we have now
+  // locked) or by carving them from the current slab (which this isn't).
+  if (atomic_load (&slab->num_held) != 0)
+    {
+      UNMARK_POINTER (free_list);
+      return false;
+    }
+
+  head = READ_POINTER (free_list);
+  for (Bucket *bucket = head; bucket; bucket = next)
+    {
+      next = bucket->next;
+      if (get_slab (bucket) != slab)
+        {
+          prev = bucket;
+          continue;
+        }
+      if (prev)
+        prev->next = next;
+      else
+        head = next;
+      ++nbuckets;
+    }
+
+  WRITE_POINTER (free_list, head);
+
+  cik_assert (nbuckets == ((slab->end - get_slab_begin (slab))
+                           / BUCKET_STRIDE (partition)));
+
+  atomic_fetch_sub (&partition->num_free, nbuckets);
+
+  LOCK_SLABS (&partition->slabs_lock);
+  for (Slab **s = &partition->slabs; *s; s = &(*s)->next)
+    {
+      if (*s == slab)
+        {
+          *s = slab->next;
+          break;
+        }
+    }
+  UNLOCK_SLABS (&partition->slabs_lock);
+
+  atomic_fetch_sub (&partition->num_slabs, 1);
+  atomic_fetch_add (&partition->num_slabs_out, 1);
+
+  if (partition->small)
+    put_free_small_slab (partition->node, slab);
+  else
+    put_free_slab (partition->node, slab);
+
+  return true;
+}
+
+// Reclaim a slab from `partition', evicting cache entries if needed.  We
+// consider the REBALANCE_MAX_VICTIMS slabs with the fewest held buckets and
+// take the first one that is empty or that evicting would leave empty.  Small
+// object slabs only give up slabs that are already empty since they aren't
+// used for cache entries.
+static bool
+reclaim_slab_from (Partition *partition)
+{
+  Slab *current = atomic_load (&partition->current_slab);
+  Slab *victims[REBALANCE_MAX_VICTIMS];
+  u32   held[REBALANCE_MAX_VICTIMS];
+  EvictionTarget targets[REBALANCE_MAX_VICTIMS];
+  u32   nvictims = 0;
+  u32   t;
+
+  // Victims are kept sorted by held buckets, fewest first
+  LOCK_SLABS (&partition->slabs_lock);
+  for (Slab *slab = partition->slabs; slab; slab = slab->next)
+    {
+      u32 num_held = atomic_load (&slab->num_held);
+      u32 i;
+
+      if ((slab == current) || (slab == compaction_slab))
+        continue;
+      if (nvictims < REBALANCE_MAX_VICTIMS)
+        ++nvictims;
+      else if (num_held >= held[nvictims - 1])
+        continue;
+
+      for (i = nvictims - 1; (i > 0) && (held[i - 1] > num_held); --i)
+        {
+          victims[i] = victims[i - 1];
+          held[i] = held[i - 1];
+        }
+      victims[i] = slab;
+      held[i] = num_held;
+    }
+  UNLOCK_SLABS (&partition->slabs_lock);
+
+  for (t = 0; (t < nvictims) && (held[t] == 0); ++t)
+    {
+      if (try_reclaim_slab (victims[t]))
+        return true;
+    }
+
+  if ((nvictims == 0) || partition->small)
+    return false;
+
+  // Buckets in magazines can't be evicted, ask for them back for next time
+  atomic_fetch_add (&partition->drain_requests, 1);
+
+  for (t = 0; t < nvictims; ++t)
+    {
+      targets[t] = (EvictionTarget) {
+        .begin    = victims[t],
+        .end      = get_slab_limit (victims[t]),
+        .num_held = &victims[t]->num_held
+      };
+    }
+
+  t = evict_entries_to_empty (targets, nvictims);
+
+  return (t < nvictims) && try_reclaim_slab (victims[t]);
+}
+
+// Get the size of the slabs `partition' is carved from
+static inline u32
+get_partition_slab_size (Partition *partition)
+{
+  return partition->small ? SMALL_SLAB_SIZE : SLAB_SIZE;
+}
+
+// Give the empty small object slabs of `node' back to its pool.  The slab they
+// are packed into is free again once all of its small object slabs are.
+static void
+reclaim_empty_small_slabs (Node *node)
+{
+  for (Partition *partition = node->small_partitions; partition;
+       partition = partition->next)
+    {
+      while ((((u64) atomic_load (&partition->num_free)
+               * BUCKET_STRIDE (partition)) >= SMALL_SLAB_SIZE)
+             && reclaim_slab_from (partition))
+        ;
+    }
+}
+
+// Move slabs from partitions of `node' with idle memory to the one that failed
+// the most allocations since the last call.
+static void
+rebalance_node (Node *node)
+{
+  Partition *lists[] = { node->small_partitions, node->partitions };
+  Partition *starved = NULL;
+  u32 max_failures = 0;
+  u32 nslabs, nfree;
+
+  for (u32 l = 0; l < (sizeof (lists) / sizeof (lists[0])); ++l)
+    {
+      for (Partition *partition = lists[l]; partition;
+           partition = partition->next)
+        {
+          u32 num_failures = atomic_load (&partition->num_failures);
+          u32 new_failures = num_failures - partition->num_failures_seen;
+          partition->num_failures_seen = num_failures;
+          if (new_failures > max_failures)
+            {
+              starved = partition;
+              max_failures = new_failures;
+            }
+        }
+    }
+
+  if (!starved)
+    return;
+
+  // Every failure could have been a new slab but don't count the ones that are
+  // already up for grabs.
+  nslabs = (max_failures < REBALANCE_MAX_SLABS
+            ? max_failures
+            : REBALANCE_MAX_SLABS);
+
+  // Empty small object slabs come for free but only make up a slab once all
+  // of the slab they're packed into are empty, so we just give them all back
+  if (!starved->small)
+    reclaim_empty_small_slabs (node);
+
+  nfree = atomic_load (&node->num_free_slabs);
+  if (starved->small)
+    nfree = ((nfree * SMALL_SLABS_PER_SLAB)
+             + atomic_load (&node->num_free_small_slabs));
+
+  for (u32 n = nfree; n < nslabs; ++n)
+    {
+      // Small object partitions try empty small object slabs first
+      Partition *donor = NULL;
+      bool moved = false;
+
+      for (u32 l = (starved->small ? 0 : 1);
+           !moved && (l < (sizeof (lists) / sizeof (lists[0]))); ++l)
+        {
+          u64 max_idle = 0;
+
+          donor = NULL;
+          for (Partition *partition = lists[l]; partition;
+               partition = partition->next)
+            {
+              u64 idle = ((u64) atomic_load (&partition->num_free)
+                          * BUCKET_STRIDE (partition));
+              if ((partition != starved)
+                  && (idle >= get_partition_slab_size (partition))
+                  && (idle > max_idle))
+                {
+                  donor = partition;
+                  max_idle = idle;
+                }
+            }
+
+          moved = (donor != NULL) && reclaim_slab_from (donor);
+        }
+
+      if (!moved)
+        break;
+
+      dbg_print ("Moved slab from %u to %u byte buckets on node %u\n",
+                 donor->size, starved->size, node->index);
+
+      if (starved->small && !donor->small)
+        break; // That's SMALL_SLABS_PER_SLAB small object slabs
+    }
+}
+
+// Rebalance the slabs of every node.  Slabs never move between nodes.  Meant
+// to be called periodically from a background thread.
+void
+rebalance_memory ()
+{
+  for (u32 n = 0; n < num_nodes; ++n)
+    rebalance_node (&nodes[n]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// COMPACTION
+//
+// Long running caches end up with partitions whose slabs are all partly used,
+// so the rebalancer can't hand them over without evicting.  The compactor
+// (see compact.c) empties the sparsest slab of such a partition by moving what
+// lives in it to free buckets in other slabs and then gives the slab back to
+// its node.  It runs on the rebalancer thread so they never race for slabs.
+
+static inline u32
+get_slab_bucket_count (Slab *slab)
+{
+  return ((slab->end - get_slab_begin (slab))
+          / BUCKET_STRIDE (slab->partition));
+}
+
+// Add `bucket' of the slab being compacted to the ones we hold on to
+static inline void
+isolate_compaction_bucket (Bucket *bucket)
+{
+  bucket->next = NULL;
+  if (compaction_buckets_tail)
+    compaction_buckets_tail->next = bucket;
+  else
+    compaction_buckets = bucket;
+  compaction_buckets_tail = bucket;
+  ++num_compaction_buckets;
+}
+
+// Take the buckets of the slab being compacted off the free list of its
+// partition so they can't be handed out again.
+static void
+isolate_free_compaction_buckets ()
+{
+  Partition *partition = compaction_slab->partition;
+  _Atomic (Bucket *) *free_list = &partition->free_buckets;
+  Bucket *head, *prev = NULL, *next;
+  u32 count = 0;
+
+  while (!MARK_POINTER (free_list))
+    thrd_yield ();
+
+  head = READ_POINTER (free_list);
+  for (Bucket *bucket = head; bucket; bucket = next)
+    {
+      next = bucket->next;
+      if (get_slab (bucket) != compaction_slab)
+        {
+          prev = bucket;
+          continue;
+        }
+      if (prev)
+        prev->next = next;
+      else
+        head = next;
+      isolate_compaction_bucket (bucket);
+      ++count;
+    }
+
+  atomic_fetch_add (&compaction_slab->num_held, count);
+  WRITE_POINTER (free_list, head);
+
+  atomic_fetch_sub (&partition->num_free, count);
+}
+
+// Release the pages of a free slab (except the one holding its header) to the
+// OS, the way `release_pages' in the config says.
+static void
+release_slab_pages (Slab *slab)
+{
+  atomic_fetch_add (&bytes_released,
+                    release_pages ((u8 *) slab + SLAB_ALIGNMENT,
+                                   (u8 *) slab + SLAB_SIZE));
+}
+
+// Pick the slab to compact and isolate its free buckets.  We go for the
+// partition with the most idle memory and its slab with the fewest held
+// buckets.  Returns false if no partition is worth compacting.
+bool
+begin_compaction ()
+{
+  Partition *partition = NULL;
+  Slab *victim = NULL;
+  u64 max_idle = 0;
+  u32 min_held = (u32) -1;
+
+  cik_assert (compaction_slab == NULL);
+
+  for (u32 n = 0; n < num_nodes; ++n)
+    {
+      for (Partition **p = &nodes[n].partitions; *p; p = &(*p)->next)
+        {
+          u64 idle = ((u64) atomic_load (&(*p)->num_free)
+                      * BUCKET_STRIDE (*p));
+          if (((*p)->size <= COMPACTION_MAX_BUCKET_SIZE)
+              && (idle >= ((u64) COMPACTION_MIN_FREE_SLABS * SLAB_SIZE))
+              && (idle > max_idle))
+            {
+              partition = *p;
+              max_idle = idle;
+            }
+        }
+    }
+
+  if (!partition)
+    return false;
+
+  LOCK_SLABS (&partition->slabs_lock);
+  for (Slab *slab = partition->slabs; slab; slab = slab->next)
+    {
+      u32 num_held = atomic_load (&slab->num_held);
+      if (slab == atomic_load (&partition->current_slab))
+        continue;
+      if (slab->compaction_backoff > 0)
+        {
+          --slab->compaction_backoff;
+          continue;
+        }
+      if (num_held < min_held)
+        {
+          victim = slab;
+          min_held = num_held;
+        }
+    }
+  UNLOCK_SLABS (&partition->slabs_lock);
+
+  if (!victim)
+    return false;
+
+  compaction_slab = victim;
+  compaction_buckets = compaction_buckets_tail = NULL;
+  num_compaction_buckets = 0;
+  isolate_free_compaction_buckets ();
+
+  dbg_print ("Compacting slab %p of %u byte buckets on node %u (%u held)\n",
+             (void *) victim, partition->size, partition->node->index,
+             min_held);
+
+  return true;
+}
+
+// Move `memory' to a free bucket in another slab if it's in the slab being
+// compacted.  The caller must make sure nobody else is using `memory' and fix
+// any pointers into it.  Returns the new location or NULL if it wasn't moved.
+void *
+move_memory (void *memory)
+{
+  Partition *partition;
+  Bucket *bucket, *moved;
+  u32 count = 0;
+
+  if (!compaction_slab
+      || ((u8 *) memory < (u8 *) compaction_slab)
+      || ((u8 *) memory >= ((u8 *) compaction_slab + SLAB_SIZE)))
+    return NULL;
+
+  bucket    = get_bucket (memory);
+  partition = bucket->partition;
+
+  // Bypass magazines, they may still hold buckets of the compacted slab
+  while ((moved = pop_free_buckets (partition, 1, &count)) != NULL)
+    {
+      atomic_fetch_sub_explicit (&partition->num_free, 1,
+                                 memory_order_relaxed);
+      if (get_slab (moved) != compaction_slab)
+        break;
+      isolate_compaction_bucket (moved); // Freed since we started
+    }
+
+  if (moved)
+    {
+      atomic_fetch_add_explicit (&partition->num_reused, 1,
+                                 memory_order_relaxed);
+    }
+  else
+    {
+      moved = carve_bucket (partition);
+      if (!moved)
+        return NULL;
+    }
+
+  cik_assert (get_slab (moved) != compaction_slab);
+
+  // The bucket stays used so only the requested bytes move along with it
+  moved->nrequested = bucket->nrequested;
+  memcpy (BUCKET_DATA (moved), memory, bucket->nrequested);
+
+  atomic_fetch_add (&num_moved_buckets, 1);
+  atomic_fetch_add (&bytes_moved, bucket->nrequested);
+
+  isolate_compaction_bucket (bucket);
+
+  return BUCKET_DATA (moved);
+}
+
+// Give the slab being compacted back to its node if every bucket has been
+// moved out of or freed.  Otherwise keep going, or if `give_up' put its free
+// buckets back and leave the slab alone for a while.  Returns true once the
+// compaction is over either way.
+bool
+try_finish_compaction (bool give_up)
+{
+  Slab *slab = compaction_slab;
+  Partition *partition;
+
+  cik_assert (slab != NULL);
+
+  partition = slab->partition;
+
+  // Buckets freed since we started are on the free list
+  isolate_free_compaction_buckets ();
+
+  if (num_compaction_buckets == get_slab_bucket_count (slab))
+    {
+      cik_assert (atomic_load (&slab->num_held) == num_compaction_buckets);
+
+      // GET requests might still be reading entries we've moved out
+      wait_for_readers ();
+
+      LOCK_SLABS (&partition->slabs_lock);
+      for (Slab **s = &partition->slabs; *s; s = &(*s)->next)
+        {
+          if (*s == slab)
+            {
+              *s = slab->next;
+              break;
+            }
+        }
+      UNLOCK_SLABS (&partition->slabs_lock);
+
+      atomic_fetch_sub (&partition->num_slabs, 1);
+      atomic_store (&slab->num_held, 0);
+
+      release_slab_pages (slab);
+      put_free_slab (partition->node, slab);
+
+      atomic_fetch_add (&num_compacted_slabs, 1);
+      dbg_print ("Compacted slab %p of %u byte buckets on node %u\n",
+                 (void *) slab, partition->size, partition->node->index);
+    }
+  else if (give_up)
+    {
+      // Moved out of buckets count as free again
+      wait_for_readers ();
+      if (compaction_buckets)
+        push_free_buckets (partition, compaction_buckets,
+                           compaction_buckets_tail);
+      atomic_fetch_add (&partition->num_free, num_compaction_buckets);
+
+      slab->compaction_backoff = COMPACTION_BACKOFF;
+
+      atomic_fetch_add (&num_aborted_compactions, 1);
+    }
+  else
+    {
+      return false;
+    }
+
+  compaction_slab = NULL;
+  compaction_buckets = compaction_buckets_tail = NULL;
+  num_compaction_buckets = 0;
+
+  return true;
+}
+
+// Get the bucket size used to store `size' bytes or 0 if it's too big.
+u32
+get_size_class (u32 size)
+{
+  Partition *partition = get_partition_for_size (&nodes[0], size);
+  return partition ? partition->size : 0;
+}
+
+// Get the bucket size of memory returned by `reserve_memory'.
+u32
+get_memory_size_class (void *memory)
+{
+  cik_assert (memory != NULL);
+  return get_bucket (memory)->partition->size;
+}
+
+CacheEntry *
+reserve_and_lock_entry (size_t payload_size)
+{
+  CacheEntry *entry = NULL;
+  size_t total_size = sizeof (CacheEntry) + payload_size;
+
+  entry = reserve_memory (total_size);
+  if (entry == NULL)
+    return NULL;
+
+  *entry = CACHE_ENTRY_INIT;
+  LOCK_ENTRY (entry);
+
+  return entry;
+}
+
+static void
+release_unread_entry (CacheEntry *entry)
+{
+  if (entry->value.chunked)
+    release_value_chunks (entry->value.chunks);
+
+  release_memory (entry);
+}
+
+static void
+release_unread_evicted_entry (CacheEntry *entry)
+{
+  if (entry->value.chunked)
+    {
+      ValueChunks *chunks = entry->value.chunks;
+      cik_assert (atomic_load (&chunks->refs) == 1);
+      for (u32 i = 0; i < chunks->nchunks; ++i)
+        {
+          if (chunks->chunks[i])
+            release_evicted_memory (chunks->chunks[i]);
+        }
+      release_evicted_memory (chunks);
+    }
+
+  release_evicted_memory (entry);
+}
+
+// Release the memory of an entry that's no longer mapped, including its value
+// chunks unless a GET request is still streaming them.
+void
+release_entry (CacheEntry *entry)
+{
+  cik_assert (entry != NULL);
+
+  wait_for_readers (); // GET requests might still be reading it
+  release_unread_entry (entry);
+}
+
+// Like `release_entry' but for entries evicted by the rebalancer.  Evicted
+// entries are never streamed since we only evict chunked values we own alone.
+void
+release_evicted_entry (CacheEntry *entry)
+{
+  cik_assert (entry != NULL);
+
+  wait_for_readers ();
+  release_unread_evicted_entry (entry);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// RETIRING
+//
+// Waiting for readers on every entry adds up when a walk clears thousands of
+// them, so batch callers retire entries instead.  Each thread queues the
+// entries it unmapped and `release_retired_entries' frees the lot after a
+// single wait, once per walked map or request.  A full list is released right
+// away, even from within a walk, so that's one wait per RETIRE_LIST_SIZE
+// entries at most.
+
+typedef struct
+{
+  CacheEntry *entry;
+  bool        evicted;
+} RetiredEntry;
+
+struct _RetireList
+{
+  u32          count;
+  RetiredEntry entries[RETIRE_LIST_SIZE];
+};
+
+static void
+empty_retire_list (RetireList *list)
+{
+  if (list->count == 0)
+    return;
+
+  wait_for_readers (); // GET requests might still be reading them
+
+  for (u32 i = 0; i < list->count; ++i)
+    {
+      if (list->entries[i].evicted)
+        release_unread_evicted_entry (list->entries[i].entry);
+      else
+        release_unread_entry (list->entries[i].entry);
+    }
+
+  list->count = 0;
+}
+
+// Release the entries the calling thread retired since the last call
+void
+release_retired_entries ()
+{
+  RetireList *list = tss_get (current_retire_list);
+
+  if (list)
+    empty_retire_list (list);
+}
+
+static void
+release_retire_list (RetireList *list)
+{
+  empty_retire_list (list);
+  release_memory (list);
+}
+
+static void
+retire (CacheEntry *entry, bool evicted)
+{
+  RetireList *list = tss_get (current_retire_list);
+
+  cik_assert (entry != NULL);
+
+  if (!list)
+    {
+      list = reserve_memory (sizeof (RetireList));
+      if (list)
+        {
+          list->count = 0;
+          tss_set (current_retire_list, list);
+        }
+    }
+
+  if (!list)
+    {
+      // Out of memory, release it the slow way
+      if (evicted)
+        release_evicted_entry (entry);
+      else
+        release_entry (entry);
+      return;
+    }
+
+  if (list->count == RETIRE_LIST_SIZE)
+    empty_retire_list (list);
+
+  list->entries[list->count++] = (RetiredEntry) {
+    .entry   = entry,
+    .evicted = evicted
+  };
+}
+
+// Like `release_entry' but the entry is only released by the next call to
+// `release_retired_entries' on the calling thread.
+void
+retire_entry (CacheEntry *entry)
+{
+  retire (entry, false);
+}
+
+// Like `release_evicted_entry' but see `retire_entry'
+void
+retire_evicted_entry (CacheEntry *entry)
+{
+  retire (entry, true);
+}
+
+// Reserve enough VALUE_CHUNK_SIZE chunks to store `size' bytes.  The last
+// chunk only takes the size class it needs.  The chunks start out with one
+// reference for the entry storing them.
+ValueChunks *
+reserve_value_chunks (u32 size)
+{
+  u32          nchunks = (size + VALUE_CHUNK_SIZE - 1) / VALUE_CHUNK_SIZE;
+  ValueChunks *chunks  = reserve_memory (sizeof (ValueChunks)
+                                         + (nchunks * sizeof (u8 *)));
+
+  if (!chunks)
+    return NULL;
+
+  atomic_init (&chunks->refs, 1);
+  chunks->nchunks = nchunks;
+
+  for (u32 i = 0; i < nchunks; ++i)
+    {
+      chunks->chunks[i] = reserve_memory (get_value_chunk_size (size, i));
+      if (!chunks->chunks[i])
+        {
+          chunks->nchunks = i;
+          release_value_chunks (chunks);
+          return NULL;
+        }
+    }
+
+  return chunks;
+}
+
+// Drop a reference to `chunks' and release them if it was the last one
+void
+release_value_chunks (ValueChunks *chunks)
+{
+  cik_assert (chunks != NULL);
+
+  if (atomic_fetch_sub (&chunks->refs, 1) != 1)
+    return;
+
+  for (u32 i = 0; i < chunks->nchunks; ++i)
+    {
+      if (chunks->chunks[i])
+        release_memory (chunks->chunks[i]);
+    }
+
+  release_memory (chunks);
+}
+
+// Make sure `payload' can hold at least `size' bytes, keeping its contents.
+// Buffers grow geometrically up to MAX_BUCKET_SIZE and always use their whole
+// bucket.  Returns false if `size' is too big or we're out of memory.
+bool
+reserve_payload (Payload *payload, u32 size)
+{
+  u8 *base;
+  u32 cap;
+
+  cik_assert (payload != NULL);
+
+  if (size <= payload->cap)
+    return true;
+
+  if (size > MAX_BUCKET_SIZE)
+    return false;
+
+  cap = (payload->cap > (MAX_BUCKET_SIZE / 2)) ? MAX_BUCKET_SIZE : payload->cap * 2;
+  if (cap < size)
+    cap = size;
+  if (cap < MIN_PAYLOAD_SIZE)
+    cap = MIN_PAYLOAD_SIZE;
+  cap = get_size_class (cap);
+
+  base = reserve_memory (cap);
+  if (base == NULL)
+    return false;
+
+  if (payload->base != NULL)
+    {
+      memcpy (base, payload->base, payload->nmemb);
+      release_memory (payload->base);
+    }
+
+  payload->base = base;
+  payload->cap = cap;
+
+  return true;
+}
+
+// Give the memory of `payload' back, it'll be reserved again when needed
+void
+release_payload (Payload *payload)
+{
+  cik_assert (payload != NULL);
+  cik_assert (payload->chunks == NULL);
+
+  if (payload->base != NULL)
+    release_memory (payload->base);
+
+  payload->base = NULL;
+  payload->nmemb = 0;
+  payload->cap = 0;
+}
+
+// Commits and faults in the next MEMORY_COMMIT_SIZE chunk of the arena so
+// workers don't have to take the page faults later.  Only meant to be called
+// from a single thread.  Returns false once the whole arena is prefaulted.
+bool
+prefault_memory ()
+{
+  uintptr_t start     = atomic_load (&prefault_cursor);
+  uintptr_t arena_end = (uintptr_t) main_memory + total_memory;
+  uintptr_t end       = start + MEMORY_COMMIT_SIZE;
+  bool      populated = false;
+
+  if (start >= arena_end)
+    return false;
+
+  if (end > arena_end)
+    end = arena_end;
+
+  if (!commit_memory (end))
+    return false;
+
+#ifdef MADV_POPULATE_WRITE
+  populated = (0 == madvise ((void *) start, end - start, MADV_POPULATE_WRITE));
+#endif
+
+  if (!populated)
+    {
+      // Write fault every page without changing what might already be there
+      size_t page_size = ((huge_page_mode == HUGE_PAGES_NONE)
+                          ? SLAB_ALIGNMENT : HUGE_PAGE_SIZE);
+      for (uintptr_t page = start; page < end; page += page_size)
+        __atomic_fetch_add ((u8 *) page, 0, __ATOMIC_RELAXED);
+    }
+
+  atomic_store (&prefault_cursor, end);
+
+  return end < arena_end;
+}
+
+// Returns how many bytes of this process are backed by huge pages
+static u64
+get_huge_page_bytes ()
+{
+  char  line[0x100];
+  u64   total = 0;
+  FILE *smaps = fopen ("/proc/self/smaps_rollup", "r");
+
+  if (!smaps)
+    return 0;
+
+  while (fgets (line, sizeof (line), smaps))
+    {
+      unsigned long kb = 0;
+      if ((1 == sscanf (line, "AnonHugePages: %lu kB", &kb))
+          || (1 == sscanf (line, "Private_Hugetlb: %lu kB", &kb)))
+        total += (u64) kb << 10;
+    }
+
+  fclose (smaps);
+
+  return total;
+}
+
+void
+release_all_memory ()
+{
+  if (0 != munmap (main_memory, total_memory))
+    {
+      err_print ("Failed to unmap %zu bytes: %s\n",
+                 total_memory, strerror (errno));
+    }
+}
+
+// Populates `nfo->server_v1' in host byte order
+void
+populate_nfo_response (NFOResponsePayload *nfo)
+{
+  cik_assert (nfo != NULL);
+
+  nfo->server_v1.version        = NFO_VERSION_1;
+  nfo->server_v1.bytes_reserved = total_memory - total_system_size;
+  nfo->server_v1.bytes_used     = 0;
+  nfo->server_v1.bytes_free     = 0;
+  nfo->server_v1.bytes_reused   = 0;
+
+  for (u32 n = 0; n < num_nodes; ++n)
+    {
+      Partition *lists[] = { nodes[n].partitions, nodes[n].small_partitions };
+
+      for (u32 l = 0; l < (sizeof (lists) / sizeof (lists[0])); ++l)
+        {
+          for (Partition *partition = lists[l]; partition;
+               partition = partition->next)
+            {
+              u64 num_used   = atomic_load (&partition->num_used);
+              u64 num_free   = atomic_load (&partition->num_free);
+              u64 num_reused = atomic_load (&partition->num_reused);
+              nfo->server_v1.bytes_used   += partition->size * num_used;
+              nfo->server_v1.bytes_free   += partition->size * num_free;
+              nfo->server_v1.bytes_reused += partition->size * num_reused;
+            }
+        }
+    }
+}
+
+// Get the number of bytes in never used and free slabs of `node'
+static u64
+get_node_memory_left (Node *node)
+{
+  uintptr_t cursor = atomic_load (&node->memory_cursor);
+  return (((uintptr_t) node->memory_end - cursor)
+          + ((u64) atomic_load (&node->num_free_slabs) * SLAB_SIZE));
+}
+
+void
+write_memory_stats (int fd)
+{
+  dprintf (fd, "%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n",
+           "Size", "Used", "Free", "Reused", "Evicted", "MagHits", "Refills",
+           "Drains", "Slabs", "MovedIn", "MovedOut", "Requested", "Allocated",
+           "Available", "Node");
+
+  for (u32 n = 0; n < num_nodes; ++n)
+    {
+      u64 memory_left = get_node_memory_left (&nodes[n]);
+
+      for (Partition **p = &nodes[n].partitions; *p; p = &(*p)->next)
+        {
+          Partition *partition = *p;
+          u32 num_used    = atomic_load (&partition->num_used);
+          u32 num_free    = atomic_load (&partition->num_free);
+          u32 num_reused  = atomic_load (&partition->num_reused);
+          u32 num_evicted = atomic_load (&partition->num_evicted);
+          u32 num_hits    = atomic_load (&partition->num_magazine_hits);
+          u32 num_refills = atomic_load (&partition->num_refills);
+          u32 num_drains  = atomic_load (&partition->num_drains);
+          u32 num_slabs   = atomic_load (&partition->num_slabs);
+          u32 num_in      = atomic_load (&partition->num_slabs_in);
+          u32 num_out     = atomic_load (&partition->num_slabs_out);
+          u64 requested   = atomic_load (&partition->bytes_requested);
+          u64 allocated   = (u64) num_used * BUCKET_STRIDE (partition);
+          dprintf (fd, "%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%lu\t%lu\t%lu\t%u\n",
+                   partition->size, num_used, num_free, num_reused, num_evicted,
+                   num_hits, num_refills, num_drains, num_slabs, num_in, num_out,
+                   requested, allocated, memory_left / partition->size, n);
+        }
+    }
+
+  dprintf (fd, "\n%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n",
+           "SmallSize", "Used", "Free", "Reused", "Failures", "Slabs",
+           "Requested", "Allocated", "Node");
+
+  for (u32 n = 0; n < num_nodes; ++n)
+    {
+      for (Partition *partition = nodes[n].small_partitions; partition;
+           partition = partition->next)
+        {
+          u32 num_used = atomic_load (&partition->num_used);
+          dprintf (fd, "%u\t%u\t%u\t%u\t%u\t%u\t%lu\t%lu\t%u\n",
+                   partition->size, num_used,
+                   atomic_load (&partition->num_free),
+                   atomic_load (&partition->num_reused),
+                   atomic_load (&partition->num_failures),
+                   atomic_load (&partition->num_slabs),
+                   atomic_load (&partition->bytes_requested),
+                   (u64) num_used * partition->size, n);
+        }
+    }
+
+  dprintf (fd, "\n%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n",
+           "Node", "NodeId", "Memory", "Allocated", "SmallAllocated",
+           "FreeSlabs", "FreeSmallSlabs", "Available");
+
+  for (u32 n = 0; n < num_nodes; ++n)
+    {
+      Node *node = &nodes[n];
+      u64 allocated = 0, small_allocated = 0;
+
+      for (Partition **p = &node->partitions; *p; p = &(*p)->next)
+        allocated += ((u64) atomic_load (&(*p)->num_used)
+                      * BUCKET_STRIDE (*p));
+      for (Partition **p = &node->small_partitions; *p; p = &(*p)->next)
+        small_allocated += ((u64) atomic_load (&(*p)->num_used)
+                            * BUCKET_STRIDE (*p));
+
+      dprintf (fd, "%u\t%u\t%lu\t%lu\t%lu\t%u\t%u\t%lu\n", n,
+               get_numa_node_id (n), (u64) (node->memory_end - node->memory),
+               allocated, small_allocated, atomic_load (&node->num_free_slabs),
+               atomic_load (&node->num_free_small_slabs),
+               get_node_memory_left (node));
+    }
+
+  dprintf (fd, "\n%s\t%s\t%s\t%s\t%s\n",
+           "Compacted", "Aborted", "MovedBuckets", "MovedBytes",
+           "ReleasedBytes");
+  dprintf (fd, "%lu\t%lu\t%lu\t%lu\t%lu\n",
+           atomic_load (&num_compacted_slabs),
+           atomic_load (&num_aborted_compactions),
+           atomic_load (&num_moved_buckets), atomic_load (&bytes_moved),
+           atomic_load (&bytes_released));
+
+  dprintf (fd, "\n%s\t%s\t%s\t%s\n",
+           "PageRelease", "ReleaseAbove", "ReleasedBuckets",
+           "ReleasedBucketBytes");
+  dprintf (fd, "%s\t%zu\t%lu\t%lu\n",
+           page_release_mode_names[page_release_mode], page_release_threshold,
+           atomic_load (&num_released_buckets),
+           atomic_load (&bucket_bytes_released));
+
+  dprintf (fd, "\n%s\t%s\t%s\t%s\t%s\n",
+           "Limit", "Committed", "Prefaulted", "HugePages", "HugePageBytes");
+  dprintf (fd, "%zu\t%lu\t%lu\t%s\t%lu\n", total_memory,
+           (u64) (__atomic_load_n (&committed_memory_end, __ATOMIC_ACQUIRE)
+                  - (uintptr_t) main_memory),
+           (u64) (atomic_load (&prefault_cursor) - (uintptr_t) main_memory),
+           huge_page_mode_names[huge_page_mode], get_huge_page_bytes ());
+
+  dprintf (fd, "\n");
+  write_cache_entry_map_stats (fd);
+  write_epoch_stats (fd);
+  write_expiry_stats (fd);
+  write_admission_stats (fd);
 }
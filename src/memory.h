@@ -5,13 +5,41 @@
 
 CacheEntryHashMap **entry_maps;
 
-int         init_memory                         (void);
+int         init_memory                         (const RuntimeConfig *);
 void       *reserve_memory                      (u32);
 void        release_memory                      (void *);
+void        release_evicted_memory              (void *);
+void       *reserve_small_memory                (u32);
+void        release_small_memory                (void *, u32);
+void        rebalance_memory                    (void);
+bool        begin_compaction                    (void);
+void       *move_memory                         (void *);
+bool        try_finish_compaction               (bool);
+bool        prefault_memory                     (void);
+u32         get_size_class                      (u32);
+u32         get_memory_size_class               (void *);
 CacheEntry *reserve_and_lock_entry              (size_t);
-bool        reserve_biggest_possible_payload    (Payload *);
+void        release_entry                       (CacheEntry *);
+void        release_evicted_entry               (CacheEntry *);
+void        retire_entry                        (CacheEntry *);
+void        retire_evicted_entry                (CacheEntry *);
+void        release_retired_entries             (void);
+ValueChunks *reserve_value_chunks               (u32);
+void        release_value_chunks                (ValueChunks *);
+bool        reserve_payload                     (Payload *, u32);
+void        release_payload                     (Payload *);
 void        release_all_memory                  (void);
 void        populate_nfo_response               (NFOResponsePayload *);
 void        write_memory_stats                  (int);
 
+// Get the number of bytes in chunk `i' of a chunked `nmemb' byte value
+static inline u32
+get_value_chunk_size (u32 nmemb, u32 i)
+{
+  u32 offset = i * VALUE_CHUNK_SIZE;
+  return ((nmemb - offset) < VALUE_CHUNK_SIZE
+          ? (nmemb - offset)
+          : VALUE_CHUNK_SIZE);
+}
+
 #endif /* ! MEMORY_H */
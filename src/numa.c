@@ -0,0 +1,187 @@
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+
+#include "numa.h"
+#include "log.h"
+
+// Nodes are numbered 0 .. `num_nodes' - 1 here which need not match the node
+// ids of the kernel (there can be gaps, and nodes without CPUs are skipped).
+static u32       num_nodes = 1;
+static u32       node_ids[MAX_NUMA_NODES] = {};
+static cpu_set_t node_cpus[MAX_NUMA_NODES];
+static u8        cpu_nodes[MAX_NUM_CPUS] = {};
+
+// Parse a sysfs cpu list like "0-3,8-11" into `cpus'.  Returns the CPU count.
+static u32
+parse_cpu_list (const char *list, cpu_set_t *cpus)
+{
+  u32 count = 0;
+
+  CPU_ZERO (cpus);
+
+  while (*list && *list != '\n')
+    {
+      char *end;
+      unsigned long first = strtoul (list, &end, 10);
+      unsigned long last  = first;
+
+      if (end == list)
+        break;
+
+      if (*end == '-')
+        {
+          list = end + 1;
+          last = strtoul (list, &end, 10);
+        }
+
+      for (unsigned long cpu = first; cpu <= last && cpu < MAX_NUM_CPUS; ++cpu)
+        {
+          CPU_SET (cpu, cpus);
+          ++count;
+        }
+
+      list = (*end == ',') ? end + 1 : end;
+    }
+
+  return count;
+}
+
+int
+init_numa (bool enabled)
+{
+  num_nodes = 1;
+  node_ids[0] = 0;
+  CPU_ZERO (&node_cpus[0]);
+  memset (cpu_nodes, 0, sizeof (cpu_nodes));
+
+  if (!enabled)
+    return 0;
+
+  num_nodes = 0;
+  for (u32 id = 0; id < (8 * sizeof (unsigned long)); ++id)
+    {
+      char  filename[0x80];
+      char      list[0x400];
+      cpu_set_t cpus;
+      FILE     *file;
+      u32       ncpus = 0;
+
+      snprintf (filename, sizeof (filename),
+                "/sys/devices/system/node/node%u/cpulist", id);
+      file = fopen (filename, "r");
+      if (!file)
+        continue;
+
+      if (fgets (list, sizeof (list), file))
+        ncpus = parse_cpu_list (list, &cpus);
+      fclose (file);
+
+      if (ncpus == 0)
+        continue; // Memory only node, no workers to place there
+
+      if (num_nodes == MAX_NUMA_NODES)
+        {
+          wrn_print ("Ignoring NUMA node %u (max: %u)\n", id, MAX_NUMA_NODES);
+          continue;
+        }
+
+      node_cpus[num_nodes] = cpus;
+      for (u32 cpu = 0; cpu < MAX_NUM_CPUS; ++cpu)
+        {
+          if (CPU_ISSET (cpu, &cpus))
+            cpu_nodes[cpu] = num_nodes;
+        }
+
+      node_ids[num_nodes++] = id;
+    }
+
+  if (num_nodes == 0)
+    {
+      wrn_print ("No NUMA nodes found, %s\n", "running as a single node");
+      num_nodes = 1;
+      CPU_ZERO (&node_cpus[0]);
+    }
+
+  nfo_print ("Using %u NUMA node(s)\n", num_nodes);
+
+  return 0;
+}
+
+u32
+get_num_numa_nodes ()
+{
+  return num_nodes;
+}
+
+// Get the node of the CPU the calling thread is running on
+u32
+get_current_numa_node ()
+{
+  int cpu;
+
+  if (num_nodes == 1)
+    return 0;
+
+  cpu = sched_getcpu ();
+  if ((cpu < 0) || (cpu >= MAX_NUM_CPUS))
+    return 0;
+
+  return cpu_nodes[cpu];
+}
+
+// Get the kernel id of `node'
+u32
+get_numa_node_id (u32 node)
+{
+  cik_assert (node < num_nodes);
+  return node_ids[node];
+}
+
+// Restrict the calling thread to the CPUs of `node'
+bool
+bind_thread_to_numa_node (u32 node)
+{
+  cik_assert (node < num_nodes);
+
+  if (num_nodes == 1)
+    return true;
+
+  if (0 != sched_setaffinity (0, sizeof (node_cpus[node]), &node_cpus[node]))
+    {
+      err_print ("Could not bind thread to NUMA node %u: %s\n",
+                 node_ids[node], strerror (errno));
+      return false;
+    }
+
+  return true;
+}
+
+// Make pages in `base' .. `base + size' prefer memory of `node' when faulted.
+bool
+bind_memory_to_numa_node (void *base, size_t size, u32 node)
+{
+  unsigned long mask;
+
+  cik_assert (node < num_nodes);
+
+  if (num_nodes == 1)
+    return true;
+
+  mask = 1UL << node_ids[node];
+  if (0 != syscall (SYS_mbind, base, size, MPOL_PREFERRED, &mask,
+                    8 * sizeof (mask), 0))
+    {
+      err_print ("Could not bind %zu bytes to NUMA node %u: %s\n",
+                 size, node_ids[node], strerror (errno));
+      return false;
+    }
+
+  return true;
+}
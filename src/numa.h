@@ -0,0 +1,13 @@
+#ifndef NUMA_H
+#define NUMA_H 1
+
+#include "types.h"
+
+int  init_numa                (bool);
+u32  get_num_numa_nodes       (void);
+u32  get_current_numa_node    (void);
+u32  get_numa_node_id         (u32);
+bool bind_thread_to_numa_node (u32);
+bool bind_memory_to_numa_node (void *, size_t, u32);
+
+#endif /* ! NUMA_H */
@@ -5,14 +5,18 @@
 #include <unistd.h>
 
 #include "controller.h"
+#include "lock.h"
 #include "log.h"
 #include "memory.h"
+#include "numa.h"
 #include "profiler.h"
 #include "server.h"
+#include "walk.h"
 
 static Server server = {};
 static Client clients[MAX_NUM_CLIENTS] = {};
 static Worker workers[NUM_WORKERS] = {};
+static _Atomic (u32) num_node_clients[MAX_NUMA_NODES] = {};
 
 static int run_worker        (Worker *);
 static int run_accept_thread (Server *);
@@ -72,7 +76,7 @@ start_server (in_addr_t listen_address, in_port_t listen_port)
     {
       Worker *worker = &workers[id];
       worker->id = id;
-      reserve_biggest_possible_payload (&worker->payload_buffer);
+      worker->node = id % get_num_numa_nodes ();
       worker->log_queue = LOG_QUEUE_INIT;
       if (thrd_create (&worker->thread, (thrd_start_t) run_worker, worker)
           != thrd_success)
@@ -91,13 +95,48 @@ start_server (in_addr_t listen_address, in_port_t listen_port)
   return 0;
 }
 
+// Pick a worker for a new connection from `addr'.  Workers are spread over
+// NUMA nodes round robin and the memory a worker reserves comes from its own
+// node.  We can't know which data a connection will read but clients mostly
+// read back what they wrote themselves, so each client address sticks to one
+// node unless that node is serving more than its share of connections.
+static Worker *
+pick_worker (const sockaddr_in_t *addr)
+{
+  static u32 next_worker[MAX_NUMA_NODES] = {};
+
+  u32 num_nodes = get_num_numa_nodes ();
+  u32 node = 0;
+  u32 num_workers;
+
+  if (num_nodes > 1)
+    {
+      u32 total = 0;
+      u32 least = 0;
+
+      for (u32 n = 0; n < num_nodes; ++n)
+        {
+          u32 count = atomic_load (&num_node_clients[n]);
+          total += count;
+          if (count < atomic_load (&num_node_clients[least]))
+            least = n;
+        }
+
+      node = ntohl (addr->sin_addr.s_addr) % num_nodes;
+      if (atomic_load (&num_node_clients[node]) > ((total / num_nodes) + 1))
+        node = least;
+    }
+
+  // Workers `node', `node + num_nodes', `node + 2 * num_nodes' and so on
+  num_workers = (NUM_WORKERS - node + num_nodes - 1) / num_nodes;
+  return &workers[node + (num_nodes * (next_worker[node]++ % num_workers))];
+}
+
 static int
 wait_for_new_connection (Server *server)
 {
   PROFILE (PROF_SERVER_ACCEPT);
 
-  static u32 worker_id = 0;
-
   Client *client = NULL;
   epoll_event_t event = {};
   int nevents;
@@ -144,7 +183,8 @@ wait_for_new_connection (Server *server)
 
   memset (&client->counters, 0, sizeof (client->counters));
 
-  client->worker = &workers[worker_id];
+  client->worker = pick_worker (&client->addr);
+  atomic_fetch_add (&num_node_clients[client->worker->node], 1);
 
   event = (epoll_event_t) {};
   event.events = EPOLLIN | EPOLLERR | EPOLLHUP;
@@ -155,8 +195,6 @@ wait_for_new_connection (Server *server)
       return errno;
     }
 
-  worker_id = (worker_id + 1) % NUM_WORKERS; // Round robin
-
   return 0;
 }
 
@@ -187,7 +225,8 @@ load_request_log (int fd)
   atomic_init (&client.fd, fd);
   client.worker = &worker;
   worker.id = (u32) -1;
-  reserve_biggest_possible_payload (&worker.payload_buffer);
+  worker.node = get_current_numa_node ();
+  worker.payload_buffer = (Payload) {};
   worker.log_queue = LOG_QUEUE_INIT;
 
   while (0 != read (fd, &request, sizeof (request)))
@@ -198,7 +237,37 @@ load_request_log (int fd)
       (void) status; // #if ! DEBUG
     }
 
-  release_memory (worker.payload_buffer.base);
+  release_payload (&worker.payload_buffer);
+}
+
+// Drop our reference to the value chunks of `payload' if it has any
+static inline void
+release_payload_chunks (Payload *payload)
+{
+  if (payload && payload->chunks)
+    {
+      release_value_chunks (payload->chunks);
+      payload->chunks = NULL;
+    }
+}
+
+// Write `payload' to `client', streaming it chunk by chunk if it's chunked
+static StatusCode
+write_payload (Client *client, Payload *payload)
+{
+  ValueChunks *chunks = payload->chunks;
+  StatusCode   status = STATUS_OK;
+
+  if (!chunks)
+    return write_response_payload (client, payload->base, payload->nmemb);
+
+  for (u32 i = 0; (i < chunks->nchunks) && (status == STATUS_OK); ++i)
+    status = write_response_payload (client, chunks->chunks[i],
+                                     get_value_chunk_size (payload->nmemb, i));
+
+  release_payload_chunks (payload);
+
+  return status;
 }
 
 static int
@@ -268,6 +337,8 @@ process_worker_events (Worker *worker)
               cik_assert (status == STATUS_OK);
               u32 size = (payload == NULL) ? 0 : payload->nmemb;
               response = MAKE_SUCCESS_RESPONSE (size);
+              if ((payload != NULL) && payload->compressed)
+                response.status = COMPRESSED_BYTE;
             }
 
           errno = 0;
@@ -276,13 +347,14 @@ process_worker_events (Worker *worker)
             {
               err_print ("(FD %d) %s [%s]\n", client->fd,
                          get_status_code_name (status), strerror (errno));
+              release_payload_chunks (payload);
               close_client (client);
               continue;
             }
 
           if ((payload != NULL) && (payload->nmemb > 0))
             {
-              status = write_response_payload (client, payload->base, payload->nmemb);
+              status = write_payload (client, payload);
               if (status & MASK_INTERNAL_ERROR)
                 {
                   err_print ("(FD %d) %s [%s]\n", client->fd,
@@ -296,12 +368,23 @@ process_worker_events (Worker *worker)
         }
     }
 
+  // Don't pin big response buffers between requests and let idle workers give
+  // theirs back entirely so the memory can go to cache entries instead
+  if ((nevents == 0)
+      || (worker->payload_buffer.cap > MAX_IDLE_PAYLOAD_SIZE))
+    release_payload (&worker->payload_buffer);
+
   return nevents;
 }
 
 static int
 run_worker (Worker *worker)
 {
+  // Bind first so the payload buffer comes from memory local to the worker.
+  // The buffer itself is reserved lazily by the requests that need it.
+  bind_thread_to_numa_node (worker->node);
+  worker->payload_buffer = (Payload) {};
+
   worker->epfd = epoll_create (MAX_NUM_CLIENTS); // Size is actually ignored here
   if (worker->epfd < 0)
     {
@@ -313,8 +396,7 @@ run_worker (Worker *worker)
     process_worker_events (worker);
 
   close (worker->epfd);
-  release_memory (worker->payload_buffer.base);
-  worker->payload_buffer = (Payload) {};
+  release_payload (&worker->payload_buffer);
 
   return thrd_success;
 }
@@ -371,6 +453,25 @@ read_request_payload (Client *client, u8 *base, u32 nmemb)
   return STATUS_OK;
 }
 
+// Read and throw away `nmemb' bytes of a request we can't serve, so they're
+// not taken for the next request
+StatusCode
+skip_request_payload (Client *client, u32 nmemb)
+{
+  u8 buffer[0x1000];
+
+  while (nmemb > 0)
+    {
+      u32 size = (nmemb < sizeof (buffer)) ? nmemb : sizeof (buffer);
+      StatusCode status = read_request_payload (client, buffer, size);
+      if (status != STATUS_OK)
+        return status;
+      nmemb -= size;
+    }
+
+  return STATUS_OK;
+}
+
 StatusCode
 write_response (Client *client, Response *response)
 {
@@ -412,6 +513,8 @@ close_client (Client *client)
     return;
   close (client->fd);
   atomic_store (&client->fd, -1);
+  if (client->worker)
+    atomic_fetch_sub (&num_node_clients[client->worker->node], 1);
   client->worker = NULL;
 }
 
@@ -484,9 +587,12 @@ write_workers_stats (int fd)
 {
   float to_ms = 1000.f / get_performance_frequency ();
 
-  dprintf (fd, "%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n",
-           "GET(n)", "GET(t)", "SET(n)", "SET(t)", "DEL(n)", "DEL(t)",
-           "CLR(n)", "CLR(t)", "LST(n)", "LST(t)", "NFO(n)", "NFO(t)");
+  dprintf (fd, "%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t"
+           "%s\t%s\t%s\t%s\t%s\n",
+           "GET(n)", "GET(t)", "GET(unlocked)", "SET(n)", "SET(t)",
+           "DEL(n)", "DEL(t)", "CLR(n)", "CLR(t)", "LST(n)", "LST(t)",
+           "NFO(n)", "NFO(t)",
+           "ZIP(n)", "ZIP(t)", "ZIP(ratio)", "UNZIP(n)", "UNZIP(t)");
 
   for (u32 i = 0; i < NUM_WORKERS; ++i)
     {
@@ -496,7 +602,8 @@ write_workers_stats (int fd)
 
       seconds = to_ms * worker->timers.get;
       seconds_avg = worker->counters.get ? (seconds / worker->counters.get) : 0.f;
-      dprintf (fd, "%u\t%.3f\t", worker->counters.get, seconds_avg);
+      dprintf (fd, "%u\t%.3f\t%u\t", worker->counters.get, seconds_avg,
+               worker->counters.get_unlocked);
 
       seconds = to_ms * worker->timers.set;
       seconds_avg = worker->counters.set ? (seconds / worker->counters.set) : 0.f;
@@ -516,8 +623,22 @@ write_workers_stats (int fd)
 
       seconds = to_ms * worker->timers.nfo;
       seconds_avg = worker->counters.nfo ? (seconds / worker->counters.nfo) : 0.f;
-      dprintf (fd, "%u\t%.3f", worker->counters.nfo, seconds_avg);
+      dprintf (fd, "%u\t%.3f\t", worker->counters.nfo, seconds_avg);
+
+      seconds = to_ms * worker->timers.compress;
+      seconds_avg = worker->counters.compress ? (seconds / worker->counters.compress) : 0.f;
+      dprintf (fd, "%u\t%.3f\t%.2f\t", worker->counters.compress, seconds_avg,
+               worker->compression.stored
+               ? ((float) worker->compression.raw / worker->compression.stored)
+               : 0.f);
+
+      seconds = to_ms * worker->timers.decompress;
+      seconds_avg = worker->counters.decompress ? (seconds / worker->counters.decompress) : 0.f;
+      dprintf (fd, "%u\t%.3f", worker->counters.decompress, seconds_avg);
 
       dprintf (fd, "\n");
     }
+
+  write_lock_stats (fd);
+  write_walk_stats (fd);
 }
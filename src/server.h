@@ -8,6 +8,7 @@ void stop_server         (void);
 
 StatusCode read_request           (Client *, Request *);
 StatusCode read_request_payload   (Client *, u8 *, u32);
+StatusCode skip_request_payload   (Client *, u32);
 StatusCode write_response         (Client *, Response *);
 StatusCode write_response_payload (Client *, u8 *, u32);
 void       close_client           (Client *);
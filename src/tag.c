@@ -1,17 +1,15 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "lock.h"
 #include "log.h"
 #include "memory.h"
 #include "tag.h"
 #include "util.h"
 
-#define LOCK_KEYS(t) \
-  do {} while (atomic_flag_test_and_set_explicit (&(t)->keys_lock, memory_order_acquire))
-#define UNLOCK_KEYS(t) \
-  atomic_flag_clear_explicit (&(t)->keys_lock, memory_order_release)
-#define TRY_LOCK_KEYS(t) \
-  (!atomic_flag_test_and_set_explicit (&(t)->keys_lock, memory_order_acquire))
+#define LOCK_KEYS(t)     acquire_lock (&(t)->keys_lock, LOCK_CLASS_KEYS)
+#define UNLOCK_KEYS(t)   release_lock (&(t)->keys_lock)
+#define TRY_LOCK_KEYS(t) try_acquire_lock (&(t)->keys_lock)
 
 #define LOCK_KEYS_AND_LOG_SPIN(t)                                       \
   do {                                                                  \
@@ -31,7 +29,7 @@ static TagNode root = {
   .tag.base  = root_value,
   .tag.nmemb = sizeof (root_value),
   .keys      = NULL,
-  .keys_lock = ATOMIC_FLAG_INIT,
+  .keys_lock = ATOMIC_VAR_INIT (LOCK_INIT),
   .num_keys  = ATOMIC_VAR_INIT (0),
   .left      = ATOMIC_VAR_INIT (NULL),
   .right     = ATOMIC_VAR_INIT (NULL)
@@ -40,23 +38,28 @@ static TagNode root = {
 static bool
 keys_are_equal (CacheKey a, CacheKey b)
 {
-  if (a.nmemb != b.nmemb)
+  if ((a.hash != b.hash) || (a.nmemb != b.nmemb))
     return false;
   if (a.base == b.base)
     return true;
   return (0 == memcmp (a.base, b.base, a.nmemb)) ? true : false;
 }
 
+// Key elements and tag nodes are small so they go in small object slabs
+#define KEY_ELEM_SIZE(n) (sizeof (KeyElem) + (sizeof (u8) * (n)))
+#define TAG_NODE_SIZE(n) (sizeof (TagNode) + (sizeof (u8) * (n)))
+
 static KeyElem *
 create_key_elem (CacheKey key)
 {
   KeyElem *elem;
-  elem = reserve_memory (sizeof (KeyElem) + (sizeof (u8) * key.nmemb));
+  elem = reserve_small_memory (KEY_ELEM_SIZE (key.nmemb));
   if (elem)
     {
       *elem = (KeyElem) {};
       elem->key.base = (u8 *) (elem + 1);
       elem->key.nmemb = key.nmemb;
+      elem->key.hash = key.hash;
       memcpy (elem->key.base, key.base, key.nmemb);
       elem->next = NULL;
     }
@@ -67,14 +70,14 @@ static TagNode *
 create_tag_node (CacheTag tag)
 {
   TagNode *node;
-  node = reserve_memory (sizeof (TagNode) + (sizeof (u8) * tag.nmemb));
+  node = reserve_small_memory (TAG_NODE_SIZE (tag.nmemb));
   cik_assert (node != NULL); // @Incomplete: Bubble out-of-memory status
   *node = (TagNode) {};
   node->tag.base = (u8 *) (node + 1);
   node->tag.nmemb = tag.nmemb;
   memcpy (node->tag.base, tag.base, tag.nmemb);
   node->keys = NULL;
-  node->keys_lock = (atomic_flag) ATOMIC_FLAG_INIT;
+  atomic_init (&node->keys_lock, LOCK_INIT);
   atomic_init (&node->num_keys, 0);
   atomic_init (&node->left, NULL);
   atomic_init (&node->right, NULL);
@@ -144,7 +147,7 @@ get_or_create_node (CacheTag tag)
               if (!atomic_compare_exchange_strong (&parent->left, &expected, left))
                 {
                   // We lost a race, release node
-                  release_memory (left);
+                  release_small_memory (left, TAG_NODE_SIZE (tag.nmemb));
                   left = TAG_NODE_LEFT (parent);
                   dbg_print ("Race to add tag: %.*s\n", tag.nmemb, tag.base);
                   cik_assert (left != NULL);
@@ -162,7 +165,7 @@ get_or_create_node (CacheTag tag)
               if (!atomic_compare_exchange_strong (&parent->right, &expected, right))
                 {
                   // We lost a race, release node
-                  release_memory (right);
+                  release_small_memory (right, TAG_NODE_SIZE (tag.nmemb));
                   right = TAG_NODE_RIGHT (parent);
                   dbg_print ("Race to add tag: %.*s\n", tag.nmemb, tag.base);
                   cik_assert (right != NULL);
@@ -209,6 +212,12 @@ copy_key_list (KeyElem *list)
        elem = &(*elem)->next, copy = &(*copy)->next)
     {
       *copy = create_key_elem ((*elem)->key);
+      if (*copy == NULL)
+        {
+          // @Incomplete: Bubble out-of-memory status
+          err_print ("Out of memory copying \"%s\"\n", key2str ((*elem)->key));
+          break;
+        }
     }
   return new_list;
 }
@@ -244,32 +253,86 @@ add_key_to_tag (CacheTag tag, CacheKey key)
   UNLOCK_KEYS (node);
 }
 
-void
-remove_key_from_tag (CacheTag tag, CacheKey key)
+// Caller must hold the key lock of `node'
+static void
+unlink_key (TagNode *node, CacheKey key)
 {
-  TagNode *node = get_tag_if_exists (tag);
-  if (node == NULL)
-    return;
-
-  LOCK_KEYS_AND_LOG_SPIN (node);
-
   for (KeyElem **elem = &node->keys; *elem; elem = &(*elem)->next)
     {
       if (keys_are_equal ((*elem)->key, key))
         {
           KeyElem *found = *elem;
           *elem = found->next;
-          release_memory (found);
+          release_small_memory (found, KEY_ELEM_SIZE (found->key.nmemb));
           atomic_fetch_sub_explicit (&node->num_keys, 1, memory_order_relaxed);
           break; // We assume there are no dupes (`insert_if_unique').
         }
     }
+}
+
+void
+remove_key_from_tag (CacheTag tag, CacheKey key)
+{
+  TagNode *node = get_tag_if_exists (tag);
+  if (node == NULL)
+    return;
 
+  LOCK_KEYS_AND_LOG_SPIN (node);
+  unlink_key (node, key);
   UNLOCK_KEYS (node);
 }
 
-void
-walk_all_tags (CacheTagWalkCb callback, void *user_data)
+// Remove `key' from all `tags' but only if every tag key list can be locked
+// without waiting.  Returns false, leaving all tags untouched, if one of them
+// is busy.  This lets us unlink keys from contexts that may already hold tag
+// locks (see `evict_entry').
+bool
+try_remove_key_from_tags (CacheTag *tags, u8 ntags, CacheKey key)
+{
+  if (ntags == 0)
+    return true;
+
+  TagNode *nodes[ntags];
+  u8 nnodes = 0;
+  bool locked = true;
+
+  for (u8 t = 0; locked && (t < ntags); ++t)
+    {
+      TagNode *node = get_tag_if_exists (tags[t]);
+      bool is_duplicate = false;
+
+      if (node == NULL)
+        continue;
+
+      for (u8 n = 0; n < nnodes; ++n)
+        is_duplicate |= (nodes[n] == node);
+
+      if (is_duplicate)
+        continue;
+
+      if (TRY_LOCK_KEYS (node))
+        nodes[nnodes++] = node;
+      else
+        locked = false;
+    }
+
+  for (u8 n = 0; n < nnodes; ++n)
+    {
+      TagNode *node = nodes[n];
+
+      if (locked)
+        unlink_key (node, key);
+      UNLOCK_KEYS (node);
+    }
+
+  return locked;
+}
+
+typedef void (*TagNodeWalkCb) (TagNode *, void *);
+
+// Visit every tag node in order, without locking them
+static void
+walk_tag_nodes (TagNodeWalkCb callback, void *user_data)
 {
   struct TagElem {
     TagNode *node;
@@ -287,7 +350,7 @@ walk_all_tags (CacheTagWalkCb callback, void *user_data)
 
       while (current != NULL)
         {
-          tmp = reserve_memory (sizeof (struct TagElem));
+          tmp = reserve_small_memory (sizeof (struct TagElem));
           cik_assert (tmp != NULL);
           tmp->node = current;
           tmp->next = stack;
@@ -299,25 +362,80 @@ walk_all_tags (CacheTagWalkCb callback, void *user_data)
       current = stack->node;
       tmp = stack;
       stack = tmp->next;
-      release_memory (tmp);
+      release_small_memory (tmp, sizeof (struct TagElem));
 
-      LOCK_KEYS_AND_LOG_SPIN (current);
-      bool has_keys = (current->keys != NULL);
-      UNLOCK_KEYS (current);
-      if (has_keys)
-        callback (current->tag, user_data);
+      callback (current, user_data);
 
       current = TAG_NODE_RIGHT (current);
     }
 }
 
+struct _WalkAllTagsCallbackData
+{
+  CacheTagWalkCb callback;
+  void          *user_data;
+};
+
+static void
+walk_all_tags_callback (TagNode *node, struct _WalkAllTagsCallbackData *data)
+{
+  LOCK_KEYS_AND_LOG_SPIN (node);
+  bool has_keys = (node->keys != NULL);
+  UNLOCK_KEYS (node);
+  if (has_keys)
+    data->callback (node->tag, data->user_data);
+}
+
+void
+walk_all_tags (CacheTagWalkCb callback, void *user_data)
+{
+  struct _WalkAllTagsCallbackData data = {
+    .callback  = callback,
+    .user_data = user_data
+  };
+
+  cik_assert (callback);
+
+  walk_tag_nodes ((TagNodeWalkCb) walk_all_tags_callback, &data);
+}
+
+static void
+move_keys_callback (TagNode *node, void *unused)
+{
+  (void) unused;
+
+  if (!TRY_LOCK_KEYS (node))
+    return; // Busy, we'll get it on the next pass
+
+  for (KeyElem **elem = &node->keys; *elem; elem = &(*elem)->next)
+    {
+      KeyElem *moved = move_memory (*elem);
+      if (moved)
+        {
+          moved->key.base = (u8 *) (moved + 1);
+          *elem = moved;
+        }
+    }
+
+  UNLOCK_KEYS (node);
+}
+
+// Move the key elements of every tag that isn't busy out of the slab being
+// compacted (see `move_memory').  Tag nodes themselves are read without locks
+// so they stay where they are.
+void
+try_move_tag_keys ()
+{
+  walk_tag_nodes (move_keys_callback, NULL);
+}
+
 void
 release_key_list (KeyElem *elem)
 {
   while (elem)
     {
       KeyElem *next = elem->next;
-      release_memory (elem);
+      release_small_memory (elem, KEY_ELEM_SIZE (elem->key.nmemb));
       elem = next;
     }
 }
@@ -388,7 +506,8 @@ get_keys_matching_all_tags (CacheTag *tags, u8 ntags)
             {
               KeyElem *not_found = *found_key;
               *found_key = not_found->next;
-              release_memory (not_found);
+              release_small_memory (not_found,
+                                    KEY_ELEM_SIZE (not_found->key.nmemb));
               if (*found_key)
                 goto skip_advancement;
               else
@@ -5,7 +5,9 @@
 
 void     add_key_to_tag               (CacheTag, CacheKey);
 void     remove_key_from_tag          (CacheTag, CacheKey);
+bool     try_remove_key_from_tags     (CacheTag *, u8, CacheKey);
 void     walk_all_tags                (CacheTagWalkCb, void *);
+void     try_move_tag_keys            (void);
 KeyElem *get_keys_matching_any_tag    (CacheTag *, u8); // A.K.A. union
 KeyElem *get_keys_matching_all_tags   (CacheTag *, u8); // A.K.A. intersection
 void     release_key_list             (KeyElem *);
@@ -25,16 +25,36 @@ typedef uint16_t u16;
 typedef uint32_t u32;
 typedef uint64_t u64;
 
+// Spins for a while, then sleeps on a futex, see lock.c
+typedef _Atomic (u32) CacheLock;
+
 typedef struct
 {
   u8 *base;
   u32 nmemb;
+  u64 hash; // See `hash_bytes', the high half picks the map and the low the slot
 } CacheKey;
 
+// Values too big for a single bucket are stored in VALUE_CHUNK_SIZE chunks.
+// GET requests stream chunks to the client without holding the entry lock so
+// they are reference counted separately from the entry.
 typedef struct
 {
-  u8 *base;
+  _Atomic (u32) refs;
+  u32 nchunks;
+  u8 *chunks[];
+} ValueChunks;
+
+typedef struct
+{
+  union
+  {
+    u8          *base;   // If ! chunked
+    ValueChunks *chunks; // If chunked
+  };
   u32 nmemb;
+  bool chunked;
+  bool compressed; // See COMPRESSED VALUES below
 } CacheValue;
 
 typedef struct
@@ -48,6 +68,8 @@ typedef struct
   u8 *base;
   u32 nmemb;
   u32 cap;
+  ValueChunks *chunks; // Written instead of `base' if set, see server.c
+  bool compressed;     // Holds a compressed value, see COMPRESSED VALUES below
 } Payload;
 
 // Linked list
@@ -62,7 +84,7 @@ typedef struct _TagNode
 {
   CacheTag tag;
   KeyElem *keys;
-  atomic_flag keys_lock;
+  CacheLock keys_lock;
   _Atomic (u32) num_keys;
   _Atomic (struct _TagNode *) left;
   _Atomic (struct _TagNode *) right;
@@ -81,19 +103,58 @@ typedef struct
   CacheValue value;
   time_t mtime;
   time_t expires;
+  u32 expiry_second; // Of its record in the expiry wheel, 0 if none
   u32 nhits;
-  atomic_flag guard;
+  bool referenced; // CLOCK reference bit, see evict.c
+  CacheLock guard;
 } CacheEntry;
 
+typedef enum
+{
+  SLOT_EMPTY = 0, // Ends a probe
+  SLOT_USED,
+  SLOT_DELETED    // Tombstone, probes go on past it
+} SlotState;
+
+// Aligned so that the lock, hash and entry of a slot are always on the same
+// cache line, which it shares with one neighbour at most
+typedef struct
+{
+  u8 state; // SlotState
+  CacheLock guard;
+  u64 hash;  // Of the entry key, compared before the key itself
+  CacheEntry *entry;
+  u32 nmemb; // Of the entry key, so probes rarely need to look at the entry
+} __attribute__ ((aligned (CACHE_ENTRY_SLOT_ALIGNMENT))) CacheEntrySlot;
+
+// With GROUP_PROBING the `slots' are followed by one control byte per slot,
+// see entry.c
 typedef struct
 {
-  bool mask[CACHE_ENTRY_MAP_SIZE];
-  atomic_flag guards[CACHE_ENTRY_MAP_SIZE];
-  u32 hashes[CACHE_ENTRY_MAP_SIZE];
-  CacheEntry *entries[CACHE_ENTRY_MAP_SIZE];
+  u32 size; // Power of 2
+  _Atomic (u32) ntombstones;
+  void *memory; // As reserved, the table is cache line aligned within it
+  CacheEntrySlot slots[] __attribute__ ((aligned (CACHE_LINE_SIZE)));
+} CacheEntryTable;
+
+// Open addressing hash map that grows (and shrinks) with the number of entries.
+// A resize migrates the entries of `old' to `table' a few slots at a time,
+// see entry.c
+typedef struct
+{
+  _Atomic (CacheEntryTable *) table;
+  _Atomic (CacheEntryTable *) old;   // Being migrated to `table' if set
+  _Atomic (u32) count;
+  _Atomic (u32) nreaders;            // Threads using the tables
+  atomic_bool resizing;              // Tables are being swapped
+  _Atomic (u32) swaps;               // Odd while swapping, see `get_cache_entry'
+  CacheLock migrate_lock;            // Held to migrate, resize or walk
+  u32 migrate_pos;                   // Next slot of `old' to migrate
+  _Atomic (u32) clock_hand;          // Eviction sweep position, see evict.c
 } CacheEntryHashMap;
 
 typedef bool (*CacheEntryWalkCb) (CacheEntry *, void *);
+typedef CacheEntry *(*CacheEntryMoveCb) (CacheEntry *, void *);
 typedef void (*CacheTagWalkCb)   (CacheTag,     void *);
 
 typedef enum
@@ -139,6 +200,20 @@ typedef struct sockaddr    sockaddr_t;
 typedef struct sockaddr_in sockaddr_in_t;
 typedef struct epoll_event epoll_event_t;
 
+typedef enum
+{
+  HUGE_PAGES_NONE = 0,    // Regular pages only
+  HUGE_PAGES_TRANSPARENT, // madvise (MADV_HUGEPAGE)
+  HUGE_PAGES_EXPLICIT     // MAP_HUGETLB, falls back to transparent
+} HugePageMode;
+
+typedef enum
+{
+  PAGE_RELEASE_NONE = 0,  // Keep the pages of free buckets resident
+  PAGE_RELEASE_DONTNEED,  // madvise (MADV_DONTNEED), RSS drops right away
+  PAGE_RELEASE_FREE       // madvise (MADV_FREE), reclaimed under pressure
+} PageReleaseMode;
+
 struct _RuntimeConfig
 {
   in_addr_t listen_address;
@@ -151,6 +226,21 @@ struct _RuntimeConfig
   const char *memory_stats_filename;
   const char *client_stats_filename;
   const char *worker_stats_filename;
+  size_t memory_limit;
+  HugePageMode huge_pages;
+  PageReleaseMode release_pages;
+  size_t release_pages_above;
+  bool prefault_memory;
+  bool numa;
+  bool compaction;
+  bool compression;
+  size_t compression_above;
+  double index_load_factor;
+  u32 walk_threads;
+  bool active_expiry;
+  u32 active_expiry_delay;
+  bool admission;
+  size_t admission_sketch_size;
 };
 
 typedef struct
@@ -166,17 +256,21 @@ typedef struct
 {
   thrd_t    thread;
   u32       id;
+  u32       node; // NUMA node, see numa.c
   int       epfd;
   Payload   payload_buffer;
   LogQueue  log_queue;
   struct
   {
     u32 get;
+    u32 get_unlocked; // Of `get', see `try_get_unlocked'
     u32 set;
     u32 del;
     u32 clr;
     u32 lst;
     u32 nfo;
+    u32 compress;
+    u32 decompress;
   } counters;
   struct
   {
@@ -186,7 +280,14 @@ typedef struct
     u64 clr;
     u64 lst;
     u64 nfo;
+    u64 compress;
+    u64 decompress;
   } timers;
+  struct
+  {
+    u64 raw;    // Bytes of values we've tried to compress
+    u64 stored; // Bytes of them stored, compressed or not
+  } compression;
 } Worker;
 
 typedef struct
@@ -322,9 +423,18 @@ get_status_code_name (StatusCode code)
 // char[3]      0               'CiK' (Sanity)
 // char         3               'n'   (OP code)
 // u8           4               Key length
-// u8[11]       5               Padding
+// u8           5               Server info version (if key length = 0)
+// u8[10]       6               Padding
 // void *       16              (key)
 
+// :COMPRESSED VALUES
+// Values of at least `compression_above' bytes (see cik.conf) are stored
+// compressed when it pays off.  GET requests with GET_FLAG_ACCEPT_COMPRESSED
+// get those as they are stored, with COMPRESSED_BYTE as response status, and
+// SET requests with SET_FLAG_COMPRESSED store a value that's already compressed.
+// u32          0               Uncompressed length (network byte order)
+// ..data       4               (LZ4 block)
+
 #define CONTROL_BYTE_1 0x43 // 'C'
 #define CONTROL_BYTE_2 0x69 // 'i'
 #define CONTROL_BYTE_3 0x4B // 'K'
@@ -336,12 +446,18 @@ get_status_code_name (StatusCode code)
 #define CMD_BYTE_NFO   0x6E // 'n'
 #define SUCCESS_BYTE   0x74 // 't'
 #define FAILURE_BYTE   0x66 // 'f'
+#define COMPRESSED_BYTE 0x7A // 'z' (Success with a compressed payload)
 
-#define GET_FLAG_NONE           0x00
-#define GET_FLAG_IGNORE_EXPIRES 0x01
+#define GET_FLAG_NONE              0x00
+#define GET_FLAG_IGNORE_EXPIRES    0x01
+#define GET_FLAG_ACCEPT_COMPRESSED 0x02
 
-#define SET_FLAG_NONE           0x00
-#define SET_FLAG_ONLY_TTL       0x01
+#define SET_FLAG_NONE              0x00
+#define SET_FLAG_ONLY_TTL          0x01
+#define SET_FLAG_COMPRESSED        0x02
+
+#define NFO_VERSION_LEGACY      0x00 // u32 server counters
+#define NFO_VERSION_1           0x01 // u64 server counters
 
 typedef struct __attribute__((packed))
 {
@@ -384,7 +500,8 @@ typedef struct __attribute__((packed))
     struct __attribute__((packed))
     {
       u8 klen;
-      u8 _padding[11];
+      u8 version;
+      u8 _padding[10];
     } n;
   };
 } Request;
@@ -410,7 +527,8 @@ typedef struct __attribute__((packed))
    && (sizeof (request.l.ntags) == 1)           \
    && (sizeof (request.l._padding) == 10)       \
    && (sizeof (request.n.klen) == 1)            \
-   && (sizeof (request.n._padding) == 11)       \
+   && (sizeof (request.n.version) == 1)         \
+   && (sizeof (request.n._padding) == 10)       \
    && (offsetof (Request, cik) == 0)            \
    && (offsetof (Request, op) == 3)             \
    && (offsetof (Request, g.klen) == 4)         \
@@ -430,7 +548,8 @@ typedef struct __attribute__((packed))
    && (offsetof (Request, l.ntags) == 5)        \
    && (offsetof (Request, l._padding) == 6)     \
    && (offsetof (Request, n.klen) == 4)         \
-   && (offsetof (Request, n._padding) == 5)     \
+   && (offsetof (Request, n.version) == 5)      \
+   && (offsetof (Request, n._padding) == 6)     \
    )
 
 typedef struct __attribute__((packed))
@@ -454,7 +573,16 @@ typedef struct __attribute__((packed))
       u32 bytes_used;
       u32 bytes_free;
       u32 bytes_reused;
-    } server;
+    } server; // NFO_VERSION_LEGACY, counters saturate at 4 Gb
+    struct __attribute__((packed))
+    {
+      u8  version;
+      u8  _padding[7];
+      u64 bytes_reserved;
+      u64 bytes_used;
+      u64 bytes_free;
+      u64 bytes_reused;
+    } server_v1; // NFO_VERSION_1
     struct __attribute__((packed))
     {
       u64 expires;
@@ -4,10 +4,18 @@
 static tss_t key2str_buffer = (tss_t) -1;
 static tss_t tag2str_buffer = (tss_t) -1;
 
+#define STR_BUFFER_SIZE (sizeof (char) * 0x100)
+
+static void
+release_str_buffer (void *buffer)
+{
+  release_small_memory (buffer, STR_BUFFER_SIZE);
+}
+
 int init_util ()
 {
   int err;
-  err = tss_create (&key2str_buffer, release_memory);
+  err = tss_create (&key2str_buffer, release_str_buffer);
   cik_assert (err == thrd_success);
   cik_assert (key2str_buffer != (tss_t) -1);
   if (err != thrd_success)
@@ -15,7 +23,7 @@ int init_util ()
 
   tss_set (key2str_buffer, NULL);
 
-  err = tss_create (&tag2str_buffer, release_memory);
+  err = tss_create (&tag2str_buffer, release_str_buffer);
   cik_assert (err == thrd_success);
   cik_assert (tag2str_buffer != (tss_t) -1);
   if (err != thrd_success)
@@ -36,7 +44,7 @@ key2str (CacheKey key)
   buffer = tss_get (key2str_buffer);
   if (!buffer)
     {
-      buffer = reserve_memory (sizeof (char) * 0x100);
+      buffer = reserve_small_memory (STR_BUFFER_SIZE);
       tss_set (key2str_buffer, buffer);
     }
 
@@ -60,7 +68,7 @@ tag2str (CacheTag tag)
   buffer = tss_get (tag2str_buffer);
   if (!buffer)
     {
-      buffer = reserve_memory (sizeof (char) * 0x100);
+      buffer = reserve_small_memory (STR_BUFFER_SIZE);
       tss_set (tag2str_buffer, buffer);
     }
 
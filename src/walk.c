@@ -0,0 +1,197 @@
+#include <stdio.h>
+
+#include "entry.h"
+#include "lock.h"
+#include "memory.h"
+#include "walk.h"
+
+// Walks of the whole index, for CLR and LST requests that don't go by tag,
+// used to run on the requesting worker alone.  Now `walk_threads' helper
+// threads join it.  The maps are split into one range per thread and each
+// thread takes WALK_STEP_MAPS maps at a time from the front of its own range.
+// Once that's done it steals from the ranges of the others, so a thread that
+// hit big maps or busy locks doesn't hold up the rest.
+//
+// Callbacks run on all threads at once.  Thread `t' (the caller is 0) passes
+// them `data + t * data_size', so each can collect output of its own for the
+// caller to merge once the walk is done.  A `data_size' of 0 shares `data'.
+// Only one walk has the helpers at a time, any other walks on its own.
+// Entries the callbacks retire are released after each map, see memory.c.
+
+typedef struct
+{
+  _Atomic (u32) next; // First map not taken yet
+  u32 end;
+} __attribute__ ((aligned (CACHE_LINE_SIZE))) WalkRange;
+
+static struct
+{
+  atomic_flag busy;        // A walk has the helpers
+  _Atomic (u32) start;     // Bumped to start helpers on a walk
+  _Atomic (u32) nwalking;  // Helpers not done with the walk yet
+  atomic_bool stop;
+  CacheEntryWalkCb callback;
+  u8 *data;
+  size_t data_size;
+  u32 nthreads;            // Helpers and the caller
+  WalkRange ranges[MAX_WALK_THREADS + 1];
+} walk = {
+  .busy = ATOMIC_FLAG_INIT
+};
+
+static thrd_t helpers[MAX_WALK_THREADS];
+static u32    num_helpers = 0;
+
+static _Atomic (u64) num_walks = 0;
+static _Atomic (u64) num_parallel_walks = 0;
+static _Atomic (u64) num_stolen_maps = 0;
+
+static void
+walk_ranges (u32 self)
+{
+  void *data = walk.data + (self * walk.data_size);
+  u32   nstolen = 0;
+
+  for (u32 i = 0; i < walk.nthreads; ++i)
+    {
+      WalkRange *range = &walk.ranges[(self + i) % walk.nthreads];
+      for (;;)
+        {
+          u32 first = atomic_fetch_add_explicit (&range->next, WALK_STEP_MAPS,
+                                                 memory_order_relaxed);
+          u32 last  = first + WALK_STEP_MAPS;
+          if (first >= range->end)
+            break;
+          if (last > range->end)
+            last = range->end;
+          if (i > 0)
+            nstolen += last - first;
+          for (u32 m = first; m < last; ++m)
+            {
+              walk_entries (entry_maps[m], walk.callback, data);
+              release_retired_entries ();
+            }
+        }
+    }
+
+  if (nstolen)
+    atomic_fetch_add_explicit (&num_stolen_maps, nstolen,
+                               memory_order_relaxed);
+}
+
+static int
+run_walk_thread (void *arg)
+{
+  u32 self  = (u32) (uintptr_t) arg;
+  u32 start = 0;
+
+  for (;;)
+    {
+      wait_for_change (&walk.start, start);
+      start = atomic_load (&walk.start);
+
+      if (atomic_load (&walk.stop))
+        break;
+
+      walk_ranges (self);
+
+      if (atomic_fetch_sub (&walk.nwalking, 1) == 1)
+        wake_all_waiters (&walk.nwalking);
+    }
+
+  return thrd_success;
+}
+
+int
+start_walk_threads (const RuntimeConfig *config)
+{
+  cik_assert (config->walk_threads <= MAX_WALK_THREADS);
+
+  atomic_init (&walk.start, 0);
+  atomic_init (&walk.nwalking, 0);
+  atomic_init (&walk.stop, false);
+
+  for (u32 i = 0; i < config->walk_threads; ++i)
+    {
+      if (thrd_create (&helpers[i], (thrd_start_t) run_walk_thread,
+                       (void *) (uintptr_t) (i + 1)) != thrd_success)
+        return -1;
+      ++num_helpers;
+    }
+
+  return 0;
+}
+
+void
+stop_walk_threads (void)
+{
+  atomic_store (&walk.stop, true);
+  atomic_fetch_add (&walk.start, 1);
+  wake_all_waiters (&walk.start);
+
+  for (u32 i = 0; i < num_helpers; ++i)
+    thrd_join (helpers[i], NULL);
+
+  num_helpers = 0;
+}
+
+// Threads that may call back at once during `walk_all_entries', which is how
+// many `data' elements it needs
+u32
+get_num_walk_threads (void)
+{
+  return num_helpers + 1;
+}
+
+// Call `callback' for every entry of the index, see `walk_entries'
+void
+walk_all_entries (CacheEntryWalkCb callback, void *data, size_t data_size)
+{
+  atomic_fetch_add_explicit (&num_walks, 1, memory_order_relaxed);
+
+  if ((num_helpers == 0)
+      || atomic_flag_test_and_set_explicit (&walk.busy, memory_order_acquire))
+    {
+      for (u32 i = 0; i < NUM_CACHE_ENTRY_MAPS; ++i)
+        {
+          walk_entries (entry_maps[i], callback, data);
+          release_retired_entries ();
+        }
+      return;
+    }
+
+  atomic_fetch_add_explicit (&num_parallel_walks, 1, memory_order_relaxed);
+
+  walk.callback  = callback;
+  walk.data      = data;
+  walk.data_size = data_size;
+  walk.nthreads  = num_helpers + 1;
+  for (u32 t = 0; t < walk.nthreads; ++t)
+    {
+      atomic_store_explicit (&walk.ranges[t].next,
+                             (t * NUM_CACHE_ENTRY_MAPS) / walk.nthreads,
+                             memory_order_relaxed);
+      walk.ranges[t].end = ((t + 1) * NUM_CACHE_ENTRY_MAPS) / walk.nthreads;
+    }
+  atomic_store (&walk.nwalking, num_helpers);
+
+  atomic_fetch_add (&walk.start, 1);
+  wake_all_waiters (&walk.start);
+
+  walk_ranges (0);
+
+  for (u32 n; (n = atomic_load (&walk.nwalking)) != 0;)
+    wait_for_change (&walk.nwalking, n);
+
+  atomic_flag_clear_explicit (&walk.busy, memory_order_release);
+}
+
+void
+write_walk_stats (int fd)
+{
+  dprintf (fd, "\n%s\t%s\t%s\t%s\n",
+           "WalkThreads", "Walks", "ParallelWalks", "StolenMaps");
+  dprintf (fd, "%u\t%lu\t%lu\t%lu\n", num_helpers,
+           atomic_load (&num_walks), atomic_load (&num_parallel_walks),
+           atomic_load (&num_stolen_maps));
+}
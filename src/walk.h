@@ -0,0 +1,12 @@
+#ifndef WALK_H
+#define WALK_H 1
+
+#include "types.h"
+
+int  start_walk_threads   (const RuntimeConfig *);
+void stop_walk_threads    (void);
+u32  get_num_walk_threads (void);
+void walk_all_entries     (CacheEntryWalkCb, void *, size_t);
+void write_walk_stats     (int);
+
+#endif /* ! WALK_H */